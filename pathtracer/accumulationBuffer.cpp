@@ -0,0 +1,148 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "accumulationBuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+#include <textures/image.h>
+
+//--------------------------------------------------------------------------------------------------
+AccumulationBuffer::AccumulationBuffer(size_t width, size_t height)
+	: mWidth(width)
+	, mHeight(height)
+	, mPixels(width * height)
+{}
+
+//--------------------------------------------------------------------------------------------------
+float AccumulationBuffer::meanVariance(size_t x, size_t y) const
+{
+	const auto& p = mPixels[x + y * mWidth];
+	const float n = float(p.numSamples);
+	const float mean = p.numSamples ? luminance(p.sum) / n : 0.f;
+	if(p.numSamples < 2)
+		return mean * mean;
+
+	const float variance = std::max(0.f, (p.luminanceSqSum / n - mean * mean) * n / (n - 1));
+	return variance / n;
+}
+
+//--------------------------------------------------------------------------------------------------
+float AccumulationBuffer::relativeError(size_t x, size_t y) const
+{
+	const auto& p = mPixels[x + y * mWidth];
+	if(p.numSamples < 2)
+		return std::numeric_limits<float>::infinity();
+
+	const float mean = luminance(p.sum) / float(p.numSamples);
+	const float standardError = std::sqrt(meanVariance(x, y));
+	// Keep almost black pixels from dominating the estimate
+	constexpr float kMinLuminance = 1e-3f;
+	return standardError / std::max(mean, kMinLuminance);
+}
+
+//--------------------------------------------------------------------------------------------------
+float AccumulationBuffer::meanRelativeError() const
+{
+	double totalError = 0;
+	for(size_t y = 0; y < mHeight; ++y)
+		for(size_t x = 0; x < mWidth; ++x)
+			totalError += relativeError(x, y);
+	return float(totalError / (mWidth * mHeight));
+}
+
+//--------------------------------------------------------------------------------------------------
+void AccumulationBuffer::resolve(Image& dst) const
+{
+	for(size_t y = 0; y < mHeight; ++y)
+		for(size_t x = 0; x < mWidth; ++x)
+			dst.pixel(x, y) = mean(x, y);
+}
+
+//--------------------------------------------------------------------------------------------------
+size_t AccumulationBuffer::selectNoisyPixels(float threshold, size_t maxPixels, std::vector<uint8_t>& mask) const
+{
+	mask.assign(mPixels.size(), 0);
+
+	std::vector<std::pair<float, uint32_t>> noisyPixels;
+	for(size_t y = 0; y < mHeight; ++y)
+		for(size_t x = 0; x < mWidth; ++x)
+		{
+			auto error = relativeError(x, y);
+			if(error > threshold)
+				noisyPixels.push_back({ error, uint32_t(x + y * mWidth) });
+		}
+
+	// Not enough budget for all of them. Keep the noisiest
+	if(noisyPixels.size() > maxPixels)
+	{
+		std::nth_element(noisyPixels.begin(), noisyPixels.begin() + maxPixels, noisyPixels.end(), [](auto& a, auto& b) {
+			return a.first > b.first;
+		});
+		noisyPixels.resize(maxPixels);
+	}
+
+	for(auto& p : noisyPixels)
+		mask[p.second] = 1;
+	return noisyPixels.size();
+}
+
+//--------------------------------------------------------------------------------------------------
+uint64_t AccumulationBuffer::totalSamples() const
+{
+	return std::accumulate(mPixels.begin(), mPixels.end(), uint64_t(0), [](uint64_t n, const Pixel& p) { return n + p.numSamples; });
+}
+
+//--------------------------------------------------------------------------------------------------
+uint32_t AccumulationBuffer::minSamples() const
+{
+	uint32_t n = std::numeric_limits<uint32_t>::max();
+	for(auto& p : mPixels)
+		n = std::min(n, p.numSamples);
+	return mPixels.empty() ? 0 : n;
+}
+
+//--------------------------------------------------------------------------------------------------
+uint32_t AccumulationBuffer::maxSamples() const
+{
+	uint32_t n = 0;
+	for(auto& p : mPixels)
+		n = std::max(n, p.numSamples);
+	return n;
+}
+
+//--------------------------------------------------------------------------------------------------
+void AccumulationBuffer::sampleCountHeatmap(Image& dst) const
+{
+	const float minN = float(minSamples());
+	const float range = std::max(1.f, float(maxSamples()) - minN);
+	for(size_t y = 0; y < mHeight; ++y)
+		for(size_t x = 0; x < mWidth; ++x)
+		{
+			// Black to red to yellow to white
+			auto t = 3 * (mPixels[x + y * mWidth].numSamples - minN) / range;
+			dst.pixel(x, y) = math::Vec3f(
+				std::clamp(t, 0.f, 1.f),
+				std::clamp(t - 1, 0.f, 1.f),
+				std::clamp(t - 2, 0.f, 1.f));
+		}
+}
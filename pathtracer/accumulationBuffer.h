@@ -0,0 +1,95 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <math/vector.h>
+
+class Image;
+
+// Running sums of the radiance samples of each pixel.
+// Lets renders be refined over several passes, and estimates how noisy each pixel still is.
+class AccumulationBuffer
+{
+public:
+	AccumulationBuffer(size_t width, size_t height);
+
+	size_t width() const { return mWidth; }
+	size_t height() const { return mHeight; }
+
+	// Different pixels can be written concurrently, but each pixel must only be written by one thread at a time
+	void addSample(size_t x, size_t y, const math::Vec3f& radiance)
+	{
+		auto& p = mPixels[x + y * mWidth];
+		p.sum += radiance;
+		auto l = luminance(radiance);
+		p.luminanceSqSum += l * l;
+		++p.numSamples;
+	}
+
+	uint32_t numSamples(size_t x, size_t y) const { return mPixels[x + y * mWidth].numSamples; }
+
+	math::Vec3f mean(size_t x, size_t y) const
+	{
+		const auto& p = mPixels[x + y * mWidth];
+		return p.numSamples ? p.sum / float(p.numSamples) : math::Vec3f(0.f);
+	}
+
+	// Variance of the pixel's mean luminance. Pixels with less than two samples are assumed to be as noisy as they are bright
+	float meanVariance(size_t x, size_t y) const;
+	// Standard error of the pixel's mean luminance, relative to the mean.
+	// Infinite for pixels with less than two samples.
+	float relativeError(size_t x, size_t y) const;
+	// Average of relativeError over the whole image
+	float meanRelativeError() const;
+
+	// Marks in mask the pixels whose relative error is above threshold, up to maxPixels of them (the noisiest ones).
+	// Returns the number of marked pixels.
+	size_t selectNoisyPixels(float threshold, size_t maxPixels, std::vector<uint8_t>& mask) const;
+
+	uint64_t totalSamples() const;
+	uint32_t minSamples() const;
+	uint32_t maxSamples() const;
+	// Shows the number of samples taken by each pixel, from black (fewest) to white (most)
+	void sampleCountHeatmap(Image& dst) const;
+
+	// Writes the mean of each pixel
+	void resolve(Image& dst) const;
+
+	static float luminance(const math::Vec3f& c)
+	{
+		return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+	}
+
+private:
+	struct Pixel
+	{
+		math::Vec3f sum = math::Vec3f(0.f);
+		float luminanceSqSum = 0.f;
+		uint32_t numSamples = 0;
+	};
+
+	size_t mWidth;
+	size_t mHeight;
+	std::vector<Pixel> mPixels;
+};
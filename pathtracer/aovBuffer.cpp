@@ -0,0 +1,174 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "aovBuffer.h"
+
+#include <cassert>
+#include <iterator>
+#include <sstream>
+
+#include "accumulationBuffer.h"
+#include <textures/image.h>
+
+namespace {
+	constexpr const char* kChannelNames[] = { "albedo", "normal", "depth", "id", "samples" };
+}
+
+//--------------------------------------------------------------------------------------------------
+uint32_t AovBuffer::parseChannels(const std::string& names)
+{
+	uint32_t channels = 0;
+	std::istringstream list(names);
+	std::string name;
+	while(std::getline(list, name, ','))
+	{
+		uint32_t channel = 0;
+		for(uint32_t i = 0; i < std::size(kChannelNames); ++i)
+			if(name == kChannelNames[i])
+				channel = 1 << i;
+		if(!channel)
+			return 0;
+		channels |= channel;
+	}
+	return channels;
+}
+
+//--------------------------------------------------------------------------------------------------
+const char* AovBuffer::channelName(Channel channel)
+{
+	for(uint32_t i = 0; i < std::size(kChannelNames); ++i)
+		if(channel == 1u << i)
+			return kChannelNames[i];
+	return "";
+}
+
+//--------------------------------------------------------------------------------------------------
+void AovBuffer::Planes::allocate(size_t numPixels, uint32_t channels)
+{
+	if(channels & Albedo)
+		for(auto& plane : albedo)
+			plane.resize(numPixels, 0.f);
+	if(channels & Normal)
+		for(auto& plane : normal)
+			plane.resize(numPixels, 0.f);
+	if(channels & Depth)
+	{
+		depth.resize(numPixels, 0.f);
+		numHits.resize(numPixels, 0);
+	}
+	if(channels & InstanceId)
+		instanceId.resize(numPixels, 0);
+	numSamples.resize(numPixels, 0);
+}
+
+//--------------------------------------------------------------------------------------------------
+void AovBuffer::Planes::addSample(size_t i, const PrimaryHit* hit)
+{
+	if(hit)
+	{
+		for(int c = 0; c < 3 && !albedo[c].empty(); ++c)
+			albedo[c][i] += hit->albedo[c];
+		for(int c = 0; c < 3 && !normal[c].empty(); ++c)
+			normal[c][i] += hit->normal[c];
+		if(!depth.empty())
+		{
+			depth[i] += hit->depth;
+			++numHits[i];
+		}
+	}
+	// Ids can't be averaged. Keep the first one
+	if(!instanceId.empty() && numSamples[i] == 0)
+		instanceId[i] = hit ? hit->instanceId + 1 : 0;
+	++numSamples[i];
+}
+
+//--------------------------------------------------------------------------------------------------
+AovBuffer::AovBuffer(size_t width, size_t height, uint32_t channels)
+	: mWidth(width)
+	, mHeight(height)
+	, mChannels(channels)
+{
+	mPlanes.allocate(width * height, channels);
+}
+
+//--------------------------------------------------------------------------------------------------
+AovBuffer::Tile::Tile(const AovBuffer& parent, const math::Rectangle<size_t>& window)
+	: mWindow(window)
+{
+	mPlanes.allocate(window.area(), parent.mChannels);
+}
+
+//--------------------------------------------------------------------------------------------------
+void AovBuffer::add(const Tile& tile)
+{
+	const auto& src = tile.mPlanes;
+	const auto& window = tile.mWindow;
+	size_t i = 0;
+	for(size_t y = window.y0; y < window.y1; ++y)
+		for(size_t x = window.x0; x < window.x1; ++x, ++i)
+		{
+			if(!src.numSamples[i])
+				continue;
+
+			const auto dst = x + y * mWidth;
+			for(int c = 0; c < 3 && !src.albedo[c].empty(); ++c)
+				mPlanes.albedo[c][dst] += src.albedo[c][i];
+			for(int c = 0; c < 3 && !src.normal[c].empty(); ++c)
+				mPlanes.normal[c][dst] += src.normal[c][i];
+			if(!src.depth.empty())
+			{
+				mPlanes.depth[dst] += src.depth[i];
+				mPlanes.numHits[dst] += src.numHits[i];
+			}
+			if(!src.instanceId.empty() && mPlanes.numSamples[dst] == 0)
+				mPlanes.instanceId[dst] = src.instanceId[i];
+			mPlanes.numSamples[dst] += src.numSamples[i];
+		}
+}
+
+//--------------------------------------------------------------------------------------------------
+void AovBuffer::resolve(Channel channel, const AccumulationBuffer& beauty, Image& dst) const
+{
+	assert(channel == SampleCount || has(channel));
+	for(size_t y = 0; y < mHeight; ++y)
+		for(size_t x = 0; x < mWidth; ++x)
+		{
+			const auto i = x + y * mWidth;
+			const float n = float(mPlanes.numSamples[i]);
+			auto& pixel = dst.pixel(x, y);
+			switch(channel)
+			{
+				case Albedo:
+					pixel = n > 0 ? math::Vec3f(mPlanes.albedo[0][i], mPlanes.albedo[1][i], mPlanes.albedo[2][i]) / n : math::Vec3f(0.f);
+					break;
+				case Normal:
+					pixel = n > 0 ? math::Vec3f(mPlanes.normal[0][i], mPlanes.normal[1][i], mPlanes.normal[2][i]) / n : math::Vec3f(0.f);
+					break;
+				case Depth:
+					pixel = math::Vec3f(mPlanes.numHits[i] ? mPlanes.depth[i] / mPlanes.numHits[i] : 0.f);
+					break;
+				case InstanceId:
+					pixel = math::Vec3f(float(mPlanes.instanceId[i]));
+					break;
+				case SampleCount:
+					pixel = math::Vec3f(float(beauty.numSamples(x, y)));
+					break;
+			}
+		}
+}
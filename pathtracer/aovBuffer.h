@@ -0,0 +1,114 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <math/rectangle.h>
+#include <math/vector.h>
+
+class AccumulationBuffer;
+class Image;
+
+// Surface features at the first hit of a camera ray
+struct PrimaryHit
+{
+	math::Vec3f albedo;
+	math::Vec3f normal; // World space, facing the camera
+	float depth; // Distance from the camera
+	uint32_t instanceId;
+};
+
+// Arbitrary output variables: auxiliary per pixel channels, rendered in the same pass as the beauty image
+// and used for compositing and denoising.
+// Each channel is stored in its own planes, and only the requested channels are allocated.
+class AovBuffer
+{
+public:
+	enum Channel : uint32_t
+	{
+		Albedo = 1 << 0,
+		Normal = 1 << 1,
+		Depth = 1 << 2, // Average over the samples that hit something. 0 for the background
+		InstanceId = 1 << 3, // Instance index + 1 seen by the first sample of the pixel. 0 for the background
+		SampleCount = 1 << 4, // Read from the beauty accumulation buffer
+	};
+	static constexpr uint32_t kAllChannels = (SampleCount << 1) - 1;
+
+	// Parses a comma separated list of channel names, as returned by channelName. Returns 0 if any name is unknown
+	static uint32_t parseChannels(const std::string& names);
+	static const char* channelName(Channel);
+
+	AovBuffer(size_t width, size_t height, uint32_t channels);
+
+	uint32_t channels() const { return mChannels; }
+	bool has(Channel c) const { return (mChannels & c) != 0; }
+
+private:
+	// Per pixel sums of the samples. Each component of each channel gets its own plane. Planes of disabled channels are empty
+	struct Planes
+	{
+		void allocate(size_t numPixels, uint32_t channels);
+		void addSample(size_t i, const PrimaryHit* hit);
+
+		std::vector<float> albedo[3];
+		std::vector<float> normal[3];
+		std::vector<float> depth;
+		std::vector<uint32_t> instanceId;
+		std::vector<uint32_t> numHits;
+		std::vector<uint32_t> numSamples;
+	};
+
+public:
+	// Samples of a single tile, summed locally so the image planes are only written once per tile
+	class Tile
+	{
+	public:
+		Tile(const AovBuffer& parent, const math::Rectangle<size_t>& window);
+
+		// hit is null for samples that miss the scene
+		void addSample(size_t x, size_t y, const PrimaryHit* hit)
+		{
+			mPlanes.addSample((x - mWindow.x0) + (y - mWindow.y0) * (mWindow.x1 - mWindow.x0), hit);
+		}
+
+	private:
+		friend class AovBuffer;
+		math::Rectangle<size_t> mWindow;
+		Planes mPlanes;
+	};
+
+	// Adds the samples of a tile to the image. Different tiles can be added concurrently if they don't overlap
+	void add(const Tile& tile);
+	// Adds a single sample. Each pixel must only be written by one thread at a time
+	void addSample(size_t x, size_t y, const PrimaryHit* hit) { mPlanes.addSample(x + y * mWidth, hit); }
+
+	// Writes the pixel averages of a channel. Scalar channels are replicated in all three components
+	void resolve(Channel, const AccumulationBuffer& beauty, Image& dst) const;
+
+private:
+	size_t mWidth;
+	size_t mHeight;
+	uint32_t mChannels;
+	Planes mPlanes;
+};
@@ -22,16 +22,36 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
+#include <math/constants.h>
+#include <math/distribution.h>
 #include <math/vector.h>
+#include <sampler.h>
 #include <textures/image.h>
 #include <textures/textureSampler.h>
 #include <cmath>
+#include <memory>
+#include <vector>
 
 //--------------------------------------------------------------------------------------------------
 class Background
 {
 public:
 	virtual math::Vec3f sample(const math::Vec3f& dir) const = 0;
+
+	// Picks a direction to gather light from, and returns the light coming from it.
+	// pdf is the solid angle density of choosing dir. By default, all directions are equally likely.
+	virtual math::Vec3f sampleDirection(Sampler& sampler, math::Vec3f& dir, float& pdf) const
+	{
+		dir = sampler.unitVector();
+		pdf = 1.f / (2 * math::TwoPi);
+		return sample(dir);
+	}
+
+	// Density of sampleDirection choosing dir
+	virtual float pdf(const math::Vec3f& /*dir*/) const
+	{
+		return 1.f / (2 * math::TwoPi);
+	}
 };
 
 //--------------------------------------------------------------------------------------------------
@@ -58,8 +78,27 @@ class HDRBackground : public Background
 {
 public:
 	HDRBackground(const char* fileName)
-		: mSampler(fileName)
+		: HDRBackground(std::make_shared<Image>(fileName))
+	{}
+
+	// Directions are importance sampled by the luminance of the image.
+	HDRBackground(std::shared_ptr<Image> image)
+		: mSampler(image)
 	{
+		// Pixels near the poles cover less solid angle, so they are scaled by sin(theta)
+		const auto width = image->width();
+		const auto height = image->height();
+		std::vector<float> weights(width * height);
+		for(size_t y = 0; y < height; ++y)
+		{
+			const float sinTheta = std::sin(math::Pi * (y + 0.5f) / height);
+			for(size_t x = 0; x < width; ++x)
+			{
+				auto& c = image->pixel(x, y);
+				weights[x + y * width] = sinTheta * (0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z());
+			}
+		}
+		mDistribution = math::Distribution2D(weights.data(), width, height);
 	}
 
 	math::Vec3f sample(const math::Vec3f& direction) const override
@@ -69,16 +108,40 @@ public:
 		return mSampler.sample(uv);
 	}
 
+	math::Vec3f sampleDirection(Sampler& sampler, math::Vec3f& dir, float& pdf) const override
+	{
+		float uvPdf;
+		auto u = sampler.next2D();
+		auto uv = mDistribution.sample(u.x(), u.y(), uvPdf);
+
+		// Inverse of sampleSpherical
+		const float theta = uv.y() * math::Pi;
+		const float phi = (uv.x() - 0.5f) * math::TwoPi;
+		const float sinTheta = std::sin(theta);
+		dir = math::Vec3f(-sinTheta * std::cos(phi), std::cos(theta), sinTheta * std::sin(phi));
+		pdf = sinTheta > 0 ? uvPdf / (math::TwoPi * math::Pi * sinTheta) : 0.f;
+		return sample(dir);
+	}
+
+	float pdf(const math::Vec3f& dir) const override
+	{
+		const float sinTheta = std::sqrt(std::max(0.f, 1 - dir.y() * dir.y()));
+		if(!(sinTheta > 0))
+			return 0.f;
+		return mDistribution.pdf(sampleSpherical(dir)) / (math::TwoPi * math::Pi * sinTheta);
+	}
+
 private:
-	using Sampler = BilinearTextureSampler<RepeatWrap,ClampWrap>;
+	using ImageSampler = BilinearTextureSampler<RepeatWrap,ClampWrap>;
 
 	math::Vec2f sampleSpherical(const math::Vec3f& dir) const
 	{
 		return {
-			atan2(dir.z(), -dir.x()) * 0.1591f + 0.5f,
-			asin(-dir.y()) * 0.3183f + 0.5f
+			atan2(dir.z(), -dir.x()) / math::TwoPi + 0.5f,
+			asin(-dir.y()) / math::Pi + 0.5f
 		};
 	}
 
-	Sampler mSampler;
-};
\ No newline at end of file
+	ImageSampler mSampler;
+	math::Distribution2D mDistribution; // Luminance of the image, over uv space
+};
@@ -68,6 +68,32 @@ int CmdLineParams::process(const vector<string>& args, int i)
 		nThreads = atoi(args[i+1].c_str());
 		return 2;
 	}
+	if(arg == "-bounces")
+	{
+		maxBounces = atoi(args[i+1].c_str());
+		return 2;
+	}
+	if(arg == "-rouletteDepth")
+	{
+		rouletteDepth = atoi(args[i+1].c_str());
+		return 2;
+	}
+	if(arg == "-noNee")
+	{
+		sampleLights = false;
+		return 1;
+	}
+	if(arg == "-sampler")
+	{
+		auto& name = args[i+1];
+		if(name == "random")
+			sampler = Sampler::Type::Random;
+		else if(name == "sobol")
+			sampler = Sampler::Type::Sobol;
+		else if(name == "bluenoise")
+			sampler = Sampler::Type::BlueNoise;
+		return 2;
+	}
 	if(arg == "-w")
 	{
 		sx = atoi(args[i+1].c_str());
@@ -88,6 +114,11 @@ int CmdLineParams::process(const vector<string>& args, int i)
 		tileSize = atoi(args[i+1].c_str());
 		return 2;
 	}
+	if(arg == "-hilbert")
+	{
+		hilbertTiles = true;
+		return 1;
+	}
 	if(arg == "-fullHD")
 	{
 		sx = 1920;
@@ -99,5 +130,80 @@ int CmdLineParams::process(const vector<string>& args, int i)
 		sphericalRender = true;
 		return 1;
 	}
+	if(arg == "-fastBvh")
+	{
+		fastBvh = true;
+		return 1;
+	}
+	if(arg == "-leafSize")
+	{
+		leafSize = atoi(args[i+1].c_str());
+		return 2;
+	}
+	if(arg == "-bvhCache")
+	{
+		bvhCache = args[i+1];
+		return 2;
+	}
+	if(arg == "-unorderedTraversal")
+	{
+		unorderedTraversal = true;
+		return 1;
+	}
+	if(arg == "-wavefront")
+	{
+		wavefront = true;
+		return 1;
+	}
+	if(arg == "-noPackets")
+	{
+		packets = false;
+		return 1;
+	}
+	if(arg == "-time")
+	{
+		maxTime = (float)atof(args[i+1].c_str());
+		return 2;
+	}
+	if(arg == "-noise")
+	{
+		noiseTarget = (float)atof(args[i+1].c_str());
+		return 2;
+	}
+	if(arg == "-writeInterval")
+	{
+		writeInterval = (float)atof(args[i+1].c_str());
+		return 2;
+	}
+	if(arg == "-adaptive")
+	{
+		adaptiveThreshold = (float)atof(args[i+1].c_str());
+		return 2;
+	}
+	if(arg == "-heatmap")
+	{
+		heatmap = args[i+1];
+		return 2;
+	}
+	if(arg == "-aov")
+	{
+		aovs = args[i+1];
+		return 2;
+	}
+	if(arg == "-denoise")
+	{
+		denoise = true;
+		return 1;
+	}
+	if(arg == "-pinThreads")
+	{
+		pinThreads = true;
+		return 1;
+	}
+	if(arg == "-numa")
+	{
+		numa = true;
+		return 1;
+	}
 	return 1;
 }
\ No newline at end of file
@@ -22,6 +22,8 @@
 #include <vector>
 #include <string>
 
+#include "sampler.h"
+
 struct CmdLineParams
 {
 	std::string scene;
@@ -29,12 +31,36 @@ struct CmdLineParams
 	std::string output = "render.png";
 	unsigned sx = 640;
 	unsigned sy = 480;
-	unsigned ns = 4;
+	unsigned ns = 4; // Samples per pixel, or per pass in progressive mode
 	unsigned nThreads = 4;
+	int maxBounces = 9;
+	int rouletteDepth = 3; // Bounces before paths can be ended by Russian roulette
+	bool sampleLights = true; // Sample the background directly at each bounce (next event estimation)
+	Sampler::Type sampler = Sampler::Type::Sobol; // Source of camera jitter and bounce directions: random, sobol or bluenoise
 	bool overrideMaterials = false;
 	float fov = 45.f;
 	unsigned tileSize = 20;
+	bool hilbertTiles = false; // Render tiles along a Hilbert curve instead of in scanline order
 	bool sphericalRender = false;
+	bool fastBvh = false; // Build BVHs from Morton codes instead of using the surface area heuristic
+	unsigned leafSize = 8; // Maximum triangles per BLAS leaf, from 1 to 8. Triangles in a leaf are tested together. Each leaf takes the space of 8 triangles, so 1 uses ~8x the leaf memory
+	std::string bvhCache; // Directory where built BLASes are stored, to be reused in later runs
+	bool unorderedTraversal = false; // Visit BVH children in storage order, instead of front to back
+	bool wavefront = false; // Use the wavefront integrator instead of tracing one path at a time
+	bool packets = true; // Trace primary rays in packets
+	bool pinThreads = false; // Pin each worker thread to a single core
+	bool numa = false; // Split workers among NUMA nodes, and give each node its own copy of the acceleration structures
+	// Progressive mode. Sample passes are added until one of the limits is reached
+	float maxTime = 0; // Seconds. 0 for no limit
+	float noiseTarget = 0; // Average relative error of the pixels. 0 for no limit
+	float writeInterval = 0; // Seconds between writes of intermediate images. 0 to only write the final image
+	// Adaptive sampling. Pixels stop taking samples once their relative error is below this. 0 to sample all pixels equally
+	float adaptiveThreshold = 0;
+	std::string heatmap; // If not empty, an image of the number of samples per pixel is written here
+	// Comma separated list of auxiliary outputs (albedo, normal, depth, id, samples), written next to the output image.
+	// Values are not clamped, so they are written as .pfm when the output is .pfm, and as .exr otherwise
+	std::string aovs;
+	bool denoise = false; // Filter the output image, guided by the albedo and normal AOVs
 
 public:
 	CmdLineParams(int _argc, const char** _argv);
@@ -22,6 +22,8 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
+#include <cstdint>
+
 #include <math/vector.h>
 
 class Material;
@@ -31,4 +33,7 @@ struct HitRecord
 	math::Vec3f p;
 	float t;
 	math::Vec3f normal;
+	math::Vec2f barycentrics; // Of the hit point in its triangle, as weights of the second and third vertices
+	uint32_t instanceId; // Index of the TLAS instance that was hit
+	uint32_t primitiveId; // Index of the triangle in the instance's mesh
 };
@@ -4,97 +4,228 @@
 #include "../shapes/triangle.h"
 #include "../math/matrix.h"
 #include "../math/vector.h"
+#include "../threadPool.h"
+
+#include <cassert>
+#include <istream>
+#include <ostream>
+#include <vector>
 
 class BLAS
 {
 public:
     BLAS() = default;
-    BLAS(const math::Vec3f* vertices, const uint16_t* indices, uint32_t numTris)
+    // Triangles are grouped in leafs of up to maxLeafSize, intersected together.
+    // Every leaf takes a whole Triangle8, so maxLeafSize 1 uses about 8 times the leaf memory of full leafs.
+    BLAS(const math::Vec3f* vertices, const uint32_t* indices, uint32_t numTris, CWBVH::BuildQuality quality = CWBVH::BuildQuality::Fast, ThreadPool* pool = nullptr,
+        uint32_t maxLeafSize = kDefaultLeafSize)
     {
-        build(vertices, indices, numTris);
+        build(vertices, indices, numTris, quality, pool, maxLeafSize);
     }
 
+    static constexpr uint32_t kDefaultLeafSize = 8;
+    static constexpr uint32_t kMaxLeafSize = Triangle8::kWidth;
+
     auto aabb() const { return m_bvh.aabb(); }
+    float sahCost() const { return m_bvh.sahCost(); }
+    uint32_t numTriangles() const { return m_numTriangles; }
+
+    // Leafs are stored right after the tree, at an aligned offset. See CWBVH::save
+    void save(std::ostream& out) const
+    {
+        m_bvh.save(out);
+
+        uint32_t counts[2] = { m_numTriangles, uint32_t(m_leafs.size()) };
+        out.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+        CWBVH::alignStream(out);
+        out.write(reinterpret_cast<const char*>(m_leafs.data()), m_leafs.size() * sizeof(Triangle8));
+    }
+
+    bool load(std::istream& in)
+    {
+        uint32_t counts[2];
+        if (!m_bvh.load(in) || !in.read(reinterpret_cast<char*>(counts), sizeof(counts)))
+            return false;
+
+        CWBVH::alignStream(in);
+        m_numTriangles = counts[0];
+        m_leafs.resize(counts[1]);
+        return bool(in.read(reinterpret_cast<char*>(m_leafs.data()), m_leafs.size() * sizeof(Triangle8)));
+    }
 
     // This method will assume you already checked against the AABB, and won't repeat that test.
-    bool closestHit(const math::Ray& ray, float tMax, uint32_t& closestHitId, float& tOut, math::Vec3f& outNormal) const
+    bool closestHit(const math::Ray& ray, float tMax, uint32_t& closestHitId, float& tOut, math::Vec3f& outNormal, math::Vec2f& outBarycentrics,
+        CWBVH::TraversalOrder order = CWBVH::TraversalOrder::FrontToBack) const
     {
         // Init traversal stack to the root
         auto implicitRay = ray.implicit();
-        auto simdRay = ray.simd();
-        CWBVH::TraversalState stack;
-        stack.reset(implicitRay, tMax);
+        CWBVH::TraversalState stack(m_bvh.maxDepth());
+        stack.reset(implicitRay, tMax, order);
+        WatertightRay watertightRay(ray);
 
-        uint32_t triangleHitId = uint32_t(-1);
+        uint32_t leafId;
+        const Triangle8* hitLeaf = nullptr;
+        int hitLane = -1;
 
-        while (m_bvh.continueTraverse(stack, triangleHitId))
+        while (m_bvh.continueTraverse(stack, leafId))
         {
             // Closest hit logic
-            float tHit = m_triangles[triangleHitId].hitNoBackface(simdRay);
-            if (tHit >= 0.f && tHit <= stack.tMax)
+            const auto& leaf = m_leafs[leafId];
+            float tHit;
+            auto lane = leaf.closestHit(watertightRay, stack.tMax, tHit, outBarycentrics);
+            if (lane >= 0)
             {
                 stack.tMax = tHit;
-                tOut = tHit;
-                outNormal = m_triangles[triangleHitId].mNormal;
-                closestHitId = triangleHitId;
+                hitLeaf = &leaf;
+                hitLane = lane;
             }
         }
 
-        return closestHitId != uint32_t(-1);
+        if (!hitLeaf)
+            return false;
+
+        tOut = stack.tMax;
+        outNormal = hitLeaf->laneNormal(hitLane);
+        closestHitId = hitLeaf->id[hitLane];
+        return true;
     }
 
-    float anyHit(const math::Ray& ray, float tMax)
+    // Closest hit for a packet of up to CWBVH::kPacketSize rays. Lanes not in activeMask are ignored.
+    // Returns the mask of lanes that hit, with their distance, normal, barycentrics and triangle in the out arrays.
+    uint32_t closestHit8(const math::Ray* rays, uint32_t activeMask, const float* tMax, float* tOut, math::Vec3f* outNormal, math::Vec2f* outBarycentrics,
+        uint32_t* outTriangleId, CWBVH::TraversalOrder order = CWBVH::TraversalOrder::FrontToBack) const
+    {
+        CWBVH::RayPacket packet;
+        WatertightRay watertightRays[CWBVH::kPacketSize];
+        for (uint32_t lanes = activeMask; lanes; lanes &= lanes - 1)
+        {
+            auto lane = std::countr_zero(lanes);
+            packet.setRay(lane, rays[lane], tMax[lane]);
+            watertightRays[lane] = WatertightRay(rays[lane]);
+        }
+
+        uint32_t hitMask = 0;
+        const Triangle8* hitLeaf[CWBVH::kPacketSize];
+        int hitLane[CWBVH::kPacketSize];
+        auto leafOp = [&](uint32_t leafId, uint32_t laneMask) {
+            const auto& leaf = m_leafs[leafId];
+            for (; laneMask; laneMask &= laneMask - 1)
+            {
+                auto lane = std::countr_zero(laneMask);
+                float tHit;
+                auto triangleLane = leaf.closestHit(watertightRays[lane], packet.tMax[lane], tHit, outBarycentrics[lane]);
+                if (triangleLane >= 0)
+                {
+                    packet.tMax[lane] = tHit;
+                    hitLeaf[lane] = &leaf;
+                    hitLane[lane] = triangleLane;
+                    hitMask |= 1 << lane;
+                }
+            }
+        };
+
+        m_bvh.closestHitPacket(packet, leafOp, order);
+
+        for (uint32_t lanes = hitMask; lanes; lanes &= lanes - 1)
+        {
+            auto lane = std::countr_zero(lanes);
+            tOut[lane] = packet.tMax[lane];
+            outNormal[lane] = hitLeaf[lane]->laneNormal(hitLane[lane]);
+            outTriangleId[lane] = hitLeaf[lane]->id[hitLane[lane]];
+        }
+        return hitMask;
+    }
+
+    // Returns true as soon as any triangle is found closer than tMax.
+    // Like closestHit, this won't check against the AABB.
+    bool anyHit(const math::Ray& ray, float tMax) const
     {
         // Init traversal stack to the root
         auto implicitRay = ray.implicit();
-        auto simdRay = ray.simd();
-        CWBVH::TraversalState stack;
+        CWBVH::TraversalState stack(m_bvh.maxDepth());
         stack.reset(implicitRay, tMax);
 
-        uint32_t triangleHitId;
+        WatertightRay watertightRay(ray);
 
-        while (m_bvh.continueTraverse(stack, triangleHitId))
+        uint32_t leafId;
+        alignas(32) float tHit[Triangle8::kWidth], uHit[Triangle8::kWidth], vHit[Triangle8::kWidth];
+
+        while (m_bvh.continueTraverse(stack, leafId))
         {
-            // Closest hit logic
-            float tHit = m_triangles[triangleHitId].hitNoBackface(simdRay);
-            if (tHit >= 0.f && tHit <= stack.tMax)
+            if (m_leafs[leafId].hit(watertightRay, stack.tMax, tHit, uHit, vHit))
             {
-                return tHit;
+                return true;
             }
         }
 
-        return -1;
+        return false;
     }
 
 private:
-    void build(const math::Vec3f* vertices, const uint16_t* indices, uint32_t numTris)
+    void build(const math::Vec3f* vertices, const uint32_t* indices, uint32_t numTris, CWBVH::BuildQuality quality, ThreadPool* pool, uint32_t maxLeafSize)
     {
+        assert(maxLeafSize > 0 && maxLeafSize <= kMaxLeafSize);
+
         // Compute triangles and its bounding boxes
-        m_triangles.reserve(numTris);
+        std::vector<Triangle> triangles(numTris);
         std::vector<math::AABB> aabbs(numTris);
 
-        for (uint32_t i = 0; i < numTris; ++i)
+        auto buildTriangles = [&](size_t begin, size_t end)
         {
-            auto& triBBox = aabbs[i];
-            triBBox.clear();
-            auto i0 = indices[3 * i + 0];
-            auto i1 = indices[3 * i + 1];
-            auto i2 = indices[3 * i + 2];
-
-            auto& v0 = vertices[i0];
-            auto& v1 = vertices[i1];
-            auto& v2 = vertices[i2];
-
-            auto t = Triangle(v0, v1, v2);
-            m_triangles.push_back(t.simd());
-            triBBox.add(v0);
-            triBBox.add(v1);
-            triBBox.add(v2);
-        }
+            for (size_t i = begin; i < end; ++i)
+            {
+                auto& triBBox = aabbs[i];
+                triBBox.clear();
+                auto i0 = indices[3 * i + 0];
+                auto i1 = indices[3 * i + 1];
+                auto i2 = indices[3 * i + 2];
+
+                auto& v0 = vertices[i0];
+                auto& v1 = vertices[i1];
+                auto& v2 = vertices[i2];
+
+                triangles[i] = Triangle(v0, v1, v2);
+                triBBox.add(v0);
+                triBBox.add(v1);
+                triBBox.add(v2);
+            }
+        };
+
+        if (pool)
+            pool->parallelFor(numTris, 1 << 12, buildTriangles);
+        else
+            buildTriangles(0, numTris);
+
+        m_bvh.build(aabbs, quality, pool, maxLeafSize);
+        m_numTriangles = numTris;
+
+        // Pack the triangles of each leaf together. With single triangle leafs, leaf ids are triangle ids,
+        // and 7 of the 8 lanes of each leaf stay empty
+        m_leafs.resize(maxLeafSize > 1 ? m_bvh.numLeafs() : numTris);
+        auto packLeafs = [&](size_t begin, size_t end)
+        {
+            for (size_t leafId = begin; leafId < end; ++leafId)
+            {
+                auto& leaf = m_leafs[leafId];
+                leaf = Triangle8();
+                if (maxLeafSize == 1)
+                {
+                    leaf.set(0, triangles[leafId], uint32_t(leafId));
+                    continue;
+                }
+                uint32_t lane = 0;
+                for (auto triangleId : m_bvh.leafObjects(uint32_t(leafId)))
+                    leaf.set(lane++, triangles[triangleId], triangleId);
+            }
+        };
 
-        m_bvh.build(aabbs);
+        if (pool)
+            pool->parallelFor(m_leafs.size(), 1 << 10, packLeafs);
+        else
+            packLeafs(0, m_leafs.size());
     }
 
     CWBVH m_bvh;
-    std::vector<Triangle::Simd> m_triangles; // I.e. bvh leafs
+    std::vector<Triangle8> m_leafs;
+    uint32_t m_numTriangles = 0;
 };
\ No newline at end of file
@@ -1,29 +1,33 @@
 #include "CWBVH.h"
 #include "BLAS.h"
+#include "radixSort.h"
 
 #include <math/aabb.h>
 #include <math/ray.h>
 #include <shapes/meshInstance.h>
 #include <math/vectorFloat.h>
+#include <threadPool.h>
 
-#include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <iostream>
+#include <istream>
+#include <ostream>
+#include <limits>
+#include <mutex>
+#include <numeric>
 
-template<uint32_t numSpaces, uint32_t numBits>
-uint32_t spaceBits(uint32_t x)
+// Spreads the lower 21 bits of v, leaving two zero bits between each of them
+uint64_t expandBits21(uint64_t v)
 {
-    uint32_t srcBitMask = 1;
-    uint32_t dstBitMask = 1;
-    uint32_t result = x & srcBitMask;
-
-    for (uint32_t i = 1; i < numBits; ++i)
-    {
-        srcBitMask <<= 1;
-        dstBitMask <<= 1 + numSpaces;
-        result += (x & srcBitMask) ? dstBitMask : 0;
-    }
-
-    return result;
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x001f00000000ffffull;
+    v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+    v = (v | (v << 8)) & 0x100f00f00f00f00full;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
 }
 
 // Returns the log2(p)+128 where p is the smallest power of two such that p > abs(x).
@@ -44,6 +48,27 @@ float floatFromExponent(uint8_t e)
     return x;
 }
 
+namespace
+{
+    // Trees with fewer leafs than this are always built on the calling thread
+    constexpr size_t kMinParallelBuildSize = 1 << 12;
+    // Minimum number of elements processed by each parallel task during construction
+    constexpr size_t kBuildGrainSize = 1 << 10;
+    // Slack on the distance where rays leave child boxes, so rounding can't cull boxes that are only touched
+    // at one point, like the flat boxes around axis aligned geometry (Ize 2013, Robust BVH Ray Traversal)
+    constexpr float kLeaveDistanceScale = 1.f + 2 * 3 * 0x1p-24f;
+
+    // Runs op(begin, end) over chunks of [0, n), in parallel when a pool is available and n is big enough
+    template<class Op>
+    void forEachChunk(ThreadPool* pool, size_t n, const Op& op)
+    {
+        if (pool && n >= kMinParallelBuildSize)
+            pool->parallelFor(n, kBuildGrainSize, op);
+        else
+            op(size_t(0), n);
+    }
+}
+
 // TODO: test this version against above code
 unsigned int expandBits(unsigned int v)
 {
@@ -74,18 +99,15 @@ math::Vec3f CWBVH::BranchNode::getLocalScale() const
 
 math::AABB CWBVH::BranchNode::getChildAABB(int childIndex) const
 {
-    const auto& compressed = childCompressedAABB[childIndex];
     // recover size
     math::Vec3f parentNormExtent = getLocalScale() / 255;
     math::Vec3f low = localOrigin;
-    low.x() += compressed.low[0] * parentNormExtent.x();
-    low.y() += compressed.low[1] * parentNormExtent.y();
-    low.z() += compressed.low[2] * parentNormExtent.z();
-
     math::Vec3f high = localOrigin;
-    high.x() += compressed.high[0] * parentNormExtent.x();
-    high.y() += compressed.high[1] * parentNormExtent.y();
-    high.z() += compressed.high[2] * parentNormExtent.z();
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        low[axis] += childLow[axis][childIndex] * parentNormExtent[axis];
+        high[axis] += childHigh[axis][childIndex] * parentNormExtent[axis];
+    }
 
     return math::AABB(low, high);
 }
@@ -99,18 +121,76 @@ void CWBVH::BranchNode::setChildAABB(const math::AABB& childAABB, int childIndex
     auto normMin = relMin / localExtent;
     auto normMax = relMax / localExtent;
 
-    // Quantize coordinates
-    CompressedAABB aabb;
-    aabb.low[0] = uint8_t(normMin.x() * 255);
-    aabb.low[1] = uint8_t(normMin.y() * 255);
-    aabb.low[2] = uint8_t(normMin.z() * 255);
+    // Quantize coordinates conservatively
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        childLow[axis][childIndex] = uint8_t(std::clamp(normMin[axis] * 255, 0.f, 255.f));
+        childHigh[axis][childIndex] = uint8_t(std::clamp((normMax[axis] * 255) + 1, 0.f, 255.f));
+    }
+    childValidMask |= 1 << childIndex;
+}
+
+uint32_t CWBVH::BranchNode::intersectChildren(const math::Ray::Implicit& r, float tMax) const
+{
+    static_assert(kWidth == 8, "Child intersection is vectorized for 8 children");
 
-    aabb.high[0] = (uint8_t)std::min((normMax.x() * 255)+1, 255.f);
-    aabb.high[1] = (uint8_t)std::min((normMax.y() * 255)+1, 255.f);
-    aabb.high[2] = (uint8_t)std::min((normMax.z() * 255)+1, 255.f);
+    // Decompress all children at once. Along each axis:
+    // t = (localOrigin + q * scale - r.o) * r.n = q * (scale * r.n) + (localOrigin - r.o) * r.n
+    auto localScale = getLocalScale() / 255;
+    math::float8 tEnter(0.f);
+    math::float8 tLeave(tMax);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        auto qLow = math::float8::fromBytes(childLow[axis]);
+        auto qHigh = math::float8::fromBytes(childHigh[axis]);
+        math::float8 scale(localScale[axis] * r.n[axis]);
+        math::float8 offset((localOrigin[axis] - r.o[axis]) * r.n[axis]);
+        auto t1 = qLow.mul_add(scale, offset);
+        auto t2 = qHigh.mul_add(scale, offset);
+        // Keep the accumulated value as the second operand, so NaNs get discarded
+        tEnter = math::max(math::min(t1, t2), tEnter);
+        tLeave = math::min(math::max(t2, t1), tLeave);
+    }
 
-    // Store compressed in the index
-    childCompressedAABB[childIndex] = aabb;
+    return (tEnter <= tLeave * math::float8(kLeaveDistanceScale)).mask() & childValidMask;
+}
+
+uint64_t CWBVH::BranchNode::intersectChildren(const RayPacket& packet, uint32_t laneMask) const
+{
+    static_assert(kPacketSize == 8, "Packet intersection is vectorized for 8 lanes");
+
+    math::float8 origin[3];
+    math::float8 invDir[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        origin[axis] = math::float8(packet.origin[axis]);
+        invDir[axis] = math::float8(packet.invDir[axis]);
+    }
+    const math::float8 tMax(packet.tMax);
+
+    // Test each child against all lanes at once
+    auto localScale = getLocalScale() / 255;
+    uint64_t childLaneMask = 0;
+    for (uint32_t validMask = childValidMask; validMask; validMask &= validMask - 1)
+    {
+        auto child = std::countr_zero(validMask);
+        math::float8 tEnter(0.f);
+        math::float8 tLeave = tMax;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            math::float8 low(localOrigin[axis] + childLow[axis][child] * localScale[axis]);
+            math::float8 high(localOrigin[axis] + childHigh[axis][child] * localScale[axis]);
+            auto t1 = (low - origin[axis]) * invDir[axis];
+            auto t2 = (high - origin[axis]) * invDir[axis];
+            // Keep the accumulated value as the second operand, so NaNs get discarded
+            tEnter = math::max(math::min(t1, t2), tEnter);
+            tLeave = math::min(math::max(t2, t1), tLeave);
+        }
+
+        childLaneMask |= uint64_t((tEnter <= tLeave * math::float8(kLeaveDistanceScale)).mask() & laneMask) << (8 * child);
+    }
+
+    return childLaneMask;
 }
 
 // Out of line constructor for smart pointers
@@ -121,21 +201,21 @@ CWBVH::CWBVH()
 CWBVH::~CWBVH()
 {}
 
-int CWBVH::findSplit(uint32_t* sortedMortonCodes,
+int CWBVH::findSplit(uint64_t* sortedMortonCodes,
     int           first,
     int           last)
 {
     // Identical Morton codes => split the range in the middle.
 
-    unsigned int firstCode = sortedMortonCodes[first];
-    unsigned int lastCode = sortedMortonCodes[last];
+    uint64_t firstCode = sortedMortonCodes[first];
+    uint64_t lastCode = sortedMortonCodes[last];
 
     if (firstCode == lastCode)
         return (first + last) >> 1;
 
     // Calculate the number of highest bits that are the same
     // for all objects, using the count-leading-zeros intrinsic.
-    int commonPrefix = __lzcnt(firstCode ^ lastCode);
+    int commonPrefix = int(__lzcnt64(firstCode ^ lastCode));
 
     // Use binary search to find where the next bit differs.
     // Specifically, we are looking for the highest object that
@@ -151,8 +231,8 @@ int CWBVH::findSplit(uint32_t* sortedMortonCodes,
 
         if (newSplit < last)
         {
-            unsigned int splitCode = sortedMortonCodes[newSplit];
-            int splitPrefix = __lzcnt(firstCode ^ splitCode);
+            uint64_t splitCode = sortedMortonCodes[newSplit];
+            int splitPrefix = int(__lzcnt64(firstCode ^ splitCode));
             if (splitPrefix > commonPrefix)
                 split = newSplit; // accept proposal
         }
@@ -163,7 +243,7 @@ int CWBVH::findSplit(uint32_t* sortedMortonCodes,
 
 uint32_t CWBVH::generateHierarchy(
     const math::AABB* sortedLeafAABBs,
-    uint32_t* sortedMortonCodes,
+    uint64_t* sortedMortonCodes,
     uint32_t* sortedObjectIDs,
     int           first,
     int           last,
@@ -179,7 +259,7 @@ uint32_t CWBVH::generateHierarchy(
 
     // Process the resulting sub-ranges recursively.
     math::AABB bboxA, bboxB;
-    auto branch = &m_internalNodes[branchNdx];
+    auto branch = &m_binaryNodes[branchNdx];
 
     if (first == split)
     {
@@ -206,21 +286,420 @@ uint32_t CWBVH::generateHierarchy(
     }
 
     treeBB = math::AABB(bboxA, bboxB);
-    branch->setLocalAABB(treeBB);
-    branch->setChildAABB(bboxA, 0);
-    branch->setChildAABB(bboxB, 1);
+    branch->childAABB[0] = bboxA;
+    branch->childAABB[1] = bboxB;
     return branchNdx;
 }
 
+int CWBVH::findSplitSAH(
+    std::span<const math::AABB> leafAABBs,
+    const math::Vec3f* leafCenters,
+    uint32_t* objectIDs,
+    int           first,
+    int           last)
+{
+    // Bin centroids along their widest ranges
+    math::AABB centroidBounds;
+    centroidBounds.clear();
+    for (int i = first; i <= last; ++i)
+        centroidBounds.add(leafCenters[objectIDs[i]]);
+
+    auto centroidExtent = centroidBounds.size();
+
+    // Identical centroids => split the range in the middle.
+    if (!(centroidExtent.x() > 0) && !(centroidExtent.y() > 0) && !(centroidExtent.z() > 0))
+        return (first + last) >> 1;
+
+    constexpr int kNumBins = 16;
+    struct Bin
+    {
+        math::AABB bounds;
+        int count;
+    };
+
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestAxis = -1;
+    int bestBin = -1;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (!(centroidExtent[axis] > 0))
+            continue;
+
+        // Fill in the bins
+        Bin bins[kNumBins];
+        for (auto& bin : bins)
+        {
+            bin.bounds.clear();
+            bin.count = 0;
+        }
+
+        const float binScale = kNumBins / centroidExtent[axis];
+        const float axisMin = centroidBounds.min()[axis];
+        for (int i = first; i <= last; ++i)
+        {
+            auto id = objectIDs[i];
+            int b = std::min(int((leafCenters[id][axis] - axisMin) * binScale), kNumBins - 1);
+            bins[b].bounds = math::AABB(bins[b].bounds, leafAABBs[id]);
+            bins[b].count++;
+        }
+
+        // Sweep from the right to get the cost of all possible right partitions
+        float rightArea[kNumBins];
+        int rightCount[kNumBins];
+        math::AABB accumBounds;
+        accumBounds.clear();
+        int accumCount = 0;
+        for (int b = kNumBins - 1; b > 0; --b)
+        {
+            accumBounds = math::AABB(accumBounds, bins[b].bounds);
+            accumCount += bins[b].count;
+            rightArea[b] = accumCount ? accumBounds.area() : 0.f;
+            rightCount[b] = accumCount;
+        }
+
+        // Sweep from the left and evaluate each split plane
+        accumBounds.clear();
+        accumCount = 0;
+        for (int b = 0; b < kNumBins - 1; ++b)
+        {
+            accumBounds = math::AABB(accumBounds, bins[b].bounds);
+            accumCount += bins[b].count;
+            if (accumCount == 0 || rightCount[b + 1] == 0)
+                continue;
+
+            float cost = accumCount * accumBounds.area() + rightCount[b + 1] * rightArea[b + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    assert(bestAxis >= 0 && "There is always a valid split along an axis with non zero extent");
+
+    // Partition leafs around the best plane
+    const float binScale = kNumBins / centroidExtent[bestAxis];
+    const float axisMin = centroidBounds.min()[bestAxis];
+    auto mid = std::partition(objectIDs + first, objectIDs + last + 1, [&](uint32_t id) {
+        int b = std::min(int((leafCenters[id][bestAxis] - axisMin) * binScale), kNumBins - 1);
+        return b <= bestBin;
+        });
+
+    return int(mid - objectIDs) - 1;
+}
+
+void CWBVH::generateHierarchySAH(
+    std::span<const math::AABB> leafAABBs,
+    const math::Vec3f* leafCenters,
+    uint32_t* objectIDs,
+    int           first,
+    int           last,
+    uint32_t      branchNdx,
+    math::AABB& treeBB,
+    std::vector<SAHSubtree>* deferredSubtrees,
+    int maxSubtreeSize
+)
+{
+    assert(first != last && "Leafs are supposed to be solved in the parent node");
+
+    // Determine where to split the range. This also sorts the objects in the range.
+    int split = findSplitSAH(leafAABBs, leafCenters, objectIDs, first, last);
+
+    // Process the resulting sub-ranges recursively.
+    // Children are placed right after their parent, left subtree first.
+    math::AABB childBB[2];
+    auto branch = &m_binaryNodes[branchNdx];
+    const int childFirst[2] = { first, split + 1 };
+    const int childLast[2] = { split, last };
+    const uint32_t childBranchNdx[2] = { branchNdx + 1, branchNdx + 1 + uint32_t(split - first) };
+
+    for (int i = 0; i < 2; ++i)
+    {
+        if (childFirst[i] == childLast[i])
+        {
+            childBB[i] = leafAABBs[objectIDs[childFirst[i]]];
+            branch->childLeafMask |= 1 << i;
+            branch->childNdx[i] = objectIDs[childFirst[i]];
+            continue;
+        }
+
+        branch->childNdx[i] = childBranchNdx[i];
+        if (deferredSubtrees && childLast[i] - childFirst[i] < maxSubtreeSize)
+        {
+            // Only compute the bounds for now. The subtree will be built later
+            childBB[i].clear();
+            for (int j = childFirst[i]; j <= childLast[i]; ++j)
+                childBB[i] = math::AABB(childBB[i], leafAABBs[objectIDs[j]]);
+            deferredSubtrees->push_back({ childFirst[i], childLast[i], childBranchNdx[i] });
+        }
+        else
+        {
+            generateHierarchySAH(leafAABBs, leafCenters, objectIDs,
+                childFirst[i], childLast[i], childBranchNdx[i], childBB[i], deferredSubtrees, maxSubtreeSize);
+        }
+    }
+
+    treeBB = math::AABB(childBB[0], childBB[1]);
+    branch->childAABB[0] = childBB[0];
+    branch->childAABB[1] = childBB[1];
+}
+
+void CWBVH::generateHierarchyParallel(
+    std::span<const math::AABB> leafAABBs,
+    const uint64_t* sortedMortonCodes,
+    const uint32_t* sortedObjectIDs,
+    ThreadPool& pool)
+{
+    const int numLeafs = int(leafAABBs.size());
+    const int numBranches = numLeafs - 1;
+
+    // Length of the common prefix of keys i and j. Duplicated codes are disambiguated using their indices
+    auto delta = [&](int i, int j) -> int {
+        if (j < 0 || j >= numLeafs)
+            return -1;
+        auto codeI = sortedMortonCodes[i];
+        auto codeJ = sortedMortonCodes[j];
+        if (codeI == codeJ)
+            return 64 + int(__lzcnt(uint32_t(i ^ j)));
+        return int(__lzcnt64(codeI ^ codeJ));
+    };
+
+    // Parents are needed to compute bounds bottom up
+    std::vector<uint32_t> leafParents(numLeafs);
+    std::vector<uint32_t> branchParents(numBranches);
+
+    // Each branch is built independently. Branch 0 is the root
+    forEachChunk(&pool, size_t(numBranches), [&](size_t begin, size_t end) {
+        for (int i = int(begin); i < int(end); ++i)
+        {
+            // Determine the direction of the range
+            int d = (delta(i, i + 1) - delta(i, i - 1)) >= 0 ? 1 : -1;
+
+            // Compute an upper bound for the length of the range
+            int deltaMin = delta(i, i - d);
+            int lMax = 2;
+            while (delta(i, i + lMax * d) > deltaMin)
+                lMax *= 2;
+
+            // Find the other end using binary search
+            int l = 0;
+            for (int t = lMax / 2; t >= 1; t /= 2)
+            {
+                if (delta(i, i + (l + t) * d) > deltaMin)
+                    l += t;
+            }
+            int j = i + l * d;
+
+            // Find the split position using binary search
+            int deltaNode = delta(i, j);
+            int s = 0;
+            for (int divisor = 2; ; divisor *= 2)
+            {
+                int t = (l + divisor - 1) / divisor;
+                if (delta(i, i + (s + t) * d) > deltaNode)
+                    s += t;
+                if (t == 1)
+                    break;
+            }
+            int split = i + s * d + std::min(d, 0);
+
+            // Link children
+            auto& branch = m_binaryNodes[i];
+            const int childNdx[2] = { split, split + 1 };
+            const bool childIsLeaf[2] = { std::min(i, j) == split, std::max(i, j) == split + 1 };
+            for (int c = 0; c < 2; ++c)
+            {
+                if (childIsLeaf[c])
+                {
+                    auto objectId = sortedObjectIDs[childNdx[c]];
+                    branch.childLeafMask |= 1 << c;
+                    branch.childNdx[c] = objectId;
+                    branch.childAABB[c] = leafAABBs[objectId];
+                    leafParents[childNdx[c]] = i;
+                }
+                else
+                {
+                    branch.childNdx[c] = childNdx[c];
+                    branchParents[childNdx[c]] = i;
+                }
+            }
+        }
+        });
+
+    // Compute bounds bottom up. The first thread to reach a branch stops there,
+    // and the second one, which knows both children are complete, computes its bounds and moves up.
+    std::vector<std::atomic<uint32_t>> visitCounters(numBranches);
+    forEachChunk(&pool, size_t(numLeafs), [&](size_t begin, size_t end) {
+        for (size_t leaf = begin; leaf < end; ++leaf)
+        {
+            auto branchNdx = leafParents[leaf];
+            while (visitCounters[branchNdx].fetch_add(1, std::memory_order_acq_rel) == 1)
+            {
+                auto& branch = m_binaryNodes[branchNdx];
+                for (int c = 0; c < 2; ++c)
+                {
+                    if (branch.childLeafMask & (1 << c))
+                        continue;
+                    const auto& child = m_binaryNodes[branch.childNdx[c]];
+                    branch.childAABB[c] = math::AABB(child.childAABB[0], child.childAABB[1]);
+                }
+
+                if (branchNdx == 0) // Reached the root
+                    break;
+                branchNdx = branchParents[branchNdx];
+            }
+        }
+        });
+}
+
+namespace
+{
+    struct SerializedTreeHeader
+    {
+        uint32_t numNodes;
+        uint32_t maxDepth;
+        math::AABB globalAABB;
+        uint32_t numLeafOffsets; // 0 unless built with multi object leafs
+        uint32_t numLeafObjects;
+        uint32_t maxLeafSize;
+        CWBVH::BuildQuality buildQuality;
+    };
+}
+
+void CWBVH::alignStream(std::ostream& out)
+{
+    auto pos = size_t(out.tellp());
+    char zeros[kSerializationAlignment] = {};
+    out.write(zeros, (kSerializationAlignment - pos % kSerializationAlignment) % kSerializationAlignment);
+}
+
+void CWBVH::alignStream(std::istream& in)
+{
+    auto pos = size_t(in.tellg());
+    in.seekg((kSerializationAlignment - pos % kSerializationAlignment) % kSerializationAlignment, std::ios::cur);
+}
+
+void CWBVH::save(std::ostream& out) const
+{
+    SerializedTreeHeader header;
+    header.numNodes = uint32_t(m_internalNodes.size());
+    header.maxDepth = m_maxDepth;
+    header.globalAABB = m_globalAABB;
+    header.numLeafOffsets = uint32_t(m_leafOffsets.size());
+    header.numLeafObjects = uint32_t(m_leafObjects.size());
+    header.maxLeafSize = m_maxLeafSize;
+    header.buildQuality = m_buildQuality;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    alignStream(out);
+    out.write(reinterpret_cast<const char*>(m_internalNodes.data()), m_internalNodes.size() * sizeof(BranchNode));
+    out.write(reinterpret_cast<const char*>(m_leafOffsets.data()), m_leafOffsets.size() * sizeof(uint32_t));
+    out.write(reinterpret_cast<const char*>(m_leafObjects.data()), m_leafObjects.size() * sizeof(uint32_t));
+}
+
+bool CWBVH::load(std::istream& in)
+{
+    SerializedTreeHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return false;
+
+    alignStream(in);
+    m_internalNodes.resize(header.numNodes);
+    m_leafOffsets.resize(header.numLeafOffsets);
+    m_leafObjects.resize(header.numLeafObjects);
+    if (!in.read(reinterpret_cast<char*>(m_internalNodes.data()), m_internalNodes.size() * sizeof(BranchNode))
+        || !in.read(reinterpret_cast<char*>(m_leafOffsets.data()), m_leafOffsets.size() * sizeof(uint32_t))
+        || !in.read(reinterpret_cast<char*>(m_leafObjects.data()), m_leafObjects.size() * sizeof(uint32_t)))
+    {
+        m_internalNodes.clear();
+        m_leafOffsets.clear();
+        m_leafObjects.clear();
+        return false;
+    }
+
+    m_maxDepth = header.maxDepth;
+    m_globalAABB = header.globalAABB;
+    m_maxLeafSize = header.maxLeafSize;
+    m_buildQuality = header.buildQuality;
+    m_mortonCollisions = 0;
+    return true;
+}
+
 void CWBVH::printStats() const
 {
+    size_t numChildren = 0;
+    for (auto& node : m_internalNodes)
+        numChildren += std::popcount(node.childValidMask);
+
     std::cout << "nodes: " << m_internalNodes.size() << "\n";
     std::cout << "tree memory: " << m_internalNodes.size() * sizeof(BranchNode) << "\n";
+    std::cout << "tree depth: " << m_maxDepth << "\n";
+    if (!m_internalNodes.empty())
+        std::cout << "children per node: " << float(numChildren) / m_internalNodes.size() << "\n";
+    if (numLeafs())
+        std::cout << "objects per leaf: " << float(m_leafObjects.size()) / numLeafs() << "\n";
+    std::cout << "SAH cost: " << sahCost() << "\n";
+    if (m_buildQuality == BuildQuality::Fast)
+        std::cout << "morton code collisions: " << m_mortonCollisions << "\n";
+}
+
+namespace
+{
+    // Relative costs used by the surface area heuristic
+    constexpr float kTraversalCost = 1.f;
+    constexpr float kLeafCost = 1.f;
 }
 
-void CWBVH::build(std::span<const math::AABB> aabbs)
+float CWBVH::sahCost() const
 {
-    // Earlt out for empty BVHs
+    auto rootArea = m_globalAABB.area();
+    if (empty() || !(rootArea > 0))
+        return 0.f;
+
+    // The root is always the first branch allocated
+    return branchSAHCost(0) / rootArea;
+}
+
+float CWBVH::branchSAHCost(uint32_t branchNdx) const
+{
+    const auto& branch = m_internalNodes[branchNdx];
+
+    // Use the decompressed child boxes, since those are the ones traversal actually tests
+    float cost = 0.f;
+    math::AABB branchAABB;
+    branchAABB.clear();
+    for (int i = 0; i < int(kWidth); ++i)
+    {
+        if (!(branch.childValidMask & (1 << i)))
+            continue;
+
+        auto childAABB = branch.getChildAABB(i);
+        branchAABB = math::AABB(branchAABB, childAABB);
+        if (branch.childLeafMask & (1 << i))
+            cost += kLeafCost * childAABB.area();
+        else
+            cost += branchSAHCost(branch.childNdx[i]);
+    }
+
+    return cost + kTraversalCost * branchAABB.area();
+}
+
+void CWBVH::build(std::span<const math::AABB> aabbs, BuildQuality quality, ThreadPool* pool, uint32_t maxLeafSize)
+{
+    // Reset any previous tree
+    m_internalNodes.clear();
+    m_leafOffsets.clear();
+    m_leafObjects.clear();
+    m_maxLeafSize = std::max(maxLeafSize, 1u);
+    m_branchCount = 0;
+    m_maxDepth = 0;
+    m_mortonCollisions = 0;
+    m_buildQuality = quality;
+    m_globalAABB.clear();
+
+    // Early out for empty BVHs
     if (aabbs.empty())
         return;
 
@@ -234,88 +713,434 @@ void CWBVH::build(std::span<const math::AABB> aabbs)
     // Find the absolute bounding box of all elements (leafs)
     // and store their centers
     // TODO: Maybe extend the bounding box to the centers only for improved quantization precision
-    std::vector<math::Vec3f> centers;
-    centers.reserve(aabbs.size());
-    
-    m_globalAABB.clear();
-    for (auto& box : aabbs)
+    std::vector<math::Vec3f> centers(aabbs.size());
+    std::mutex globalAABBMutex;
+    forEachChunk(pool, aabbs.size(), [&](size_t begin, size_t end) {
+        math::AABB chunkAABB;
+        chunkAABB.clear();
+        for (size_t i = begin; i < end; ++i)
+        {
+            chunkAABB.add(aabbs[i].min());
+            chunkAABB.add(aabbs[i].max());
+
+            centers[i] = aabbs[i].origin();
+        }
+
+        std::lock_guard lock(globalAABBMutex);
+        m_globalAABB = math::AABB(m_globalAABB, chunkAABB);
+        });
+
+    // Allocate enough nodes to hold the binary tree
+    m_binaryNodes.resize(aabbs.size() - 1);
+    assert(aabbs.size() < std::numeric_limits<int>::max());
+
+    uint32_t binTreeRootId;
+    if (quality == BuildQuality::SAH)
+        binTreeRootId = buildSAH(aabbs, centers, pool);
+    else
+        binTreeRootId = buildMorton(aabbs, centers, pool);
+
+    // Small subtrees will become leafs, so we need their sizes
+    if (m_maxLeafSize > 1)
     {
-        m_globalAABB.add(box.min());
-        m_globalAABB.add(box.max());
+        m_binarySubtreeSizes.resize(m_binaryNodes.size());
+        countSubtreeObjects(binTreeRootId);
+        m_leafOffsets.push_back(0);
+        m_leafObjects.reserve(aabbs.size());
+    }
 
-        centers.push_back(box.origin());
+    // Collapse the binary tree into the wide one. There can't be more wide nodes than binary ones.
+    m_internalNodes.reserve(m_binaryNodes.size());
+    collapse(binTreeRootId, m_globalAABB, 1);
+    m_internalNodes.shrink_to_fit();
+    m_leafOffsets.shrink_to_fit();
+
+    // Free temporary construction data
+    m_binaryNodes.clear();
+    m_binaryNodes.shrink_to_fit();
+    m_binarySubtreeSizes.clear();
+    m_binarySubtreeSizes.shrink_to_fit();
+}
+
+void CWBVH::refit(std::span<const math::AABB> aabbs)
+{
+    if (empty())
+        return;
+
+    // Parents always come before their children in memory, so a reverse pass refits children first
+    std::vector<math::AABB> nodeAABBs(m_internalNodes.size());
+    for (size_t nodeNdx = m_internalNodes.size(); nodeNdx-- > 0;)
+    {
+        auto& node = m_internalNodes[nodeNdx];
+        math::AABB childAABBs[kWidth];
+        auto& nodeAABB = nodeAABBs[nodeNdx];
+        nodeAABB.clear();
+        for (int slot = 0; slot < int(kWidth); ++slot)
+        {
+            if (!(node.childValidMask & (1 << slot)))
+                continue;
+
+            auto& childAABB = childAABBs[slot];
+            auto childNdx = node.childNdx[slot];
+            if (!(node.childLeafMask & (1 << slot)))
+                childAABB = nodeAABBs[childNdx];
+            else if (m_maxLeafSize > 1)
+            {
+                childAABB.clear();
+                for (auto object : leafObjects(childNdx))
+                    childAABB = math::AABB(childAABB, aabbs[object]);
+            }
+            else
+                childAABB = aabbs[childNdx];
+            nodeAABB = math::AABB(nodeAABB, childAABB);
+        }
+
+        // Quantize the children again, relative to the new bounds of the node
+        node.setLocalAABB(nodeAABB);
+        for (int slot = 0; slot < int(kWidth); ++slot)
+        {
+            if (node.childValidMask & (1 << slot))
+                node.setChildAABB(childAABBs[slot], slot);
+        }
     }
-    math::Vec3f invGlobalAABBSize = math::Vec3f(1.f,1.f,1.f) / m_globalAABB.size();
 
-    // Assign morton code quadrants to each centroid
-    std::vector<uint32_t> mortonSections;
-    mortonSections.reserve(aabbs.size());
-    for (auto& trianglePos : centers)
+    m_globalAABB = nodeAABBs[0];
+}
+
+uint32_t CWBVH::countSubtreeObjects(uint32_t binaryNdx)
+{
+    const auto& node = m_binaryNodes[binaryNdx];
+    uint32_t count = 0;
+    for (int i = 0; i < 2; ++i)
+        count += (node.childLeafMask & (1 << i)) ? 1 : countSubtreeObjects(node.childNdx[i]);
+    m_binarySubtreeSizes[binaryNdx] = count;
+    return count;
+}
+
+uint32_t CWBVH::addLeaf(uint32_t ndx, bool isObject)
+{
+    if (isObject)
+        m_leafObjects.push_back(ndx);
+    else
+        gatherLeafObjects(ndx);
+    m_leafOffsets.push_back(uint32_t(m_leafObjects.size()));
+    return numLeafs() - 1;
+}
+
+void CWBVH::gatherLeafObjects(uint32_t binaryNdx)
+{
+    const auto& node = m_binaryNodes[binaryNdx];
+    for (int i = 0; i < 2; ++i)
     {
-        math::Vec3f normalizedPos = (trianglePos - m_globalAABB.min()) * invGlobalAABBSize;
+        if (node.childLeafMask & (1 << i))
+            m_leafObjects.push_back(node.childNdx[i]);
+        else
+            gatherLeafObjects(node.childNdx[i]);
+    }
+}
 
-        // Quantize position. 11 bits x, 11 bits y, 10 bits z.
-        uint32_t quantX = std::min<uint32_t>(static_cast<uint32_t>(normalizedPos.x() * (1 << 11)), (1 << 11) - 1);
-        uint32_t quantY = std::min<uint32_t>(static_cast<uint32_t>(normalizedPos.y() * (1 << 11)), (1 << 11) - 1);
-        uint32_t quantZ = std::min<uint32_t>(static_cast<uint32_t>(normalizedPos.z() * (1 << 10)), (1 << 10) - 1);
+uint32_t CWBVH::collapse(uint32_t binaryNdx, const math::AABB& treeBB, uint32_t depth)
+{
+    m_maxDepth = std::max(m_maxDepth, depth);
 
-        // Interlace morton codes
-        uint32_t mortonCode = spaceBits<2, 11>(quantX) | (spaceBits<2, 11>(quantY)<<1) | (spaceBits<2, 10>(quantZ)<<2);
-        mortonSections.push_back(mortonCode);
+    struct Child
+    {
+        math::AABB aabb;
+        uint32_t ndx;
+        bool isLeaf;
+        bool isObject; // Single object leaf. Otherwise, leafs are binary subtrees small enough to not be split
+    };
+
+    auto binaryChild = [this](const BinaryNode& node, int i) {
+        Child child;
+        child.aabb = node.childAABB[i];
+        child.ndx = node.childNdx[i];
+        child.isObject = (node.childLeafMask & (1 << i)) != 0;
+        child.isLeaf = child.isObject || (m_maxLeafSize > 1 && m_binarySubtreeSizes[child.ndx] <= m_maxLeafSize);
+        return child;
+    };
+
+    // Start with the two children of the binary node
+    Child children[kWidth];
+    uint32_t numChildren = 0;
+    const auto& binaryRoot = m_binaryNodes[binaryNdx];
+    for (int i = 0; i < 2; ++i)
+        children[numChildren++] = binaryChild(binaryRoot, i);
+
+    // Greedily open the internal child with the largest surface area until the node is full
+    while (numChildren < kWidth)
+    {
+        int bestChild = -1;
+        float bestArea = -1.f;
+        for (uint32_t i = 0; i < numChildren; ++i)
+        {
+            if (!children[i].isLeaf && children[i].aabb.area() > bestArea)
+            {
+                bestChild = int(i);
+                bestArea = children[i].aabb.area();
+            }
+        }
+
+        if (bestChild < 0) // Only leaves left
+            break;
+
+        const auto& openedNode = m_binaryNodes[children[bestChild].ndx];
+        children[bestChild] = binaryChild(openedNode, 0);
+        children[numChildren++] = binaryChild(openedNode, 1);
     }
 
-    // Sort elements based on their morton codes
+    // Assign each child to the slot that best matches its direction from the node's center,
+    // so traversal can visit them front to back. See TraversalState::reset.
+    int childSlot[kWidth];
+    {
+        // Greedily pick the best remaining (child, slot) pair
+        uint32_t freeChildren = (1 << numChildren) - 1;
+        uint32_t freeSlots = (1 << kWidth) - 1;
+        while (freeChildren)
+        {
+            float bestScore = -std::numeric_limits<float>::infinity();
+            int bestChild = -1;
+            int bestSlot = -1;
+            for (uint32_t i = 0; i < numChildren; ++i)
+            {
+                if (!(freeChildren & (1 << i)))
+                    continue;
+                auto offset = children[i].aabb.origin() - treeBB.origin();
+                for (int slot = 0; slot < int(kWidth); ++slot)
+                {
+                    if (!(freeSlots & (1 << slot)))
+                        continue;
+                    float score = 0.f;
+                    for (int axis = 0; axis < 3; ++axis)
+                        score += (slot & (1 << axis)) ? -offset[axis] : offset[axis];
+                    if (score > bestScore)
+                    {
+                        bestScore = score;
+                        bestChild = int(i);
+                        bestSlot = slot;
+                    }
+                }
+            }
+
+            childSlot[bestChild] = bestSlot;
+            freeChildren &= ~(1 << bestChild);
+            freeSlots &= ~(1 << bestSlot);
+        }
+    }
+
+    // Allocate this node before its children, so parents always come before their children in memory
+    auto wideNdx = uint32_t(m_internalNodes.size());
+    m_internalNodes.emplace_back();
+    m_internalNodes[wideNdx].setLocalAABB(treeBB);
+
+    for (uint32_t i = 0; i < numChildren; ++i)
+    {
+        uint32_t childNdx;
+        if (!children[i].isLeaf)
+            childNdx = collapse(children[i].ndx, children[i].aabb, depth + 1);
+        else if (m_maxLeafSize > 1)
+            childNdx = addLeaf(children[i].ndx, children[i].isObject);
+        else
+            childNdx = children[i].ndx;
+
+        auto& node = m_internalNodes[wideNdx];
+        auto slot = childSlot[i];
+        node.setChildAABB(children[i].aabb, slot);
+        node.childNdx[slot] = childNdx;
+        if (children[i].isLeaf)
+            node.childLeafMask |= 1 << slot;
+    }
+
+    return wideNdx;
+}
+
+uint32_t CWBVH::buildMorton(std::span<const math::AABB> aabbs, const std::vector<math::Vec3f>& centers, ThreadPool* pool)
+{
+    math::Vec3f invGlobalAABBSize = math::Vec3f(1.f,1.f,1.f) / m_globalAABB.size();
+
+    // Assign morton code quadrants to each centroid
+    std::vector<uint64_t> sortedMortonCodes(aabbs.size());
     std::vector<uint32_t> indices(aabbs.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::sort(indices.begin(), indices.end(), [&](auto a, auto b) {
-        return mortonSections[a] < mortonSections[b];
+    forEachChunk(pool, aabbs.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+        {
+            math::Vec3f normalizedPos = (centers[i] - m_globalAABB.min()) * invGlobalAABBSize;
+
+            // Quantize position. 21 bits per axis.
+            constexpr uint32_t kMaxQuant = (1 << 21) - 1;
+            uint32_t quantX = std::min<uint32_t>(static_cast<uint32_t>(normalizedPos.x() * (1 << 21)), kMaxQuant);
+            uint32_t quantY = std::min<uint32_t>(static_cast<uint32_t>(normalizedPos.y() * (1 << 21)), kMaxQuant);
+            uint32_t quantZ = std::min<uint32_t>(static_cast<uint32_t>(normalizedPos.z() * (1 << 21)), kMaxQuant);
+
+            // Interlace morton codes
+            sortedMortonCodes[i] = expandBits21(quantX) | (expandBits21(quantY) << 1) | (expandBits21(quantZ) << 2);
+            indices[i] = uint32_t(i);
+        }
         });
-    std::vector<uint32_t> sortedMortonCodes(aabbs.size());
-    std::vector<math::AABB> sortedLeafAABBs(aabbs.size());
-    for (size_t i = 0; i < aabbs.size(); ++i)
+
+    // Sort elements based on their morton codes
+    radixSort(sortedMortonCodes, indices, 63, pool);
+
+    // Count leafs that share their code with the previous one. Those can't be told apart by the split search.
+    m_mortonCollisions = 0;
+    for (size_t i = 1; i < sortedMortonCodes.size(); ++i)
+        m_mortonCollisions += sortedMortonCodes[i] == sortedMortonCodes[i - 1];
+
+    const bool parallel = pool && aabbs.size() >= kMinParallelBuildSize;
+    if (parallel)
     {
-        auto ndx = indices[i];
-        sortedMortonCodes[i] = mortonSections[ndx];
-        sortedLeafAABBs[i] = aabbs[ndx];
+        generateHierarchyParallel(aabbs, sortedMortonCodes.data(), indices.data(), *pool);
+        return 0;
     }
 
-    // Allocate enough nodes to hold the tree
-    m_internalNodes.resize(aabbs.size() - 1);
+    std::vector<math::AABB> sortedLeafAABBs(aabbs.size());
+    for (size_t i = 0; i < aabbs.size(); ++i)
+        sortedLeafAABBs[i] = aabbs[indices[i]];
 
     // Build a binary tree out of the sorted nodes
-    assert(aabbs.size() < std::numeric_limits<int>::max());
     math::AABB treeAABB;
-    auto binTreeRootId = generateHierarchy(
+    return generateHierarchy(
         sortedLeafAABBs.data(),
         sortedMortonCodes.data(),
         indices.data(),
         0,
         int(aabbs.size() - 1), treeAABB);
-    m_binTreeRoot = &m_internalNodes[binTreeRootId];
+}
+
+uint32_t CWBVH::buildSAH(std::span<const math::AABB> aabbs, const std::vector<math::Vec3f>& centers, ThreadPool* pool)
+{
+    // Leafs get partitioned in place as we build the tree top down
+    std::vector<uint32_t> indices(aabbs.size());
+    std::iota(indices.begin(), indices.end(), 0);
+
+    // Build the top of the tree on this thread, and leave the smaller subtrees for the pool
+    const bool parallel = pool && aabbs.size() >= kMinParallelBuildSize;
+    std::vector<SAHSubtree> subtrees;
+    const int maxSubtreeSize = parallel ? int(std::max(kMinParallelBuildSize / 4, aabbs.size() / (8 * pool->numWorkers()))) : 0;
+
+    math::AABB treeAABB;
+    generateHierarchySAH(
+        aabbs,
+        centers.data(),
+        indices.data(),
+        0,
+        int(aabbs.size() - 1),
+        0,
+        treeAABB,
+        parallel ? &subtrees : nullptr,
+        maxSubtreeSize);
+
+    if (!subtrees.empty())
+    {
+        // Big subtrees first, for better load balancing
+        std::sort(subtrees.begin(), subtrees.end(), [](const SAHSubtree& a, const SAHSubtree& b) {
+            return (a.last - a.first) > (b.last - b.first);
+            });
+
+        pool->dispatch(subtrees.size(), [&](size_t taskNdx, size_t) {
+            auto& subtree = subtrees[taskNdx];
+            math::AABB subtreeAABB;
+            generateHierarchySAH(aabbs, centers.data(), indices.data(), subtree.first, subtree.last, subtree.branchNdx, subtreeAABB);
+            });
+    }
+
+    return 0;
+}
+
+namespace
+{
+    thread_local uint64_t t_visitedNodeCount = 0;
+}
+
+uint64_t CWBVH::consumeVisitedNodeCount()
+{
+    auto count = t_visitedNodeCount;
+    t_visitedNodeCount = 0;
+    return count;
+}
+
+CWBVH::TraversalState::~TraversalState()
+{
+    t_visitedNodeCount += numVisitedNodes;
+}
+
+CWBVH::PacketTraversalState::~PacketTraversalState()
+{
+    t_visitedNodeCount += numVisitedNodes;
+}
+
+bool CWBVH::continueTraversePacket(
+    const RayPacket& packet,
+    PacketTraversalState& stack,
+    uint32_t& hitId,
+    uint32_t& laneMask) const
+{
+    if (stack.rootPending)
+    {
+        stack.rootPending = false;
+        ++stack.numVisitedNodes;
+        auto rootHitMask = m_internalNodes[0].intersectChildren(packet, packet.activeMask);
+        if (rootHitMask)
+            stack.push(0, rootHitMask);
+    }
+
+    while (!stack.empty())
+    {
+        uint32_t i;
+        uint32_t childLanes;
+        auto branchNdx = stack.pop(i, childLanes);
+        const auto& branch = m_internalNodes[branchNdx];
+
+        auto childNdx = branch.childNdx[i];
+        if (branch.childLeafMask & (1 << i)) // Child is a leaf, perform leaf test
+        {
+            hitId = childNdx;
+            laneMask = childLanes;
+            return true;
+        }
+        else // Child is a branch. Test its children against the lanes that reached it
+        {
+            ++stack.numVisitedNodes;
+            auto childHitMask = m_internalNodes[childNdx].intersectChildren(packet, childLanes);
+            if (childHitMask)
+                stack.push(childNdx, childHitMask);
+        }
+    }
+
+    return false;
 }
 
 bool CWBVH::continueTraverse(
     TraversalState& stack,
     uint32_t& hitId) const
 {
+    if (stack.rootPending)
+    {
+        stack.rootPending = false;
+        ++stack.numVisitedNodes;
+        auto rootHitMask = m_internalNodes[0].intersectChildren(stack.r, stack.tMax);
+        if (rootHitMask)
+            stack.push(0, rootHitMask);
+    }
+
     while (!stack.empty())
     {
-        auto branchAndChildNdx = stack.pop();
-        const auto& branch = m_internalNodes[branchAndChildNdx>>1];
+        uint32_t i;
+        auto branchNdx = stack.pop(i);
+        const auto& branch = m_internalNodes[branchNdx];
 
-        int i = branchAndChildNdx & 1;
-        if (branch.getChildAABB(i).intersect(stack.r, stack.tMax))
+        auto childNdx = branch.childNdx[i];
+        if (branch.childLeafMask & (1 << i)) // Child is a leaf, perform leaf test
         {
-            auto childNdx = branch.childNdx[i];
-            if (branch.childLeafMask & (1 << i)) // Child is a leaf, perform leaf test
-            {
-                hitId = childNdx;
-                return true;
-            }
-            else // Child is a branch. Add it to the stack
-            {
-                stack.push(childNdx);
-            }
+            hitId = childNdx;
+            return true;
+        }
+        else // Child is a branch. Test its children and add them to the stack
+        {
+            ++stack.numVisitedNodes;
+            auto childHitMask = m_internalNodes[childNdx].intersectChildren(stack.r, stack.tMax);
+            if (childHitMask)
+                stack.push(childNdx, childHitMask);
         }
     }
 
@@ -335,11 +1160,12 @@ void CWBVH::createSingleLeafHierarchy(const math::AABB& leaf)
     m_internalNodes.resize(1);
     m_internalNodes[0].setLocalAABB(leaf);
     m_internalNodes[0].setChildAABB(leaf, 0);
-    m_internalNodes[0].setChildAABB(leaf, 1);
     m_internalNodes[0].childNdx[0] = 0;
-    m_internalNodes[0].childNdx[1] = 0;
-
-    m_binTreeRoot = &m_internalNodes[0];
-    m_binTreeRoot->childLeafMask = 0x03;
-    m_branchCount = 1;
+    m_internalNodes[0].childLeafMask = 0x01;
+    m_maxDepth = 1;
+    if (m_maxLeafSize > 1)
+    {
+        m_leafOffsets = { 0, 1 };
+        m_leafObjects = { 0 };
+    }
 }
\ No newline at end of file
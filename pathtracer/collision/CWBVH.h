@@ -19,8 +19,13 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
+#include <algorithm>
+#include <bit>
 #include <cassert>
+#include <cmath>
 #include <functional>
+#include <iosfwd>
+#include <memory>
 #include <span>
 #include <vector>
 
@@ -35,21 +40,71 @@ namespace math
 
 class MeshInstance;
 class BLAS;
+class ThreadPool;
 struct HitRecord;
 
-// Compressed wide BVH based on Karras 2017
+// Compressed wide BVH based on Ylitie, Karras and Laine 2017.
+// A binary tree is built first, and then collapsed into nodes of up to 8 children with quantized bounds.
 class CWBVH
 {
 public:
     CWBVH();
     ~CWBVH();
-    void build(std::span<const math::AABB> aabbs);
+    CWBVH(const CWBVH&) = default;
+    CWBVH(CWBVH&&) = default;
+    CWBVH& operator=(const CWBVH&) = default;
+    CWBVH& operator=(CWBVH&&) = default;
+
+    enum class BuildQuality
+    {
+        Fast, // Morton codes, Karras 2012
+        SAH // Binned surface area heuristic, Wald 2007
+    };
+
+    // When a thread pool is provided, big trees are built in parallel on it.
+    // Subtrees of up to maxLeafSize objects are not split any further, but stored as a single leaf.
+    // With maxLeafSize > 1, ids passed to leaf ops are leaf indices, and leafObjects maps them to the objects in them.
+    void build(std::span<const math::AABB> aabbs, BuildQuality quality = BuildQuality::Fast, ThreadPool* pool = nullptr, uint32_t maxLeafSize = 1);
+    // Updates the bounds of the tree to new boxes for the same objects it was built with, keeping its topology.
+    // Much cheaper than a build, but the tree degrades as objects move away from their original neighbours.
+    void refit(std::span<const math::AABB> aabbs);
     auto aabb() const { return m_globalAABB; }
+    bool empty() const { return m_internalNodes.empty(); }
+    // Number of wide nodes in the longest path from the root to a leaf
+    uint32_t maxDepth() const { return m_maxDepth; }
+
+    // Only valid for trees built with maxLeafSize > 1
+    uint32_t numLeafs() const { return m_leafOffsets.empty() ? 0 : uint32_t(m_leafOffsets.size() - 1); }
+    std::span<const uint32_t> leafObjects(uint32_t leafNdx) const
+    {
+        return { m_leafObjects.data() + m_leafOffsets[leafNdx], m_leafObjects.data() + m_leafOffsets[leafNdx + 1] };
+    }
 
+    // Expected cost of tracing a random ray through the tree, relative to the cost of a single leaf test.
+    float sahCost() const;
     void printStats() const;
 
+    // Binary serialization. Nodes are stored as a flat array starting at an offset aligned to
+    // kSerializationAlignment, so they can be read in a single call, or mapped straight from the file.
+    void save(std::ostream& out) const;
+    bool load(std::istream& in);
+    static constexpr size_t kSerializationAlignment = 64;
+    // Skip to the next aligned position in the stream. Output streams are padded with zeros
+    static void alignStream(std::ostream& out);
+    static void alignStream(std::istream& in);
+
     class TraversalState;
 
+    enum class TraversalOrder
+    {
+        Unordered, // Children are visited in the order they are stored
+        FrontToBack // Children closer to the ray origin are visited first
+    };
+
+    // Number of nodes visited by traversals on the calling thread since the last call.
+    // Useful to measure traversal efficiency.
+    static uint64_t consumeVisitedNodeCount();
+
     struct HitInfo
     {
         bool empty() const { return mNodeId < 0; }
@@ -71,11 +126,11 @@ public:
     {
         // Check against global aabb
         auto implicitRay = ray.implicit();
-        if (!m_globalAABB.intersect(implicitRay, tMax))
+        if (empty() || !m_globalAABB.intersect(implicitRay, tMax))
             return false;
 
         // Init traversal stack to the root
-        CWBVH::TraversalState stack;
+        CWBVH::TraversalState stack(m_maxDepth);
         stack.reset(implicitRay, tMax);
 
         uint32_t instanceHitId;
@@ -92,16 +147,17 @@ public:
     // Leaf Op takes a ray, max distance and a node index (in the order provided at build time),
     // and returns an intersection distance, or -1 if no intersection was found.
     template<class LeafOp>
-    HitInfo closestHit(const math::Ray& ray, const math::Ray::Implicit& implicitRay, float tMax, const LeafOp& leafOp) const
+    HitInfo closestHit(const math::Ray& ray, const math::Ray::Implicit& implicitRay, float tMax, const LeafOp& leafOp,
+        TraversalOrder order = TraversalOrder::FrontToBack) const
     {
         HitInfo hitInfo;
         // Check against global aabb
-        if (!m_globalAABB.intersect(implicitRay, tMax))
+        if (empty() || !m_globalAABB.intersect(implicitRay, tMax))
             return hitInfo;
 
         // Init traversal stack to the root
-        CWBVH::TraversalState stack;
-        stack.reset(implicitRay, tMax);
+        CWBVH::TraversalState stack(m_maxDepth);
+        stack.reset(implicitRay, tMax, order);
 
         int32_t closestHit = -1;
         uint32_t instanceHitId;
@@ -130,97 +186,352 @@ public:
         uint32_t& hitId
     ) const;
 
+    // Maximum number of children of each node
+    static constexpr uint32_t kWidth = 8;
+
+    // Packets of coherent rays, traversed together with a shared stack
+    static constexpr uint32_t kPacketSize = 8;
+
+    // Rays in structure of arrays layout, so each node's children can be tested against all lanes at once.
+    // Lanes not in activeMask are ignored.
+    struct RayPacket
+    {
+        void setRay(uint32_t lane, const math::Ray& ray, float _tMax)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                origin[axis][lane] = ray.origin()[axis];
+                invDir[axis][lane] = 1.f / ray.direction()[axis];
+            }
+            tMax[lane] = _tMax;
+            activeMask |= 1 << lane;
+        }
+
+        alignas(32) float origin[3][kPacketSize] = {};
+        alignas(32) float invDir[3][kPacketSize] = {};
+        alignas(32) float tMax[kPacketSize] = {}; // Leaf ops must shrink this as they find hits
+        uint32_t activeMask = 0;
+    };
+
+    class PacketTraversalState;
+
+    // Leaf Op takes a node index and the mask of lanes that reached it.
+    // It must update the packet's tMax of any lanes it finds a hit for.
+    template<class LeafOp>
+    void closestHitPacket(RayPacket& packet, const LeafOp& leafOp, TraversalOrder order = TraversalOrder::FrontToBack) const
+    {
+        if (empty() || !packet.activeMask)
+            return;
+
+        PacketTraversalState stack(m_maxDepth);
+        stack.reset(packet, order);
+
+        uint32_t hitId;
+        uint32_t laneMask;
+        while (continueTraversePacket(packet, stack, hitId, laneMask))
+            leafOp(hitId, laneMask);
+    }
+
+    bool continueTraversePacket(
+        const RayPacket& packet,
+        PacketTraversalState& stack,
+        uint32_t& hitId,
+        uint32_t& laneMask
+    ) const;
+
+    // Every node in the traversal stack is an ancestor of the next one, so the stack never holds more nodes
+    // than the depth of the tree. Trees deeper than kInlineStackSize get their stack from the heap.
     class TraversalState
     {
     public:
+        explicit TraversalState(uint32_t treeDepth)
+        {
+            if (treeDepth > kInlineStackSize)
+            {
+                heapStack = std::make_unique<Entry[]>(treeDepth);
+                stack = heapStack.get();
+            }
+            stackEnd = stack + std::max(treeDepth, kInlineStackSize);
+            top = stack;
+        }
+        TraversalState(const TraversalState&) = delete;
+        TraversalState& operator=(const TraversalState&) = delete;
+        ~TraversalState();
+
         // Point stack to the root of the tree
-        void reset(const math::Ray::Implicit& _r, float _tMax)
+        void reset(const math::Ray::Implicit& _r, float _tMax, TraversalOrder order = TraversalOrder::FrontToBack)
         {
             // Init ray
             r = _r;
             tMax = _tMax;
-            // Reset stack
-            stack[0] = 0;
-            top = &stack[1];
+            // Reset stack. The root's children still need to be tested
+            top = stack;
+            rootPending = true;
+
+            // Children are stored in the slot that matches their position relative to the parent's center,
+            // with bit i of the slot set when the child is on the negative side of axis i.
+            // The closest slot is the one on the opposite side of the ray direction, and the rest are
+            // visited in order of their distance to it, so we just need to xor slots with that one.
+            childOrderKey = 0;
+            if (order == TraversalOrder::FrontToBack)
+            {
+                for (int axis = 0; axis < 3; ++axis)
+                    childOrderKey |= std::signbit(r.n[axis]) ? 0 : (1 << axis);
+            }
         }
 
         bool empty() const { return stack == top; }
 
-        void push(uint32_t nodeId)
+        void push(uint32_t nodeId, uint32_t childHitMask)
         {
-            // Store nodeId together with the index of the next branch that needs parsing,
-            // which is always 0 when pushing a brand new node.
-            assert(((nodeId << 1) >> 1) == nodeId);
-            *top = nodeId << 1;
+            // Store nodeId together with the mask of children that still need to be visited.
+            // Bit i of the stored mask represents slot (i ^ childOrderKey), so popping the lowest bit first
+            // follows the traversal order.
+            assert(childHitMask && childHitMask < (1 << kWidth));
+            assert(top < stackEnd);
+            static_assert(kWidth == 8, "Child mask permutation assumes 8 children");
+            if (childOrderKey & 1)
+                childHitMask = ((childHitMask & 0x55) << 1) | ((childHitMask >> 1) & 0x55);
+            if (childOrderKey & 2)
+                childHitMask = ((childHitMask & 0x33) << 2) | ((childHitMask >> 2) & 0x33);
+            if (childOrderKey & 4)
+                childHitMask = ((childHitMask & 0x0f) << 4) | ((childHitMask >> 4) & 0x0f);
+            top->nodeId = nodeId;
+            top->childMask = childHitMask;
             ++top;
         }
 
-        uint32_t pop() {
-            auto nodeAndChildNdx = *(top - 1);
-            if ((nodeAndChildNdx & 1) > 0) // This is the second and last time we pop this node
+        // Returns the node at the top of the stack and removes the next child to visit from it.
+        uint32_t pop(uint32_t& childNdx)
+        {
+            assert(top > stack);
+            auto& entry = *(top - 1);
+            childNdx = std::countr_zero(entry.childMask) ^ childOrderKey;
+            entry.childMask &= entry.childMask - 1; // Clear the lowest bit of the mask
+            auto nodeId = entry.nodeId;
+            if (!entry.childMask) // This was the last child to visit
                 --top;
-            else
-                (*(top - 1))++; // Prepare for next iteration
-            assert(top >= stack);
-            return nodeAndChildNdx;
+            return nodeId;
         }
 
         math::Ray::Implicit r;
         float tMax;
+        bool rootPending = false;
+        uint32_t childOrderKey = 0;
+        uint32_t numVisitedNodes = 0; // Nodes whose children were tested
+
+        static constexpr uint32_t kInlineStackSize = 64;
 
     private:
-        static constexpr uint32_t kMaxStackSize = 40;
-        uint32_t stack[kMaxStackSize];
-        uint32_t* top = stack;
-    };
+        struct Entry
+        {
+            uint32_t nodeId;
+            uint32_t childMask;
+        };
 
-private:
+        Entry inlineStack[kInlineStackSize];
+        std::unique_ptr<Entry[]> heapStack;
+        Entry* stack = inlineStack;
+        Entry* stackEnd = nullptr;
+        Entry* top = nullptr;
+    };
 
-    struct BranchNode
+    // See TraversalState for how the stack is sized
+    class PacketTraversalState
     {
-        using BlasCallback = std::function<float(uint32_t leafId, float tMax)>;
+    public:
+        explicit PacketTraversalState(uint32_t treeDepth)
+        {
+            if (treeDepth > TraversalState::kInlineStackSize)
+            {
+                heapStack = std::make_unique<Entry[]>(treeDepth);
+                stack = heapStack.get();
+            }
+            stackEnd = stack + std::max(treeDepth, TraversalState::kInlineStackSize);
+            top = stack;
+        }
+        PacketTraversalState(const PacketTraversalState&) = delete;
+        PacketTraversalState& operator=(const PacketTraversalState&) = delete;
+        ~PacketTraversalState();
+
+        void reset(const RayPacket& packet, TraversalOrder order)
+        {
+            top = stack;
+            rootPending = true;
+
+            // Packets are expected to be coherent, so use the first active ray to choose the traversal order.
+            // See TraversalState::reset
+            childOrderKey = 0;
+            if (order == TraversalOrder::FrontToBack)
+            {
+                auto lane = std::countr_zero(packet.activeMask);
+                for (int axis = 0; axis < 3; ++axis)
+                    childOrderKey |= std::signbit(packet.invDir[axis][lane]) ? 0 : (1 << axis);
+            }
+        }
 
-        struct CompressedAABB
+        bool empty() const { return stack == top; }
+
+        // Byte i of childLaneMask holds the lanes that hit child slot i
+        void push(uint32_t nodeId, uint64_t childLaneMask)
+        {
+            assert(childLaneMask);
+            assert(top < stackEnd);
+            static_assert(kWidth == 8 && kPacketSize == 8, "Child mask permutation assumes 8 children and 8 lanes");
+            // Permute slots the same way TraversalState::push does, one byte per slot
+            if (childOrderKey & 1)
+                childLaneMask = ((childLaneMask & 0x00ff00ff00ff00ffull) << 8) | ((childLaneMask >> 8) & 0x00ff00ff00ff00ffull);
+            if (childOrderKey & 2)
+                childLaneMask = ((childLaneMask & 0x0000ffff0000ffffull) << 16) | ((childLaneMask >> 16) & 0x0000ffff0000ffffull);
+            if (childOrderKey & 4)
+                childLaneMask = (childLaneMask << 32) | (childLaneMask >> 32);
+            top->nodeId = nodeId;
+            top->childLaneMask = childLaneMask;
+            ++top;
+        }
+
+        // Returns the node at the top of the stack, and removes the next child to visit from it
+        uint32_t pop(uint32_t& childNdx, uint32_t& laneMask)
+        {
+            assert(top > stack);
+            auto& entry = *(top - 1);
+            auto byteNdx = uint32_t(std::countr_zero(entry.childLaneMask)) / 8;
+            laneMask = uint32_t(entry.childLaneMask >> (8 * byteNdx)) & 0xff;
+            childNdx = byteNdx ^ childOrderKey;
+            auto nodeId = entry.nodeId;
+            entry.childLaneMask &= ~(uint64_t(0xff) << (8 * byteNdx));
+            if (!entry.childLaneMask)
+                --top;
+            return nodeId;
+        }
+
+        bool rootPending = false;
+        uint32_t childOrderKey = 0;
+        uint32_t numVisitedNodes = 0;
+
+    private:
+        struct Entry
         {
-            uint8_t low[3];
-            uint8_t high[3];
+            uint32_t nodeId;
+            uint64_t childLaneMask;
         };
 
-        static_assert(sizeof(CompressedAABB) == 6);
+        Entry inlineStack[TraversalState::kInlineStackSize];
+        std::unique_ptr<Entry[]> heapStack;
+        Entry* stack = inlineStack;
+        Entry* stackEnd = nullptr;
+        Entry* top = nullptr;
+    };
+
+private:
+
+    // Binary tree used during construction, before it is collapsed into the wide tree
+    struct BinaryNode
+    {
+        math::AABB childAABB[2];
+        uint32_t childNdx[2] = {};
+        uint8_t childLeafMask = 0;
+    };
 
+    struct BranchNode
+    {
         void setLocalAABB(const math::AABB& localAABB);
         math::Vec3f getLocalScale() const;
         math::AABB getChildAABB(int childIndex) const;
         void setChildAABB(const math::AABB& childAABB, int childIndex);
 
+        // Returns a mask of the children hit by the ray before tMax
+        uint32_t intersectChildren(const math::Ray::Implicit& r, float tMax) const;
+        // Returns a mask where byte i has the active lanes that hit child i before their tMax
+        uint64_t intersectChildren(const RayPacket& packet, uint32_t laneMask) const;
+
         math::Vec3f localOrigin; // 12 bytes
         uint8_t localScaleExp[3]; // 3 bytes
         uint8_t childLeafMask = 0; // 1 byte
-        CompressedAABB childCompressedAABB[2]; // 12 bytes
-
-        uint32_t childNdx[2] = {}; // 8 bytes
+        // Quantized child boxes, stored per axis so all children can be decompressed at once
+        uint8_t childLow[3][kWidth] = {}; // 24 bytes
+        uint8_t childHigh[3][kWidth] = {}; // 24 bytes
+        uint32_t childNdx[kWidth] = {}; // 32 bytes
+        uint8_t childValidMask = 0; // 1 byte
     };
 
-    static_assert(sizeof(BranchNode) == 36);
-
-    BranchNode* m_binTreeRoot{};
+    static_assert(sizeof(BranchNode) == 100);
 
     uint32_t generateHierarchy(
         const math::AABB* sortedLeafAABBs,
-        uint32_t* sortedMortonCodes,
+        uint64_t* sortedMortonCodes,
         uint32_t* sortedObjectIDs,
         int           first,
         int           last,
         math::AABB& treeBB);
 
-    int findSplit(uint32_t* sortedMortonCodes,
+    int findSplit(uint64_t* sortedMortonCodes,
         int           first,
         int           last);
 
+    // Parallel version of generateHierarchy, following Karras 2012.
+    // All internal nodes are created at once, and their bounds are then computed bottom up.
+    void generateHierarchyParallel(
+        std::span<const math::AABB> leafAABBs,
+        const uint64_t* sortedMortonCodes,
+        const uint32_t* sortedObjectIDs,
+        ThreadPool& pool);
+
+    // Range of leafs whose subtree construction was deferred, so it can run in parallel
+    struct SAHSubtree
+    {
+        int first;
+        int last;
+        uint32_t branchNdx;
+    };
+
+    // Builds the subtree for leafs in [first, last] starting at branchNdx.
+    // A subtree of n leafs always takes the n-1 nodes after branchNdx, so subtrees can be built independently.
+    // If deferredSubtrees is not null, subtrees of up to maxSubtreeSize leafs are not built, but added to the list instead.
+    void generateHierarchySAH(
+        std::span<const math::AABB> leafAABBs,
+        const math::Vec3f* leafCenters,
+        uint32_t* objectIDs,
+        int           first,
+        int           last,
+        uint32_t      branchNdx,
+        math::AABB& treeBB,
+        std::vector<SAHSubtree>* deferredSubtrees = nullptr,
+        int maxSubtreeSize = 0);
+
+    int findSplitSAH(
+        std::span<const math::AABB> leafAABBs,
+        const math::Vec3f* leafCenters,
+        uint32_t* objectIDs,
+        int           first,
+        int           last);
+
+    float branchSAHCost(uint32_t branchNdx) const;
+
+    uint32_t buildMorton(std::span<const math::AABB> aabbs, const std::vector<math::Vec3f>& centers, ThreadPool* pool);
+    uint32_t buildSAH(std::span<const math::AABB> aabbs, const std::vector<math::Vec3f>& centers, ThreadPool* pool);
+
+    // Collapses the binary subtree under binaryNdx into wide nodes. Returns the index of the top wide node.
+    uint32_t collapse(uint32_t binaryNdx, const math::AABB& treeBB, uint32_t depth);
+    // Number of objects under each binary node, stored in m_binarySubtreeSizes
+    uint32_t countSubtreeObjects(uint32_t binaryNdx);
+    // Creates a leaf with a single object, or with all the objects under a binary node. Returns its index.
+    uint32_t addLeaf(uint32_t ndx, bool isObject);
+    void gatherLeafObjects(uint32_t binaryNdx);
+
     uint32_t allocBranch(uint32_t numNodes);
     void createSingleLeafHierarchy(const math::AABB& leaf);
     uint32_t m_branchCount = 0;
+    uint32_t m_maxDepth = 0;
+    uint32_t m_maxLeafSize = 1;
+    BuildQuality m_buildQuality = BuildQuality::Fast;
+    size_t m_mortonCollisions = 0; // Leafs sharing their Morton code with the previous one
 
+    std::vector<BinaryNode> m_binaryNodes;
+    std::vector<uint32_t> m_binarySubtreeSizes;
     std::vector<BranchNode> m_internalNodes;
+    // Leaf i holds objects m_leafObjects[m_leafOffsets[i]] to m_leafObjects[m_leafOffsets[i + 1] - 1]
+    std::vector<uint32_t> m_leafOffsets;
+    std::vector<uint32_t> m_leafObjects;
     math::AABB m_globalAABB;
 };
\ No newline at end of file
@@ -7,11 +7,14 @@
 //--------------------------------------------------------------------------------------------------
 void TLAS::build(
     std::vector<BLAS>&& blasBuffer,
-    std::vector<Instance>&& instances)
+    std::vector<Instance>&& instances,
+    CWBVH::BuildQuality quality,
+    ThreadPool* pool)
 {
     // Transform instance bboxes to the common frame of reference
     std::vector<math::AABB> aabbs;
     aabbs.reserve(instances.size());
+    m_invInstancePoses.clear();
     m_invInstancePoses.reserve(instances.size());
     
     for (auto& instance : instances)
@@ -25,11 +28,44 @@ void TLAS::build(
     m_instances = std::move(instances);
 
     // Build the TLAS bvh
-    m_bvh.build(aabbs);
+    m_bvh.build(aabbs, quality, pool);
+    m_buildQuality = quality;
+    m_builtSahCost = m_bvh.sahCost();
     std::cout << "TLAS stats:\n";
     m_bvh.printStats();
 }
 
+//--------------------------------------------------------------------------------------------------
+bool TLAS::updatePoses(std::span<const math::Matrix34f> poses, float maxSahGrowth, ThreadPool* pool)
+{
+    assert(poses.size() == m_instances.size());
+
+    std::vector<math::AABB> aabbs(m_instances.size());
+    auto updateInstances = [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            auto& instance = m_instances[i];
+            instance.pose = poses[i];
+            m_invInstancePoses[i] = instance.pose.inverse();
+            aabbs[i] = instance.pose * m_BLASBuffer[instance.BlasIndex].aabb();
+        }
+    };
+
+    if (pool)
+        pool->parallelFor(m_instances.size(), 1 << 10, updateInstances);
+    else
+        updateInstances(0, m_instances.size());
+
+    m_bvh.refit(aabbs);
+    if (!(m_bvh.sahCost() > maxSahGrowth * m_builtSahCost))
+        return false;
+
+    m_bvh.build(aabbs, m_buildQuality, pool);
+    m_builtSahCost = m_bvh.sahCost();
+    return true;
+}
+
 //--------------------------------------------------------------------------------------------------
 bool TLAS::closestHit(const math::Ray& ray, float tMax, HitRecord& dst) const
 {
@@ -40,8 +76,11 @@ bool TLAS::closestHit(const math::Ray& ray, float tMax, HitRecord& dst) const
 
     float closestT = std::numeric_limits<float>::max();
     math::Vec3f closestNormal;
+    math::Vec2f closestBarycentrics;
+    uint32_t closestInstance = 0;
+    uint32_t closestTriangle = 0;
 
-    auto blasTest = [this, &closestT, &closestNormal](const math::Ray& globalRay, float tMax, uint32_t& closestHitId) {
+    auto blasTest = [this, &closestT, &closestNormal, &closestBarycentrics, &closestInstance, &closestTriangle](const math::Ray& globalRay, float tMax, uint32_t& closestHitId) {
         // Transform the ray to local coordinates
         const auto& invPose = m_invInstancePoses[closestHitId];
         math::Ray localRay;
@@ -53,25 +92,100 @@ bool TLAS::closestHit(const math::Ray& ray, float tMax, HitRecord& dst) const
         auto& blas = m_BLASBuffer[instance.BlasIndex];
         float tHit;
         math::Vec3f hitNormal;
+        math::Vec2f hitBarycentrics;
         uint32_t closestHitTriId = -1;
-        if (blas.closestHit(localRay, tMax, closestHitTriId, tHit, hitNormal))
+        if (blas.closestHit(localRay, tMax, closestHitTriId, tHit, hitNormal, hitBarycentrics, m_traversalOrder))
         {
             closestT = tHit;
             closestNormal = instance.pose.transformDir(hitNormal);
+            closestBarycentrics = hitBarycentrics;
+            closestInstance = closestHitId;
+            closestTriangle = closestHitTriId;
             return tHit;
         }
 
         return -1.f;
     };
 
-    auto hitInfo = m_bvh.closestHit(ray, implicitRay, tMax, blasTest);
+    auto hitInfo = m_bvh.closestHit(ray, implicitRay, tMax, blasTest, m_traversalOrder);
 
     if (hitInfo.empty())
         return false;
 
     dst.normal = closestNormal;
+    dst.barycentrics = closestBarycentrics;
     dst.p = ray.at(closestT);
     dst.t = closestT;
+    dst.instanceId = closestInstance;
+    dst.primitiveId = closestTriangle;
 
     return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+uint32_t TLAS::closestHit8(const math::Ray* rays, uint32_t activeMask, float tMax, HitRecord* dst) const
+{
+    CWBVH::RayPacket packet;
+    for (uint32_t lanes = activeMask; lanes; lanes &= lanes - 1)
+        packet.setRay(std::countr_zero(lanes), rays[std::countr_zero(lanes)], tMax);
+
+    uint32_t hitMask = 0;
+    auto blasTest = [&](uint32_t instanceId, uint32_t laneMask) {
+        // Transform the rays to local coordinates
+        const auto& invPose = m_invInstancePoses[instanceId];
+        math::Ray localRays[CWBVH::kPacketSize];
+        for (uint32_t lanes = laneMask; lanes; lanes &= lanes - 1)
+        {
+            auto lane = std::countr_zero(lanes);
+            localRays[lane].origin() = invPose.transformPos(rays[lane].origin());
+            localRays[lane].direction() = invPose.transformDir(rays[lane].direction());
+        }
+
+        // Intersect rays with the BLAS
+        const auto& instance = m_instances[instanceId];
+        const auto& blas = m_BLASBuffer[instance.BlasIndex];
+        float tHit[CWBVH::kPacketSize];
+        math::Vec3f hitNormal[CWBVH::kPacketSize];
+        math::Vec2f hitBarycentrics[CWBVH::kPacketSize];
+        uint32_t hitTriangle[CWBVH::kPacketSize];
+        auto blasHits = blas.closestHit8(localRays, laneMask, packet.tMax, tHit, hitNormal, hitBarycentrics, hitTriangle, m_traversalOrder);
+        for (uint32_t lanes = blasHits; lanes; lanes &= lanes - 1)
+        {
+            auto lane = std::countr_zero(lanes);
+            packet.tMax[lane] = tHit[lane];
+            dst[lane].normal = instance.pose.transformDir(hitNormal[lane]);
+            dst[lane].barycentrics = hitBarycentrics[lane];
+            dst[lane].instanceId = instanceId;
+            dst[lane].primitiveId = hitTriangle[lane];
+        }
+        hitMask |= blasHits;
+    };
+
+    m_bvh.closestHitPacket(packet, blasTest, m_traversalOrder);
+
+    for (uint32_t lanes = hitMask; lanes; lanes &= lanes - 1)
+    {
+        auto lane = std::countr_zero(lanes);
+        dst[lane].t = packet.tMax[lane];
+        dst[lane].p = rays[lane].at(dst[lane].t);
+    }
+
+    return hitMask;
+}
+
+//--------------------------------------------------------------------------------------------------
+bool TLAS::anyHit(const math::Ray& ray, float tMax) const
+{
+    auto blasTest = [&](uint32_t instanceId) {
+        // Transform the ray to local coordinates
+        const auto& invPose = m_invInstancePoses[instanceId];
+        math::Ray localRay;
+        localRay.origin() = invPose.transformPos(ray.origin());
+        localRay.direction() = invPose.transformDir(ray.direction());
+
+        const auto& blas = m_BLASBuffer[m_instances[instanceId].BlasIndex];
+        return blas.anyHit(localRay, tMax);
+    };
+
+    return m_bvh.anyHit(ray, tMax, blasTest);
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include "shapes/triangle.h"
 #include "math/matrix.h"
 
+#include <span>
+
 class BLAS;
 
 class TLAS
@@ -17,16 +19,35 @@ public:
     };
 
     // Construction
-    // TODO: Add different construction methods: Embree, Morton codes, Surface area heuristic
+    // TODO: Add Embree based construction
     void build(
         std::vector<BLAS>&& blasBuffer,
-        std::vector<Instance>&& instances);
+        std::vector<Instance>&& instances,
+        CWBVH::BuildQuality quality = CWBVH::BuildQuality::Fast,
+        ThreadPool* pool = nullptr);
+
+    // Moves the instances to new poses, given in the same order as the instances passed to build.
+    // The tree is refit to the new instance bounds, unless that makes its SAH cost grow past maxSahGrowth
+    // times the cost of its last build. It is then rebuilt with the same quality. Returns true if it was rebuilt.
+    static constexpr float kDefaultMaxSahGrowth = 1.5f;
+    bool updatePoses(std::span<const math::Matrix34f> poses, float maxSahGrowth = kDefaultMaxSahGrowth, ThreadPool* pool = nullptr);
 
     // Queries
     bool closestHit(const math::Ray& ray, float tMax, HitRecord& dst) const;
+    // Closest hit for a packet of up to CWBVH::kPacketSize coherent rays, traversed together.
+    // Lanes not in activeMask are ignored. Returns the mask of lanes that hit something.
+    uint32_t closestHit8(const math::Ray* rays, uint32_t activeMask, float tMax, HitRecord* dst) const;
+    // Returns true if anything is hit before tMax. Faster than closestHit, meant for shadow rays.
+    bool anyHit(const math::Ray& ray, float tMax) const;
+
+    // Order used to visit children during traversal, both in the TLAS and its BLASes
+    void setTraversalOrder(CWBVH::TraversalOrder order) { m_traversalOrder = order; }
 
 private:
     CWBVH m_bvh;
+    CWBVH::TraversalOrder m_traversalOrder = CWBVH::TraversalOrder::FrontToBack;
+    CWBVH::BuildQuality m_buildQuality = CWBVH::BuildQuality::Fast;
+    float m_builtSahCost = 0.f; // SAH cost right after the last build, to measure the degradation of refits
 
     // Needs an array of BLASs
     std::vector<Instance> m_instances;
@@ -0,0 +1,102 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2021 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include <threadPool.h>
+
+// Stable least significant digit radix sort of key/value pairs, one byte at a time.
+// There is one pass per byte holding the lowest keyBits bits, so keys are ordered by those bytes and higher bytes are ignored.
+// When a thread pool is provided, big arrays are counted and scattered in parallel,
+// with each task owning a contiguous chunk of the input.
+template<class Value>
+void radixSort(std::vector<uint64_t>& keys, std::vector<Value>& values, uint32_t keyBits = 64, ThreadPool* pool = nullptr)
+{
+    assert(keys.size() == values.size());
+    constexpr uint32_t kDigitBits = 8;
+    constexpr uint32_t kNumBuckets = 1 << kDigitBits;
+    constexpr size_t kMinChunkSize = 1 << 14;
+
+    const size_t n = keys.size();
+    size_t numChunks = 1;
+    if (pool)
+        numChunks = std::max<size_t>(1, std::min(n / kMinChunkSize, 4 * pool->numWorkers()));
+
+    auto forEachChunk = [&](const auto& op) {
+        if (numChunks > 1)
+            pool->dispatch(numChunks, [&](size_t chunk, size_t) { op(chunk, chunk * n / numChunks, (chunk + 1) * n / numChunks); });
+        else
+            op(size_t(0), size_t(0), n);
+    };
+
+    std::vector<uint64_t> tmpKeys(n);
+    std::vector<Value> tmpValues(n);
+    std::vector<std::array<size_t, kNumBuckets>> chunkOffsets(numChunks);
+
+    for (uint32_t shift = 0; shift < keyBits; shift += kDigitBits)
+    {
+        // Count the keys in each bucket, per chunk
+        forEachChunk([&](size_t chunk, size_t begin, size_t end) {
+            auto& histogram = chunkOffsets[chunk];
+            histogram.fill(0);
+            for (size_t i = begin; i < end; ++i)
+                histogram[(keys[i] >> shift) & (kNumBuckets - 1)]++;
+        });
+
+        // Turn counts into output offsets. Buckets go in order, and chunks in order within each bucket
+        size_t offset = 0;
+        bool trivialPass = false;
+        for (uint32_t bucket = 0; bucket < kNumBuckets; ++bucket)
+        {
+            size_t bucketSize = 0;
+            for (auto& offsets : chunkOffsets)
+            {
+                auto count = offsets[bucket];
+                offsets[bucket] = offset + bucketSize;
+                bucketSize += count;
+            }
+            trivialPass |= bucketSize == n;
+            offset += bucketSize;
+        }
+
+        // All keys share this digit, so the pass wouldn't change the order
+        if (trivialPass)
+            continue;
+
+        // Scatter
+        forEachChunk([&](size_t chunk, size_t begin, size_t end) {
+            auto& offsets = chunkOffsets[chunk];
+            for (size_t i = begin; i < end; ++i)
+            {
+                auto dst = offsets[(keys[i] >> shift) & (kNumBuckets - 1)]++;
+                tmpKeys[dst] = keys[i];
+                tmpValues[dst] = values[i];
+            }
+        });
+
+        keys.swap(tmpKeys);
+        values.swap(tmpValues);
+    }
+}
@@ -0,0 +1,135 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "cpuTopology.h"
+
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <Windows.h>
+#elif defined(__linux__)
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+#ifdef __linux__
+	// Parses cpu (or node) lists like "0-3,8-11"
+	std::vector<uint32_t> parseCpuList(const std::string& list)
+	{
+		std::vector<uint32_t> cores;
+		size_t pos = 0;
+		while(pos < list.size())
+		{
+			auto end = list.find(',', pos);
+			if(end == std::string::npos)
+				end = list.size();
+			auto range = list.substr(pos, end - pos);
+			auto dash = range.find('-');
+			auto first = uint32_t(std::stoul(range.substr(0, dash)));
+			auto last = dash == std::string::npos ? first : uint32_t(std::stoul(range.substr(dash + 1)));
+			for(auto c = first; c <= last; ++c)
+				cores.push_back(c);
+			pos = end + 1;
+		}
+		return cores;
+	}
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+CpuTopology CpuTopology::detect()
+{
+	CpuTopology topology;
+
+#ifdef _WIN32
+	ULONG highestNode = 0;
+	if(GetNumaHighestNodeNumber(&highestNode))
+	{
+		for(ULONG node = 0; node <= highestNode; ++node)
+		{
+			GROUP_AFFINITY affinity = {};
+			if(!GetNumaNodeProcessorMaskEx(USHORT(node), &affinity) || !affinity.Mask)
+				continue;
+			Node& dst = topology.nodes.emplace_back();
+			for(uint32_t bit = 0; bit < 64; ++bit)
+			{
+				if(affinity.Mask & (KAFFINITY(1) << bit))
+					dst.cores.push_back(affinity.Group * 64 + bit);
+			}
+		}
+	}
+#elif defined(__linux__)
+	// Node ids can have gaps (e.g. "0,2" after offlining a node), so iterate over the online ones
+	std::ifstream onlineNodes("/sys/devices/system/node/online");
+	std::string nodeList;
+	if(std::getline(onlineNodes, nodeList))
+	{
+		for(auto node : parseCpuList(nodeList))
+		{
+			std::ifstream cpuList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			std::string list;
+			if(!std::getline(cpuList, list))
+				continue;
+			auto cores = parseCpuList(list);
+			if(!cores.empty())
+				topology.nodes.push_back({ std::move(cores) });
+		}
+	}
+#endif
+
+	if(topology.nodes.empty())
+	{
+		Node& all = topology.nodes.emplace_back();
+		for(uint32_t c = 0; c < std::max(1u, std::thread::hardware_concurrency()); ++c)
+			all.cores.push_back(c);
+	}
+
+	return topology;
+}
+
+//--------------------------------------------------------------------------------------------------
+bool CpuTopology::pinCurrentThread(std::span<const uint32_t> cores)
+{
+	if(cores.empty())
+		return false;
+
+#ifdef _WIN32
+	// Threads can only run on one processor group at a time, so use the group of the first core
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = WORD(cores[0] / 64);
+	for(auto c : cores)
+	{
+		if(c / 64 == affinity.Group)
+			affinity.Mask |= KAFFINITY(1) << (c % 64);
+	}
+	return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(auto c : cores)
+		CPU_SET(c, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
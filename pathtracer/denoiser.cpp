@@ -0,0 +1,284 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "denoiser.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include <math/vectorFloat.h>
+#include <textures/image.h>
+#include "threadPool.h"
+
+using namespace math;
+
+namespace {
+	// Albedo below this is not divided out, so black surfaces keep their noise instead of blowing it up
+	constexpr float kMinAlbedo = 1e-3f;
+	// Rows per task
+	constexpr size_t kGrainSize = 16;
+
+	// B3 spline, separable
+	constexpr float kKernel[5] = { 1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16 };
+
+	//----------------------------------------------------------------------------------------------
+	// Image with each component in its own plane, so filter taps can be applied to a whole row at once, in SIMD
+	struct Planes
+	{
+		explicit Planes(size_t n) : x(n), y(n), z(n) {}
+
+		void set(size_t i, const Vec3f& v)
+		{
+			x[i] = v.x();
+			y[i] = v.y();
+			z[i] = v.z();
+		}
+
+		std::vector<float> x, y, z;
+	};
+
+	//----------------------------------------------------------------------------------------------
+	float luminance(float r, float g, float b)
+	{
+		return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Filter taps are applied to 8 pixels of a row at a time, and the leftovers one by one.
+	// These let the same code handle both cases
+	float load(const float* p, float) { return *p; }
+	float8 load(const float* p, float8) { return float8::loadUnaligned(p); }
+	void store(float* p, float x) { *p = x; }
+	void store(float* p, float8 x) { x.storeUnaligned(p); }
+	float abs(float x) { return std::abs(x); }
+
+	//----------------------------------------------------------------------------------------------
+	// exp(-x) for x >= 0, to about 1e-4 relative error
+	float8 expNegative(float8 x)
+	{
+		const auto t = max(x * float8(-1.44269504f), float8(-126.f)); // In base 2
+		const auto integer = float8(_mm256_floor_ps(t.m));
+		const auto f = t - integer;
+		// 2^f in [0,1)
+		const auto fraction = f.mul_add(f.mul_add(f.mul_add(float8(0.0781063f), float8(0.2261697f)), float8(0.6951786f)), float8(1.f));
+		const auto exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(integer.m), _mm256_set1_epi32(127)), 23);
+		return fraction * float8(_mm256_castsi256_ps(exponent));
+	}
+
+	float expNegative(float x)
+	{
+		float lanes[8];
+		expNegative(float8(x)).storeUnaligned(lanes);
+		return lanes[0];
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Sums of the weighted taps of each pixel in a row
+	struct RowAccumulator
+	{
+		explicit RowAccumulator(size_t width) : sumX(width), sumY(width), sumZ(width), weightSum(width), varianceSum(width) {}
+
+		void clear()
+		{
+			for(auto* sum : { &sumX, &sumY, &sumZ, &weightSum, &varianceSum })
+				std::fill(sum->begin(), sum->end(), 0.f);
+		}
+
+		std::vector<float> sumX, sumY, sumZ, weightSum, varianceSum;
+	};
+
+	//----------------------------------------------------------------------------------------------
+	struct FilterInputs
+	{
+		const Planes& lighting;
+		const std::vector<float>& lightingLuminance;
+		const std::vector<float>& lightingVariance;
+		const std::vector<float>& invColorSigma;
+		const Planes& normal;
+		const Planes& albedo;
+		float invNormalSigma2;
+		float invAlbedoSigma2;
+	};
+
+	//----------------------------------------------------------------------------------------------
+	// Adds the tap at index tap of the image to the pixel at index center, which is pixel x of the accumulator's row.
+	// Lanes is float8 to do the same for the 7 pixels that follow.
+	template<class Lanes>
+	void addTap(const FilterInputs& in, size_t center, size_t tap, size_t x, float kernel, RowAccumulator& dst)
+	{
+		const Lanes zero(0.f);
+		auto sqDistance = [&](const Planes& p) {
+			const auto dx = load(&p.x[tap], zero) - load(&p.x[center], zero);
+			const auto dy = load(&p.y[tap], zero) - load(&p.y[center], zero);
+			const auto dz = load(&p.z[tap], zero) - load(&p.z[center], zero);
+			return dx * dx + dy * dy + dz * dz;
+		};
+		const auto colorDistance = abs(load(&in.lightingLuminance[tap], zero) - load(&in.lightingLuminance[center], zero));
+		const auto distance =
+			colorDistance * load(&in.invColorSigma[center], zero) +
+			sqDistance(in.normal) * Lanes(in.invNormalSigma2) +
+			sqDistance(in.albedo) * Lanes(in.invAlbedoSigma2);
+		const auto weight = Lanes(kernel) * expNegative(distance);
+
+		auto accumulate = [&](std::vector<float>& sum, const Lanes& value) {
+			store(&sum[x], load(&sum[x], zero) + value);
+		};
+		accumulate(dst.sumX, weight * load(&in.lighting.x[tap], zero));
+		accumulate(dst.sumY, weight * load(&in.lighting.y[tap], zero));
+		accumulate(dst.sumZ, weight * load(&in.lighting.z[tap], zero));
+		accumulate(dst.weightSum, weight);
+		accumulate(dst.varianceSum, weight * weight * load(&in.lightingVariance[tap], zero));
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Variance is smoothed with a 3x3 gaussian before it's used for edge stopping, because estimates from few
+	// samples are noisy themselves
+	float blurredVariance(const std::vector<float>& variance, size_t width, size_t height, size_t x, size_t y)
+	{
+		constexpr float kGaussian[3] = { 0.25f, 0.5f, 0.25f };
+		float sum = 0.f;
+		float weightSum = 0.f;
+		for(int dy = -1; dy <= 1; ++dy)
+			for(int dx = -1; dx <= 1; ++dx)
+			{
+				const auto tx = ptrdiff_t(x) + dx;
+				const auto ty = ptrdiff_t(y) + dy;
+				if(tx < 0 || ty < 0 || tx >= ptrdiff_t(width) || ty >= ptrdiff_t(height))
+					continue;
+				const float weight = kGaussian[dx + 1] * kGaussian[dy + 1];
+				sum += weight * variance[tx + ty * width];
+				weightSum += weight;
+			}
+		return sum / weightSum;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+void denoise(const Image& color, const std::vector<float>& variance, const Image& albedo, const Image& normal, Image& dst,
+	ThreadPool& pool, const DenoiserOptions& options)
+{
+	const auto width = color.width();
+	const auto height = color.height();
+	const auto numPixels = width * height;
+	assert(variance.size() == numPixels);
+	assert(albedo.width() == width && albedo.height() == height);
+	assert(normal.width() == width && normal.height() == height);
+
+	// Filter lighting only
+	Planes lighting(numPixels);
+	Planes albedoPlanes(numPixels);
+	Planes normalPlanes(numPixels);
+	std::vector<float> lightingVariance(numPixels);
+	pool.parallelFor(height, kGrainSize, [&](size_t y0, size_t y1) {
+		for(size_t y = y0; y < y1; ++y)
+			for(size_t x = 0; x < width; ++x)
+			{
+				const auto i = x + y * width;
+				const auto& a = albedo.pixel(x, y);
+				const auto& c = color.pixel(x, y);
+				Vec3f l;
+				for(int j = 0; j < 3; ++j)
+					l[j] = a[j] > kMinAlbedo ? c[j] / a[j] : c[j];
+				lighting.set(i, l);
+				albedoPlanes.set(i, a);
+				normalPlanes.set(i, normal.pixel(x, y));
+				const float albedoLuminance = luminance(a.x(), a.y(), a.z());
+				lightingVariance[i] = albedoLuminance > kMinAlbedo ? variance[i] / (albedoLuminance * albedoLuminance) : variance[i];
+			}
+	});
+
+	const float invNormalSigma2 = 1.f / (options.normalSigma * options.normalSigma);
+	const float invAlbedoSigma2 = 1.f / (options.albedoSigma * options.albedoSigma);
+	Planes filtered(numPixels);
+	std::vector<float> filteredVariance(numPixels);
+	std::vector<float> lightingLuminance(numPixels);
+	std::vector<float> invColorSigma(numPixels);
+	for(int iteration = 0; iteration < options.iterations; ++iteration)
+	{
+		pool.parallelFor(height, kGrainSize, [&](size_t y0, size_t y1) {
+			for(size_t y = y0; y < y1; ++y)
+				for(size_t x = 0; x < width; ++x)
+				{
+					const auto i = x + y * width;
+					lightingLuminance[i] = luminance(lighting.x[i], lighting.y[i], lighting.z[i]);
+					invColorSigma[i] = 1.f / (options.colorSigma * std::sqrt(blurredVariance(lightingVariance, width, height, x, y)) + 1e-6f);
+				}
+		});
+
+		// Taps are visited in the outer loops, so the inner loop runs over contiguous pixels of a row
+		const FilterInputs inputs = { lighting, lightingLuminance, lightingVariance, invColorSigma, normalPlanes, albedoPlanes,
+			invNormalSigma2, invAlbedoSigma2 };
+		const ptrdiff_t step = ptrdiff_t(1) << iteration;
+		pool.parallelFor(height, kGrainSize, [&](size_t y0, size_t y1) {
+			RowAccumulator row(width);
+			for(size_t y = y0; y < y1; ++y)
+			{
+				row.clear();
+				const auto rowStart = y * width;
+				for(int dy = -2; dy <= 2; ++dy)
+				{
+					const auto ty = ptrdiff_t(y) + dy * step;
+					if(ty < 0 || ty >= ptrdiff_t(height))
+						continue;
+					for(int dx = -2; dx <= 2; ++dx)
+					{
+						// Range of pixels in the row whose tap lands inside the image
+						const auto offset = dx * step;
+						const auto xBegin = size_t(std::clamp<ptrdiff_t>(-offset, 0, width));
+						const auto xEnd = size_t(std::clamp<ptrdiff_t>(ptrdiff_t(width) - offset, 0, width));
+						const auto tapToCenter = ptrdiff_t(ty - ptrdiff_t(y)) * ptrdiff_t(width) + offset;
+						const float kernel = kKernel[dx + 2] * kKernel[dy + 2];
+						size_t x = xBegin;
+						for(; x + 8 <= xEnd; x += 8)
+							addTap<float8>(inputs, rowStart + x, size_t(ptrdiff_t(rowStart + x) + tapToCenter), x, kernel, row);
+						for(; x < xEnd; ++x)
+							addTap<float>(inputs, rowStart + x, size_t(ptrdiff_t(rowStart + x) + tapToCenter), x, kernel, row);
+					}
+				}
+
+				// The center tap always has weight, so weightSum > 0
+				for(size_t x = 0; x < width; ++x)
+				{
+					const float invWeight = 1.f / row.weightSum[x];
+					filtered.x[rowStart + x] = row.sumX[x] * invWeight;
+					filtered.y[rowStart + x] = row.sumY[x] * invWeight;
+					filtered.z[rowStart + x] = row.sumZ[x] * invWeight;
+					filteredVariance[rowStart + x] = row.varianceSum[x] * invWeight * invWeight;
+				}
+			}
+		});
+		std::swap(lighting, filtered);
+		std::swap(lightingVariance, filteredVariance);
+	}
+
+	// Put albedo back
+	pool.parallelFor(height, kGrainSize, [&](size_t y0, size_t y1) {
+		for(size_t y = y0; y < y1; ++y)
+			for(size_t x = 0; x < width; ++x)
+			{
+				const auto i = x + y * width;
+				const auto& a = albedo.pixel(x, y);
+				const Vec3f l(lighting.x[i], lighting.y[i], lighting.z[i]);
+				auto& d = dst.pixel(x, y);
+				for(int j = 0; j < 3; ++j)
+					d[j] = a[j] > kMinAlbedo ? l[j] * a[j] : l[j];
+			}
+	});
+}
@@ -0,0 +1,43 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <vector>
+
+class Image;
+class ThreadPool;
+
+struct DenoiserOptions
+{
+	int iterations = 5; // Each iteration doubles the distance between filter taps
+	// Edge stopping. Taps are weighted down by how much they differ from the center pixel
+	float colorSigma = 4.f; // Luminance differences are measured in standard deviations of the center pixel
+	float normalSigma = 0.3f;
+	float albedoSigma = 0.1f;
+};
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010), guided by the albedo and normal AOVs, and by the noise
+// of each pixel like in SVGF (Schied et al. 2017), so well converged pixels are barely blurred.
+// Albedo is divided out before filtering and multiplied back after it, so only lighting gets blurred.
+// variance holds the variance of each pixel's luminance, as given by AccumulationBuffer::meanVariance.
+// Each iteration is split among the pool's workers. All images must have the same size, and dst must not be any of
+// the inputs.
+void denoise(const Image& color, const std::vector<float>& variance, const Image& albedo, const Image& normal, Image& dst,
+	ThreadPool& pool, const DenoiserOptions& options = {});
@@ -0,0 +1,68 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//--------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <algorithm>
+
+#include <background.h>
+#include <math/constants.h>
+#include <math/ray.h>
+#include <math/vector.h>
+#include <sampler.h>
+
+// Multiple importance sampling weight of a sample drawn with density pdf, that otherPdf could also have produced
+inline float powerHeuristic(float pdf, float otherPdf)
+{
+	const float a = pdf * pdf;
+	const float b = otherPdf * otherPdf;
+	return a + b > 0 ? a / (a + b) : 0.f;
+}
+
+// Density of lambertScatter picking dir, off a surface whose normal faces the incoming ray
+inline float lambertPdf(const math::Vec3f& normal, const math::Vec3f& dir)
+{
+	return std::max(0.f, dot(normal, dir)) / math::Pi;
+}
+
+// Next event estimation towards the background, from a Lambertian surface at pos whose normal faces the incoming ray.
+// Returns false if no light can arrive from the chosen direction. Otherwise, unless shadowRay is occluded,
+// contribution should be scaled by the path throughput and added to its radiance.
+// The contribution is already weighted against the background being reached by lambertScatter.
+inline bool sampleBackgroundLight(
+	const Background& background,
+	const math::Vec3f& pos,
+	const math::Vec3f& normal,
+	const math::Vec3f& albedo,
+	Sampler& sampler,
+	math::Ray& shadowRay,
+	math::Vec3f& contribution)
+{
+	math::Vec3f dir;
+	float lightPdf;
+	auto radiance = background.sampleDirection(sampler, dir, lightPdf);
+	const float cosTheta = dot(normal, dir);
+	if(cosTheta <= 0 || !(lightPdf > 0))
+		return false;
+
+	const float weight = powerHeuristic(lightPdf, lambertPdf(normal, dir));
+	contribution = albedo * radiance * (cosTheta / math::Pi * weight / lightPdf);
+	shadowRay = math::Ray(pos + math::SurfaceOffset * normal, dir);
+	return true;
+}
@@ -18,63 +18,102 @@
 // DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
+#include <chrono>
 #include <cstddef>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
 #include <vector>
 
 #include <background.h>
+#include "accumulationBuffer.h"
+#include "aovBuffer.h"
 #include "camera/frustumCamera.h"
 #include "camera/sphericalCamera.h"
 #include "cmdLineParams.h"
 #include "math/rectangle.h"
+#include "lightSampling.h"
 #include "materials/Lambertian.h"
+#include "pathTermination.h"
 #include "collision.h"
+#include "denoiser.h"
 #include "scene/scene.h"
 #include "scene/loadGltf.h"
+#include "textures/exrWriter.h"
 #include "textures/image.h"
 #include "threadPool.h"
+#include "tileScheduler.h"
+#include "wavefrontIntegrator.h"
 
 using namespace math;
 using namespace std;
 
 namespace {
-    constexpr int MAX_BOUNCES = 9;
+	constexpr float farPlane = 1e3f;
 }
 
 //--------------------------------------------------------------------------------------------------
-Vec3f color(Ray r, const Scene& world, RandomGenerator& random, size_t& numRays)
+// Integrates light along the path starting with ray r, whose first intersection has already been traced.
+// If sampleLights is set, each bounce also samples the background directly, and both strategies are combined with MIS.
+Vec3f color(Ray r, bool primaryHit, HitRecord hit, const Scene& world, const PathTermination& termination, bool sampleLights, Sampler& sampler, size_t& numRays)
 {
 	assert(abs(r.direction().sqNorm()-1) < 1e-4f); // Check ray direction
 
     int depth = 0;
-	constexpr float farPlane = 1e3f;
 
     Vec3f accumLight = Vec3f(0.f);
     Vec3f accumAttenuation = Vec3f(1.f);
-	HitRecord hit;
+	float bsdfPdf = 0; // Density of the last bounce direction. 0 for camera rays
+	bool isHit = primaryHit;
+	++numRays;
 
-    while(depth <= MAX_BOUNCES)
+    for(;;)
     {
-		++numRays;
-        if (world.hit(r, farPlane, hit))
+        if (isHit)
         {
+			const Vec3f albedo = Vec3f(DefaultAlbedo);
+			const auto facingNormal = dot(hit.normal, r.direction()) > 0.f ? -hit.normal : hit.normal;
+
+			// Next event estimation. Light samples are weighted against the bounce ray, so skip them
+			// when the bounce limit stops the path before that ray is traced.
+			Ray shadowRay;
+			Vec3f directLight;
+			if(sampleLights && depth < termination.maxBounces && sampleBackgroundLight(*world.background, hit.p, facingNormal, albedo, sampler, shadowRay, directLight))
+			{
+				++numRays;
+				if(!world.occluded(shadowRay, farPlane))
+					accumLight += accumAttenuation * directLight;
+			}
+
             // Evaluate light bounce
             Ray scatteredRay;
             Vec3f attenuation;
             Vec3f emitted;
-            lambertScatter(r, hit.p, hit.normal, Vec3f(0.75), attenuation, emitted, scatteredRay, random);
+            lambertScatter(r, hit.p, hit.normal, albedo, attenuation, emitted, scatteredRay, sampler);
             r = scatteredRay;
+			bsdfPdf = lambertPdf(facingNormal, r.direction());
 
             // Integrate path
             accumLight += accumAttenuation * emitted;
             accumAttenuation *= attenuation;
 
-            ++depth;
+            if(++depth > termination.maxBounces)
+				break;
+			if(!termination.russianRoulette(depth, accumAttenuation, sampler))
+				break;
+
+			// Trace next bounce
+			++numRays;
+			isHit = world.hit(r, farPlane, hit);
         }
         else
         {
             // Gather light from the background
-            accumLight += accumAttenuation * world.background->sample(r.direction());
+			float weight = 1.f;
+			if(sampleLights && bsdfPdf > 0)
+				weight = powerHeuristic(bsdfPdf, world.background->pdf(r.direction()));
+            accumLight += weight * accumAttenuation * world.background->sample(r.direction());
             break;
         }
     }
@@ -82,43 +121,172 @@ Vec3f color(Ray r, const Scene& world, RandomGenerator& random, size_t& numRays)
     return accumLight;
 }
 
+//--------------------------------------------------------------------------------------------------
+// Surface features seen by a camera ray, for the AOVs
+PrimaryHit primaryHit(const Ray& r, const HitRecord& hit)
+{
+	PrimaryHit features;
+	features.albedo = Vec3f(DefaultAlbedo);
+	features.normal = dot(hit.normal, r.direction()) > 0.f ? -hit.normal : hit.normal;
+	features.depth = hit.t;
+	features.instanceId = hit.instanceId;
+	return features;
+}
+
 using Rect = math::Rectangle<size_t>;
 
 //--------------------------------------------------------------------------------------------------
+// Adds nSamples more samples to each pixel in the window.
+// If activePixels is not null, only pixels marked in it are sampled.
+// If aovs is not null, the primary hits of the new samples are added to it.
 void renderTile(
 	Rect window,
 	const Scene& world,
-	Image& dst,
-	RandomGenerator& random,
+	const PathTermination& termination,
+	bool sampleLights,
+	Sampler::Type samplerType,
+	AccumulationBuffer& dst,
+	AovBuffer* aovs,
 	unsigned nSamples,
+	const uint8_t* activePixels,
 	size_t& totalNumRays)
 {
 	const auto totalNx = dst.width();
 	const auto totalNy = dst.height();
 	const auto& cam = *world.cameras().front();
+	std::optional<AovBuffer::Tile> aovTile;
+	if(aovs)
+		aovTile.emplace(*aovs, window);
 
 	for(size_t i = window.y0; i < window.y1; ++i)
 		for(size_t j = window.x0; j < window.x1; ++j)
 		{
-			Vec3f accum(0.f);
-			for(size_t s = 0; s < nSamples; ++s)
+			if(activePixels && !activePixels[j + i * totalNx])
+				continue;
+
+			for(unsigned s = 0; s < nSamples; ++s)
 			{
-				float u = float(j+random.scalar())/totalNx;
-				float v = 1.f-float(i+random.scalar())/totalNy;
+				// Each pixel sample gets its own sequence, so images don't depend on tiling, thread count,
+				// or how many samples other pixels took
+				Sampler sampler(samplerType, uint32_t(j), uint32_t(i), uint32_t(totalNx), dst.numSamples(j, i));
+				auto jitter = sampler.next2D();
+				float u = float(j+jitter.x())/totalNx;
+				float v = 1.f-float(i+jitter.y())/totalNy;
 				Ray r = cam.get_ray(u,v);
 
-				accum += color(r, world, random, totalNumRays);
+				HitRecord hit;
+				bool isHit = world.hit(r, farPlane, hit);
+				if(aovTile)
+				{
+					// hit is only filled in when the ray hits something
+					PrimaryHit features;
+					if(isHit)
+						features = primaryHit(r, hit);
+					aovTile->addSample(j, i, isHit ? &features : nullptr);
+				}
+				dst.addSample(j, i, color(r, isHit, hit, world, termination, sampleLights, sampler, totalNumRays));
 			}
-			accum /= float(nSamples);
+		}
+
+	if(aovTile)
+		aovs->add(*aovTile);
+}
 
-			dst.pixel(j,i) = accum;
+//--------------------------------------------------------------------------------------------------
+// Same as renderTile, but primary rays for runs of 8 consecutive pixels are traced together as a packet
+void renderTilePackets(
+	Rect window,
+	const Scene& world,
+	const PathTermination& termination,
+	bool sampleLights,
+	Sampler::Type samplerType,
+	AccumulationBuffer& dst,
+	AovBuffer* aovs,
+	unsigned nSamples,
+	const uint8_t* activePixels,
+	size_t& totalNumRays)
+{
+	constexpr size_t kPacketSize = 8;
+	const auto totalNx = dst.width();
+	const auto totalNy = dst.height();
+	const auto& cam = *world.cameras().front();
+	std::optional<AovBuffer::Tile> aovTile;
+	if(aovs)
+		aovTile.emplace(*aovs, window);
+
+	for(size_t i = window.y0; i < window.y1; ++i)
+		for(size_t j0 = window.x0; j0 < window.x1; j0 += kPacketSize)
+		{
+			const auto packetSize = std::min(kPacketSize, window.x1 - j0);
+			uint32_t activeMask = (1 << packetSize) - 1;
+			if(activePixels)
+			{
+				for(size_t lane = 0; lane < packetSize; ++lane)
+				{
+					if(!activePixels[j0 + lane + i * totalNx])
+						activeMask &= ~(1 << lane);
+				}
+				if(!activeMask)
+					continue;
+			}
+
+			for(unsigned s = 0; s < nSamples; ++s)
+			{
+				// Same per pixel sample sequences as renderTile
+				Sampler samplers[kPacketSize];
+				Ray rays[kPacketSize];
+				for(size_t lane = 0; lane < packetSize; ++lane)
+				{
+					if(!(activeMask & (1 << lane)))
+						continue;
+					samplers[lane] = Sampler(samplerType, uint32_t(j0 + lane), uint32_t(i), uint32_t(totalNx), dst.numSamples(j0 + lane, i));
+					auto jitter = samplers[lane].next2D();
+					float u = float(j0+lane+jitter.x())/totalNx;
+					float v = 1.f-float(i+jitter.y())/totalNy;
+					rays[lane] = cam.get_ray(u,v);
+				}
+
+				HitRecord hits[kPacketSize];
+				auto hitMask = world.hit8(rays, activeMask, farPlane, hits);
+
+				// Secondary bounces are incoherent, so trace them one at a time
+				for(size_t lane = 0; lane < packetSize; ++lane)
+				{
+					if(!(activeMask & (1 << lane)))
+						continue;
+					const bool isHit = (hitMask >> lane) & 1;
+					if(aovTile)
+					{
+						PrimaryHit features;
+						if(isHit)
+							features = primaryHit(rays[lane], hits[lane]);
+						aovTile->addSample(j0+lane, i, isHit ? &features : nullptr);
+					}
+					dst.addSample(j0+lane, i, color(rays[lane], isHit, hits[lane], world, termination, sampleLights, samplers[lane], totalNumRays));
+				}
+			}
 		}
+
+	if(aovTile)
+		aovs->add(*aovTile);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Each AOV is written next to the main output, with the AOV name before the extension. E.g. render.albedo.exr
+// AOVs hold unbounded and negative values, so they are always stored as floats: .pfm if the output is .pfm, .exr otherwise
+std::string aovFileName(const std::string& output, const char* aovName)
+{
+	auto extension = output.find_last_of('.');
+	if(extension == std::string::npos || output.find_first_of("/\\", extension) != std::string::npos)
+		extension = output.size();
+	const bool isPfm = output.substr(extension) == ".pfm";
+	return output.substr(0, extension) + "." + aovName + (isPfm ? ".pfm" : ".exr");
 }
 
 struct ThreadInfo
 {
-	RandomGenerator random;
 	size_t totalTracedRays = 0;
+	size_t visitedNodes = 0;
 };
 
 //--------------------------------------------------------------------------------------------------
@@ -126,65 +294,218 @@ int main(int _argc, const char** _argv)
 {
 	CmdLineParams params(_argc, _argv);
 	params.overrideMaterials = true;
-	Rect size {0, 0, params.sx, params.sy };
 
-	Image outputImage(params.sx, params.sy);
+	// Allocate threads to consume
+	ThreadPool::Options poolOptions;
+	poolOptions.pinThreads = params.pinThreads;
+	poolOptions.numaAware = params.numa;
+	ThreadPool taskQueue(params.nThreads, poolOptions);
 
 	// Scene
 	Scene world;
     auto t0 = chrono::high_resolution_clock().now();
-	world.loadFromCommandLine(params);
+	world.loadFromCommandLine(params, taskQueue);
     auto loadTime = chrono::high_resolution_clock().now() - t0;
     cout << "Loaded acceleration structure in " << chrono::duration_cast<chrono::milliseconds>(loadTime).count() << " milliseconds\n";
 
-	// Divide the image in tiles that can be consumed as jobs
-	if(!(size.x1%params.tileSize == 0) ||
-		!(size.y1%params.tileSize == 0))
+	// Prepare independent data for each thread
+	std::vector<ThreadInfo> threadData(taskQueue.numWorkers());
+	PathTermination termination;
+	termination.maxBounces = params.maxBounces;
+	termination.rouletteDepth = params.rouletteDepth;
+	WavefrontIntegrator integrator(termination, params.sampleLights, params.sampler);
+	AccumulationBuffer accumulation(params.sx, params.sy);
+	const size_t numPixels = size_t(params.sx) * params.sy;
+	// The denoiser is guided by albedo and normals, even if they are not written out
+	uint32_t outputAovs = 0;
+	if(!params.aovs.empty())
 	{
-		std::cout << "Incompatible tile and image size. Image size (" << size.x1 << "x" << size.y1 << ") must be an exact multiple of tile size (" << params.tileSize << ")\n";
-		return -1;
+		outputAovs = AovBuffer::parseChannels(params.aovs);
+		if(!outputAovs)
+		{
+			cout << "Unknown AOV in " << params.aovs << "\n";
+			return -1;
+		}
 	}
+	const uint32_t aovChannels = outputAovs | (params.denoise ? AovBuffer::Albedo | AovBuffer::Normal : 0);
+	std::optional<AovBuffer> aovs;
+	if(aovChannels)
+		aovs.emplace(params.sx, params.sy, aovChannels);
+	AovBuffer* aovTarget = aovs ? &*aovs : nullptr;
 
-	// Prepare independent data for each thread
-	std::vector<ThreadInfo> threadData(params.nThreads);
+	// Divide the image in tiles that can be consumed as jobs
+	TileScheduler tiles(params.sx, params.sy, params.tileSize, params.hilbertTiles ? TileScheduler::Order::Hilbert : TileScheduler::Order::Scanline);
 
-	// Allocate threads to consume
-	ThreadPool taskQueue(params.nThreads);
-
-    // Dispatch compute
-    const auto xTiles = (size.x1 + params.tileSize -1) / params.tileSize;
-    const auto yTiles = (size.y1 + params.tileSize -1) / params.tileSize;
-
-	if(taskQueue.dispatch(
-        xTiles * yTiles,
-		[xTiles, &threadData,
-        &world,
-		&outputImage, params]
-		(size_t taskIndex, size_t workerIndex){
-            // Compute the boundaries of the tile to be rendered by this thread
-            Rect tile;
-            auto tx = taskIndex % xTiles;
-            tile.x0 = tx * params.tileSize;
-            auto ty = taskIndex / xTiles;
-            tile.y0 = ty * params.tileSize;
-            tile.x1 = tile.x0 + params.tileSize;
-            tile.y1 = tile.y0 + params.tileSize;
-
-            renderTile(tile, world, outputImage, threadData[workerIndex].random, params.ns, threadData[workerIndex].totalTracedRays);
-		},
-		cout))
+	// Single pass renders to .exr write each tile to disk as soon as it's done, unless the whole image must be denoised first
+	const bool progressive = params.maxTime > 0 || params.noiseTarget > 0;
+	const bool adaptive = params.adaptiveThreshold > 0;
+	std::unique_ptr<TiledExrWriter> tileWriter;
+	if(!progressive && !adaptive && !params.wavefront && !params.denoise && params.output.ends_with(".exr"))
 	{
-		// Save final image
-		outputImage.saveAsSRGB(params.output.c_str());
+		tileWriter = std::make_unique<TiledExrWriter>(params.output.c_str(), params.sx, params.sy, params.tileSize, ExrCompression::Zip);
+		if(!tileWriter->isOpen())
+		{
+			cout << "Unable to open " << params.output << " for writing\n";
+			return -1;
+		}
+	}
+	auto writeTile = [&](size_t tileIndex) {
+		if(!tileWriter)
+			return;
+		auto& tile = tiles.tile(tileIndex);
+		std::vector<Vec3f> pixels;
+		pixels.reserve(tile.area());
+		for(size_t y = tile.y0; y < tile.y1; ++y)
+			for(size_t x = tile.x0; x < tile.x1; ++x)
+				pixels.push_back(accumulation.mean(x, y));
+		tileWriter->writeTile(tile.x0, tile.y0, tile.x1, tile.y1, pixels.data());
+	};
 
-		size_t numTracesRays = 0;
-		for (auto& t : threadData)
-			numTracesRays += t.totalTracedRays;
+	float denoiseSeconds = 0;
+	auto saveOutput = [&]() {
+		Image outputImage(params.sx, params.sy);
+		accumulation.resolve(outputImage);
+		if(params.denoise)
+		{
+			Image albedo(params.sx, params.sy);
+			Image normal(params.sx, params.sy);
+			aovs->resolve(AovBuffer::Albedo, accumulation, albedo);
+			aovs->resolve(AovBuffer::Normal, accumulation, normal);
+			std::vector<float> variance(numPixels);
+			for(size_t y = 0; y < params.sy; ++y)
+				for(size_t x = 0; x < params.sx; ++x)
+					variance[x + y * params.sx] = accumulation.meanVariance(x, y);
+			Image denoised(params.sx, params.sy);
+			const auto denoiseStart = chrono::high_resolution_clock::now();
+			denoise(outputImage, variance, albedo, normal, denoised, taskQueue);
+			denoiseSeconds = chrono::duration<float>(chrono::high_resolution_clock::now() - denoiseStart).count();
+			denoised.save(params.output.c_str());
+		}
+		else
+			outputImage.save(params.output.c_str());
+	};
 
-		std::cout << "Num rays: " << numTracesRays << "\n";
+	// Adds nSamples samples to each active pixel. All pixels are active if activePixels is null
+	auto renderPass = [&](unsigned nSamples, const uint8_t* activePixels, bool logMetrics) -> bool
+	{
+		if(params.wavefront)
+		{
+			integrator.render(world, *world.cameras().front(), accumulation, aovTarget, nSamples, activePixels, taskQueue);
+			return true;
+		}
 
-        return 0;
+		auto renderTask = [&](const Rect& tile, size_t workerIndex) {
+			auto& threadInfo = threadData[workerIndex];
+			if(params.packets)
+				renderTilePackets(tile, world, termination, params.sampleLights, params.sampler, accumulation, aovTarget, nSamples, activePixels, threadInfo.totalTracedRays);
+			else
+				renderTile(tile, world, termination, params.sampleLights, params.sampler, accumulation, aovTarget, nSamples, activePixels, threadInfo.totalTracedRays);
+			threadInfo.visitedNodes += CWBVH::consumeVisitedNodeCount();
+		};
+		return tiles.renderPass(taskQueue, renderTask, writeTile, logMetrics ? &cout : nullptr);
 	};
 
-	return -1; // Something failed, we shouldn't reach this point
-}
\ No newline at end of file
+	// Dispatch compute
+	using Seconds = chrono::duration<float>;
+	const auto renderStart = chrono::high_resolution_clock::now();
+
+	// Without a progressive limit, adaptive renders take as many samples as a uniform render would, but spend them
+	// in smaller passes so converged pixels can stop early. At least two samples are needed to estimate variance.
+	const unsigned samplesPerPass = (adaptive && !progressive) ? std::max(2u, params.ns / 4) : params.ns;
+	const uint64_t sampleBudget = uint64_t(params.ns) * numPixels;
+
+	std::vector<uint8_t> activePixels;
+	auto lastWrite = renderStart;
+	auto passStart = renderStart;
+	for(unsigned pass = 0;; ++pass)
+	{
+		const uint8_t* passPixels = nullptr;
+		if(adaptive && pass > 0)
+		{
+			auto samplesLeft = sampleBudget - std::min(sampleBudget, accumulation.totalSamples());
+			auto maxPixels = progressive ? numPixels : size_t(samplesLeft / samplesPerPass);
+			if(!accumulation.selectNoisyPixels(params.adaptiveThreshold, maxPixels, activePixels))
+				break; // Converged, or out of budget
+			passPixels = activePixels.data();
+		}
+
+		if(!renderPass(samplesPerPass, passPixels, !progressive && !adaptive && !params.wavefront))
+			return -1; // Something failed, we shouldn't reach this point
+
+		if(!progressive)
+		{
+			if(!adaptive)
+				break;
+			continue;
+		}
+
+		// Keep adding passes until we run out of time or the image is clean enough
+		const auto passEnd = chrono::high_resolution_clock::now();
+		const auto elapsed = Seconds(passEnd - renderStart).count();
+		const auto passTime = Seconds(passEnd - passStart).count();
+		passStart = passEnd;
+		const auto noise = accumulation.meanRelativeError();
+		cout << "Pass " << pass << ": " << double(accumulation.totalSamples()) / numPixels << " spp, noise " << noise << ", " << elapsed << " seconds\n";
+
+		// Assume the next pass will take as long as this one, so we don't overshoot the time budget
+		if(params.maxTime > 0 && elapsed + passTime > params.maxTime)
+			break;
+		if(params.noiseTarget > 0 && noise <= params.noiseTarget)
+			break;
+
+		if(params.writeInterval > 0 && Seconds(passEnd - lastWrite).count() >= params.writeInterval)
+		{
+			saveOutput();
+			lastWrite = passEnd;
+		}
+	}
+	if(progressive || adaptive || params.wavefront)
+		cout << "Running time: " << Seconds(chrono::high_resolution_clock::now() - renderStart).count() << " seconds\n";
+
+	// Save final image. Streamed renders are already on disk
+	if(!tileWriter)
+		saveOutput();
+	if(params.denoise)
+	{
+		const double megapixels = double(numPixels) / 1e6;
+		cout << "Denoising time: " << denoiseSeconds * 1e3f << " ms, " << denoiseSeconds * 1e3 / megapixels << " ms per megapixel\n";
+	}
+
+	std::cout << "Samples: " << accumulation.totalSamples() << " total, " << double(accumulation.totalSamples()) / numPixels
+		<< " per pixel on average (min " << accumulation.minSamples() << ", max " << accumulation.maxSamples() << ")\n";
+	if(!params.heatmap.empty())
+	{
+		Image heatmap(params.sx, params.sy);
+		accumulation.sampleCountHeatmap(heatmap);
+		heatmap.saveAsLinearRGB(params.heatmap.c_str());
+	}
+	if(outputAovs)
+	{
+		Image aovImage(params.sx, params.sy);
+		for(uint32_t channel = 1; channel <= AovBuffer::kAllChannels; channel <<= 1)
+		{
+			if(!(outputAovs & channel))
+				continue;
+			aovs->resolve(AovBuffer::Channel(channel), accumulation, aovImage);
+			aovImage.save(aovFileName(params.output, AovBuffer::channelName(AovBuffer::Channel(channel))).c_str());
+		}
+	}
+
+	size_t numTracesRays = 0;
+	size_t visitedNodes = 0;
+	if(params.wavefront)
+	{
+		numTracesRays = integrator.numTracedRays();
+		visitedNodes = integrator.numVisitedNodes();
+	}
+	for (auto& t : threadData)
+	{
+		numTracesRays += t.totalTracedRays;
+		visitedNodes += t.visitedNodes;
+	}
+
+	std::cout << "Num rays: " << numTracesRays << "\n";
+	std::cout << "BVH nodes visited per ray: " << double(visitedNodes) / numTracesRays << "\n";
+
+	return 0;
+}
@@ -21,6 +21,10 @@
 
 #include "material.h"
 #include <math/ray.h>
+#include <sampler.h>
+
+// Albedo of all surfaces when scene materials are overridden
+constexpr float DefaultAlbedo = 0.75f;
 
 inline bool lambertScatter(
     const math::Ray& in,
@@ -30,13 +34,14 @@ inline bool lambertScatter(
     math::Vec3f& attenuation,
     math::Vec3f& emitted,
     math::Ray& out,
-    RandomGenerator& random
+    Sampler& sampler
 )
 {
     emitted = math::Vec3f(0.f);
     bool normalSignFlip = dot(normal, in.direction()) > 0.f;
-    auto target = (normalSignFlip ? -normal : normal) + random.unit_vector();
-    out = math::Ray(pos, normalize(target));
+    auto facingNormal = normalSignFlip ? -normal : normal;
+    auto target = facingNormal + sampler.unitVector();
+    out = math::Ray(pos + math::SurfaceOffset * facingNormal, normalize(target));
     attenuation = albedo;
     return true;
 }
@@ -118,7 +118,9 @@ namespace math
             auto tLeave = math::max(t2, t1);
             auto maxEnter = math::max(tEnter.x(), math::max(tEnter.y(), math::max(tEnter.z(), 0.f)));
             auto minLeave = math::min(tLeave.x(), math::min(tLeave.y(), math::min(tLeave.z(), _tmax)));
-            return minLeave >= maxEnter;
+            // Conservative against rounding, so flat boxes and rays through their borders aren't culled
+            constexpr float kLeaveScale = 1.f + 2 * 3 * 0x1p-24f;
+            return minLeave * kLeaveScale >= maxEnter;
         }
 	private:
 		Vector mMin;
@@ -0,0 +1,127 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//--------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "vector.h"
+
+namespace math
+{
+	// Piecewise constant distribution over [0,1), with one bucket per weight
+	class Distribution1D
+	{
+	public:
+		Distribution1D() = default;
+		Distribution1D(const float* weights, size_t n)
+			: mWeights(weights, weights + n)
+			, mCdf(n + 1)
+		{
+			mCdf[0] = 0.f;
+			for(size_t i = 0; i < n; ++i)
+				mCdf[i + 1] = mCdf[i] + mWeights[i];
+			mTotal = mCdf[n];
+			mWeightSum = mTotal;
+
+			// All zero weights. Fall back to uniform so there is still something to sample
+			if(!(mTotal > 0))
+			{
+				std::fill(mWeights.begin(), mWeights.end(), 1.f);
+				for(size_t i = 0; i <= n; ++i)
+					mCdf[i] = float(i);
+				mTotal = float(n);
+			}
+
+			for(auto& c : mCdf)
+				c /= mTotal;
+		}
+
+		size_t size() const { return mWeights.size(); }
+		// Sum of the weights used to build the distribution
+		float total() const { return mWeightSum; }
+
+		// Maps u in [0,1) to a value in [0,1) with density pdf. bucket receives the index of the chosen bucket.
+		float sample(float u, float& pdf, size_t& bucket) const
+		{
+			const auto n = size();
+			bucket = std::clamp<size_t>(std::upper_bound(mCdf.begin(), mCdf.end(), u) - mCdf.begin(), 1, n) - 1;
+			const auto width = mCdf[bucket + 1] - mCdf[bucket];
+			const auto du = width > 0 ? (u - mCdf[bucket]) / width : 0.f;
+			pdf = mWeights[bucket] * n / mTotal;
+			return std::min((bucket + du) / n, 1.f - 1e-7f);
+		}
+
+		float pdf(float x) const
+		{
+			const auto n = size();
+			const auto bucket = std::min(size_t(std::max(x, 0.f) * n), n - 1);
+			return mWeights[bucket] * n / mTotal;
+		}
+
+	private:
+		std::vector<float> mWeights;
+		std::vector<float> mCdf;
+		float mTotal = 0.f; // Of mWeights, after the uniform fallback
+		float mWeightSum = 0.f;
+	};
+
+	// Piecewise constant distribution over [0,1)^2, built from a grid of weights stored in rows.
+	// Picks a row from the marginal distribution of the rows, then a column within that row.
+	class Distribution2D
+	{
+	public:
+		Distribution2D() = default;
+		Distribution2D(const float* weights, size_t width, size_t height)
+		{
+			mRows.reserve(height);
+			std::vector<float> rowTotals(height);
+			for(size_t y = 0; y < height; ++y)
+			{
+				mRows.emplace_back(&weights[y * width], width);
+				rowTotals[y] = mRows.back().total();
+			}
+			mMarginal = Distribution1D(rowTotals.data(), height);
+		}
+
+		Vec2f sample(float u0, float u1, float& pdf) const
+		{
+			float pdfY, pdfX;
+			size_t row;
+			const float y = mMarginal.sample(u1, pdfY, row);
+			size_t column;
+			const float x = mRows[row].sample(u0, pdfX, column);
+			pdf = pdfX * pdfY;
+			return { x, y };
+		}
+
+		float pdf(const Vec2f& uv) const
+		{
+			const auto n = mRows.size();
+			const auto row = std::min(size_t(std::max(uv.y(), 0.f) * n), n - 1);
+			return mMarginal.pdf(uv.y()) * mRows[row].pdf(uv.x());
+		}
+
+	private:
+		std::vector<Distribution1D> mRows;
+		Distribution1D mMarginal;
+	};
+}
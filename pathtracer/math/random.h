@@ -22,16 +22,44 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
-#include <random>
+#include <bit>
+#include <cstdint>
 #include "constants.h"
 #include "vector.h"
+#include "vectorFloat.h"
 
+// PCG32 generator (O'Neill 2014). 64 bits of state, and a selectable stream,
+// so each pixel and sample can get its own independent sequence.
 class RandomGenerator
 {
 public:
+	RandomGenerator(uint64_t seed = 0x853c49e6748fea9bull, uint64_t stream = 0xda3e39cb94b95bdbull)
+	{
+		this->seed(seed, stream);
+	}
+
+	void seed(uint64_t seed, uint64_t stream)
+	{
+		mState = 0;
+		mInc = (stream << 1) | 1;
+		next();
+		mState += seed;
+		next();
+	}
+
+	uint32_t next()
+	{
+		auto oldState = mState;
+		mState = oldState * kMultiplier + mInc;
+		auto xorShifted = uint32_t(((oldState >> 18) ^ oldState) >> 27);
+		auto rotation = int(oldState >> 59);
+		return std::rotr(xorShifted, rotation);
+	}
+
+	// Uniform float in [0, 1)
 	float scalar()
 	{
-		return distrib(engine);
+		return (next() >> 8) * 0x1p-24f;
 	}
 	
 	math::Vec3f unit_vector()
@@ -44,7 +72,84 @@ public:
 			sin(theta)*sinPhi,
 			cosPhi);
 	}
+
+	static constexpr uint64_t kMultiplier = 6364136223846793005ull;
+
+private:
+	friend class RandomGenerator8;
+
+	uint64_t mState;
+	uint64_t mInc;
+};
+
+// Eight PCG32 generators advanced together with AVX2.
+// Each lane produces exactly the same sequence as the scalar generator it was loaded from,
+// so batched code can draw samples for several pixels at once without changing their streams.
+class RandomGenerator8
+{
+public:
+	void load(const RandomGenerator* generators)
+	{
+		for(int half = 0; half < 2; ++half)
+		{
+			auto g = generators + 4 * half;
+			mState[half] = _mm256_set_epi64x(g[3].mState, g[2].mState, g[1].mState, g[0].mState);
+			mInc[half] = _mm256_set_epi64x(g[3].mInc, g[2].mInc, g[1].mInc, g[0].mInc);
+		}
+	}
+
+	void store(RandomGenerator* generators) const
+	{
+		alignas(32) uint64_t state[4];
+		for(int half = 0; half < 2; ++half)
+		{
+			_mm256_store_si256(reinterpret_cast<__m256i*>(state), mState[half]);
+			for(int i = 0; i < 4; ++i)
+				generators[4 * half + i].mState = state[i];
+		}
+	}
+
+	// Uniform floats in [0, 1), one per lane
+	math::float8 scalar()
+	{
+		// Results are computed in the low half of 64 bit lanes. Gather them into consecutive 32 bit lanes
+		const auto lowDwords = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+		auto low = _mm256_permutevar8x32_epi32(nextHalf(0), lowDwords);
+		auto high = _mm256_permutevar8x32_epi32(nextHalf(1), lowDwords);
+		auto bits = _mm256_permute2x128_si256(low, high, 0x20);
+
+		auto mantissa = _mm256_cvtepi32_ps(_mm256_srli_epi32(bits, 8));
+		return math::float8(_mm256_mul_ps(mantissa, _mm256_set1_ps(0x1p-24f)));
+	}
+
 private:
-	std::default_random_engine engine;
-	std::uniform_real_distribution<float> distrib;
+	// Low 64 bits of a 64x64 bit product, from 32x32 bit products
+	static __m256i mul64(__m256i a, __m256i b)
+	{
+		auto lowProduct = _mm256_mul_epu32(a, b);
+		auto crossProducts = _mm256_add_epi64(
+			_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+			_mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+		return _mm256_add_epi64(lowProduct, _mm256_slli_epi64(crossProducts, 32));
+	}
+
+	// Advances 4 generators, and returns their outputs in the low 32 bits of each 64 bit lane
+	__m256i nextHalf(int half)
+	{
+		auto oldState = mState[half];
+		mState[half] = _mm256_add_epi64(mul64(oldState, _mm256_set1_epi64x(RandomGenerator::kMultiplier)), mInc[half]);
+
+		const auto low32 = _mm256_set1_epi64x(0xffffffff);
+		auto xorShifted = _mm256_and_si256(
+			_mm256_srli_epi64(_mm256_xor_si256(_mm256_srli_epi64(oldState, 18), oldState), 27),
+			low32);
+		auto rotation = _mm256_srli_epi64(oldState, 59);
+		auto rotated = _mm256_or_si256(
+			_mm256_srlv_epi64(xorShifted, rotation),
+			_mm256_sllv_epi64(xorShifted, _mm256_sub_epi64(_mm256_set1_epi64x(32), rotation)));
+		return _mm256_and_si256(rotated, low32);
+	}
+
+	__m256i mState[2]; // Lanes 0-3, and 4-7
+	__m256i mInc[2];
 };
@@ -24,6 +24,9 @@
 
 namespace math
 {
+	// How far from a surface secondary rays start, so they don't hit the surface they leave
+	constexpr float SurfaceOffset = 1e-4f;
+
 	class Ray
 	{
 	public:
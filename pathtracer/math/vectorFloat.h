@@ -228,6 +228,23 @@ namespace math
 
 		explicit float8(__m256 x) : m(x) {}
 
+		// p must be 32 byte aligned
+		void store(float* p) const
+		{
+			_mm256_store_ps(p, m);
+		}
+
+		// For pointers with any alignment
+		static float8 loadUnaligned(const float* p)
+		{
+			return float8(_mm256_loadu_ps(p));
+		}
+
+		void storeUnaligned(float* p) const
+		{
+			_mm256_storeu_ps(p, m);
+		}
+
 		float8 operator+(const float8& b) const
 		{
 			return float8(_mm256_add_ps(m, b.m));
@@ -249,12 +266,55 @@ namespace math
 		}
 
 		// this*b + c;
-		float8 mul_add(const float8& b, const float8& c)
+		float8 mul_add(const float8& b, const float8& c) const
 		{
 			return float8(_mm256_fmadd_ps(m,b.m,c.m));
 		}
 
-	private:
+		float8 operator<=(const float8& b) const {
+			return float8(_mm256_cmp_ps(m, b.m, _CMP_LE_OQ));
+		}
+
+		float8 operator>=(const float8& b) const {
+			return float8(_mm256_cmp_ps(m, b.m, _CMP_GE_OQ));
+		}
+
+		float8 operator<(const float8& b) const {
+			return float8(_mm256_cmp_ps(m, b.m, _CMP_LT_OQ));
+		}
+
+		float8 operator==(const float8& b) const {
+			return float8(_mm256_cmp_ps(m, b.m, _CMP_EQ_OQ));
+		}
+
+		// One bit per lane, set when the lane's sign bit is set (i.e. comparisons that passed)
+		uint32_t mask() const
+		{
+			return uint32_t(_mm256_movemask_ps(m));
+		}
+
+		// Converts 8 consecutive bytes into floats
+		static float8 fromBytes(const uint8_t* p)
+		{
+			auto bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+			return float8(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes)));
+		}
+
 		__m256 m;
 	};
+
+	inline auto min(float8 a, float8 b)
+	{
+		return float8(_mm256_min_ps(a.m,b.m));
+	}
+
+	inline auto max(float8 a, float8 b)
+	{
+		return float8(_mm256_max_ps(a.m,b.m));
+	}
+
+	inline auto abs(float8 a)
+	{
+		return float8(_mm256_andnot_ps(_mm256_set1_ps(-0.f), a.m));
+	}
 }
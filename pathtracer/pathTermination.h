@@ -0,0 +1,48 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <algorithm>
+
+#include <math/vector.h>
+#include <sampler.h>
+
+// When paths stop bouncing
+struct PathTermination
+{
+	int maxBounces = 9; // Paths are cut after this many bounces, even if they still carry light
+	int rouletteDepth = 3; // Russian roulette starts after this many bounces
+
+	// Randomly ends paths that carry little light, with probability based on their throughput.
+	// Surviving paths are scaled up to compensate, so the estimate stays unbiased.
+	// Returns false if the path must stop.
+	bool russianRoulette(int depth, math::Vec3f& throughput, Sampler& sampler) const
+	{
+		if(depth < rouletteDepth)
+			return true;
+
+		// Capped below 1, so paths between perfect reflectors still end
+		const float survival = std::min(0.95f, std::max(throughput.x(), std::max(throughput.y(), throughput.z())));
+		if(sampler.next1D() >= survival)
+			return false;
+		throughput /= survival;
+		return true;
+	}
+};
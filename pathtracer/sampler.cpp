@@ -0,0 +1,261 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "sampler.h"
+
+#include <cmath>
+#include <vector>
+
+namespace {
+	// Side of the blue noise mask, which tiles the image
+	constexpr uint32_t kBlueNoiseSize = 64;
+
+	//----------------------------------------------------------------------------------------------
+	// Integer hash with low bias (Wellons' lowbias32)
+	uint32_t hash(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x21f0aaadu;
+		x ^= x >> 15;
+		x *= 0x735a2d97u;
+		x ^= x >> 15;
+		return x;
+	}
+
+	//----------------------------------------------------------------------------------------------
+	uint32_t hashCombine(uint32_t seed, uint32_t value)
+	{
+		return seed ^ (hash(value) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+	}
+
+	//----------------------------------------------------------------------------------------------
+	constexpr uint32_t reverseBits(uint32_t x)
+	{
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+		x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+		return (x >> 16) | (x << 16);
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Owen scrambling of bit reversed values. Each bit is flipped based on the bits below it (Laine and Karras 2011)
+	uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed)
+	{
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return x;
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Owen scrambling of the bits of x, from the most significant down (Burley 2020)
+	uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+	{
+		return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Generator matrix of the second dimension of the Sobol sequence, applied a byte of the index at a time.
+	// Scrambled indices use all 32 bits, so this is much faster than going bit by bit.
+	// Results are bit reversed, ready to be scrambled.
+	struct SobolSecondDimensionTables
+	{
+		constexpr SobolSecondDimensionTables()
+		{
+			uint32_t directions[32] = {};
+			uint32_t v = 1u << 31;
+			for(int bit = 0; bit < 32; ++bit, v ^= v >> 1)
+				directions[bit] = reverseBits(v);
+			for(int byte = 0; byte < 4; ++byte)
+				for(uint32_t i = 0; i < 256; ++i)
+				{
+					uint32_t result = 0;
+					for(int bit = 0; bit < 8; ++bit)
+						if(i & (1u << bit))
+							result ^= directions[8 * byte + bit];
+					table[byte][i] = result;
+				}
+		}
+
+		uint32_t table[4][256] = {};
+	};
+
+	constexpr SobolSecondDimensionTables kSobolTables;
+
+	//----------------------------------------------------------------------------------------------
+	// Second dimension of the Sobol sequence, bit reversed. The first one is reverseBits(index)
+	uint32_t sobolSecondDimensionReversed(uint32_t index)
+	{
+		return kSobolTables.table[0][index & 0xff] ^
+			kSobolTables.table[1][(index >> 8) & 0xff] ^
+			kSobolTables.table[2][(index >> 16) & 0xff] ^
+			kSobolTables.table[3][index >> 24];
+	}
+
+	//----------------------------------------------------------------------------------------------
+	float toUnitFloat(uint32_t x)
+	{
+		return (x >> 8) * 0x1p-24f;
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Threshold mask built with void and cluster (Ulichney 1993). Values are the rank of each pixel, in [0, 1).
+	// The mask tiles seamlessly.
+	std::vector<float> generateBlueNoise()
+	{
+		constexpr int N = int(kBlueNoiseSize);
+		constexpr int kRadius = 6;
+		constexpr float kSigma = 1.5f;
+		float kernel[2 * kRadius + 1][2 * kRadius + 1];
+		for(int dy = -kRadius; dy <= kRadius; ++dy)
+			for(int dx = -kRadius; dx <= kRadius; ++dx)
+				kernel[dy + kRadius][dx + kRadius] = std::exp(-(dx * dx + dy * dy) / (2 * kSigma * kSigma));
+
+		// Energy of each pixel is the sum of the kernel centered at all set pixels
+		std::vector<float> energy(N * N, 0.f);
+		std::vector<uint8_t> isSet(N * N, 0);
+		auto toggle = [&](int p) {
+			isSet[p] = !isSet[p];
+			const float sign = isSet[p] ? 1.f : -1.f;
+			const int px = p % N;
+			const int py = p / N;
+			for(int dy = -kRadius; dy <= kRadius; ++dy)
+				for(int dx = -kRadius; dx <= kRadius; ++dx)
+					energy[(px + dx + N) % N + ((py + dy + N) % N) * N] += sign * kernel[dy + kRadius][dx + kRadius];
+		};
+		auto tightestCluster = [&]() {
+			int best = -1;
+			for(int p = 0; p < N * N; ++p)
+				if(isSet[p] && (best < 0 || energy[p] > energy[best]))
+					best = p;
+			return best;
+		};
+		auto largestVoid = [&]() {
+			int best = -1;
+			for(int p = 0; p < N * N; ++p)
+				if(!isSet[p] && (best < 0 || energy[p] < energy[best]))
+					best = p;
+			return best;
+		};
+
+		// Start from a random pattern, and move points from clusters to voids until it's even
+		const int numInitial = N * N / 10;
+		RandomGenerator random;
+		for(int numSet = 0; numSet < numInitial;)
+		{
+			auto p = int(random.next() % (N * N));
+			if(!isSet[p])
+			{
+				toggle(p);
+				++numSet;
+			}
+		}
+		for(int i = 0; i < N * N; ++i)
+		{
+			auto cluster = tightestCluster();
+			toggle(cluster);
+			auto emptiest = largestVoid();
+			toggle(emptiest);
+			if(emptiest == cluster)
+				break;
+		}
+
+		// Points of the initial pattern are ranked by removing the tightest clusters first,
+		// and the rest by filling the largest voids
+		std::vector<uint32_t> rank(N * N);
+		const auto initialSet = isSet;
+		const auto initialEnergy = energy;
+		for(int r = numInitial - 1; r >= 0; --r)
+		{
+			auto cluster = tightestCluster();
+			rank[cluster] = r;
+			toggle(cluster);
+		}
+		isSet = initialSet;
+		energy = initialEnergy;
+		for(int r = numInitial; r < N * N; ++r)
+		{
+			auto emptiest = largestVoid();
+			rank[emptiest] = r;
+			toggle(emptiest);
+		}
+
+		std::vector<float> mask(N * N);
+		for(int p = 0; p < N * N; ++p)
+			mask[p] = (rank[p] + 0.5f) / (N * N);
+		return mask;
+	}
+
+	//----------------------------------------------------------------------------------------------
+	float blueNoise(uint32_t x, uint32_t y)
+	{
+		static const std::vector<float> mask = generateBlueNoise();
+		return mask[(x % kBlueNoiseSize) + (y % kBlueNoiseSize) * kBlueNoiseSize];
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Toroidal shift of u by the blue noise mask. Each dimension and component reads the mask at a different offset
+	float blueNoiseShift(float u, uint32_t x, uint32_t y, uint32_t seed)
+	{
+		const uint32_t offset = hash(seed);
+		const float shifted = u + blueNoise(x + offset, y + (offset >> 16));
+		return shifted < 1.f ? shifted : shifted - 1.f;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+Sampler::Sampler(Type type, uint32_t x, uint32_t y, uint32_t width, uint32_t sampleIndex)
+	: mRandom(sampleIndex, x + y * width) // Same streams as before samplers existed
+	, mSeed(type == Type::BlueNoise ? 0 : hash(x + y * width))
+	, mIndex(sampleIndex)
+	, mX(uint16_t(x % kBlueNoiseSize))
+	, mY(uint16_t(y % kBlueNoiseSize))
+	, mType(type)
+{}
+
+//--------------------------------------------------------------------------------------------------
+float Sampler::sobol1D(uint32_t dimension) const
+{
+	const auto seed = hashCombine(mSeed, dimension);
+	const auto index = nestedUniformScramble(mIndex, seed);
+	const float u = toUnitFloat(reverseBits(laineKarrasPermutation(index, hashCombine(seed, 0))));
+	if(mType == Type::BlueNoise)
+		return blueNoiseShift(u, mX, mY, hashCombine(seed, 0));
+	return u;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Higher dimensions are padded with independently shuffled and scrambled copies of the first two
+math::Vec2f Sampler::sobol2D(uint32_t dimension) const
+{
+	const auto seed = hashCombine(mSeed, dimension);
+	const auto index = nestedUniformScramble(mIndex, seed);
+	math::Vec2f u(
+		toUnitFloat(reverseBits(laineKarrasPermutation(index, hashCombine(seed, 0)))),
+		toUnitFloat(reverseBits(laineKarrasPermutation(sobolSecondDimensionReversed(index), hashCombine(seed, 1)))));
+	if(mType == Type::BlueNoise)
+	{
+		u.x() = blueNoiseShift(u.x(), mX, mY, hashCombine(seed, 0));
+		u.y() = blueNoiseShift(u.y(), mX, mY, hashCombine(seed, 1));
+	}
+	return u;
+}
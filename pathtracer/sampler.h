@@ -0,0 +1,89 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#include <math/constants.h>
+#include <math/random.h>
+#include <math/vector.h>
+
+// Source of the random numbers of a single pixel sample.
+// Each call draws from the next dimension of the sample, so paths that make the same sequence of calls get
+// well distributed values for each of them.
+class Sampler
+{
+public:
+	enum class Type : uint8_t
+	{
+		Random, // Independent PCG32 streams. White noise
+		Sobol, // Owen scrambled Sobol points (Burley 2020). The samples of a pixel are stratified in each pair of dimensions
+		BlueNoise, // Sobol points shared by all pixels, each shifted by a blue noise mask, so error is spread as blue noise
+	};
+
+	Sampler() = default;
+	// sampleIndex is the number of samples the pixel already took
+	Sampler(Type type, uint32_t x, uint32_t y, uint32_t width, uint32_t sampleIndex);
+
+	// Uniform in [0, 1)
+	float next1D()
+	{
+		if(mType == Type::Random)
+			return mRandom.scalar();
+		return sobol1D(mDimension++);
+	}
+
+	// Uniform in [0, 1)^2
+	math::Vec2f next2D()
+	{
+		if(mType == Type::Random)
+		{
+			const float u = mRandom.scalar();
+			return { u, mRandom.scalar() };
+		}
+		return sobol2D(mDimension++);
+	}
+
+	// Uniform on the unit sphere
+	math::Vec3f unitVector()
+	{
+		auto u = next2D();
+		auto theta = math::TwoPi * u.x();
+		auto cosPhi = 2 * u.y() - 1;
+		auto sinPhi = std::sqrt(1 - cosPhi * cosPhi);
+		return math::Vec3f(
+			std::cos(theta) * sinPhi,
+			std::sin(theta) * sinPhi,
+			cosPhi);
+	}
+
+private:
+	float sobol1D(uint32_t dimension) const;
+	math::Vec2f sobol2D(uint32_t dimension) const;
+
+	RandomGenerator mRandom;
+	uint32_t mSeed = 0; // Decorrelates pixels. Shared by all pixels for blue noise
+	uint32_t mIndex = 0;
+	uint32_t mDimension = 0;
+	uint16_t mX = 0; // Pixel coordinates, used to look up the blue noise mask
+	uint16_t mY = 0;
+	Type mType = Type::Random;
+};
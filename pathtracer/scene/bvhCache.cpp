@@ -0,0 +1,145 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//--------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "bvhCache.h"
+
+#include <collision/BLAS.h>
+
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+
+namespace
+{
+	// Bump this every time the layout of the cached data changes
+	constexpr uint32_t kCacheVersion = 5;
+	constexpr char kCacheMagic[4] = { 'G', 'B', 'V', 'H' };
+
+	struct CacheFileHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t meshHash;
+	};
+
+	// 64 bit FNV-1a
+	uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+	{
+		auto bytes = reinterpret_cast<const uint8_t*>(data);
+		for(size_t i = 0; i < size; ++i)
+		{
+			hash ^= bytes[i];
+			hash *= 0x100000001b3ull;
+		}
+		return hash;
+	}
+
+	// Temporary files are unique to each process and call, so concurrent writers of the same entry never share one
+	std::string uniqueTmpName(const std::string& dstName)
+	{
+		static const uint64_t processToken = (uint64_t(std::random_device()()) << 32) | std::random_device()();
+		static std::atomic<uint32_t> callCount = 0;
+		char suffix[48];
+		snprintf(suffix, sizeof(suffix), ".%016llx.%u.tmp", (unsigned long long)processToken, unsigned(callCount++));
+		return dstName + suffix;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+BVHCache::BVHCache(const std::string& directory)
+	: mDirectory(directory)
+{
+	std::error_code error;
+	std::filesystem::create_directories(mDirectory, error);
+	if(error)
+		std::cout << "Unable to create BVH cache directory " << mDirectory << ": " << error.message() << "\n";
+}
+
+//--------------------------------------------------------------------------------------------------
+uint64_t BVHCache::hashMesh(std::span<const math::Vec3f> vertices, std::span<const uint32_t> indices, CWBVH::BuildQuality quality, uint32_t maxLeafSize)
+{
+	uint64_t hash = fnv1a(vertices.data(), vertices.size_bytes());
+	hash = fnv1a(indices.data(), indices.size_bytes(), hash);
+	hash = fnv1a(&quality, sizeof(quality), hash);
+	return fnv1a(&maxLeafSize, sizeof(maxLeafSize), hash);
+}
+
+//--------------------------------------------------------------------------------------------------
+bool BVHCache::load(uint64_t meshHash, BLAS& dst)
+{
+	std::ifstream file(fileName(meshHash), std::ios::binary);
+	CacheFileHeader header;
+	if(file.read(reinterpret_cast<char*>(&header), sizeof(header))
+		&& std::equal(header.magic, header.magic + 4, kCacheMagic)
+		&& header.version == kCacheVersion
+		&& header.meshHash == meshHash)
+	{
+		CWBVH::alignStream(file);
+		if(dst.load(file))
+		{
+			++mHits;
+			return true;
+		}
+	}
+
+	++mMisses;
+	return false;
+}
+
+//--------------------------------------------------------------------------------------------------
+void BVHCache::store(uint64_t meshHash, const BLAS& blas)
+{
+	// Write to a temporary file first, so other processes never see partial files
+	auto dstName = fileName(meshHash);
+	auto tmpName = uniqueTmpName(dstName);
+	{
+		std::ofstream file(tmpName, std::ios::binary);
+		CacheFileHeader header;
+		std::copy(kCacheMagic, kCacheMagic + 4, header.magic);
+		header.version = kCacheVersion;
+		header.meshHash = meshHash;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		CWBVH::alignStream(file);
+		blas.save(file);
+		if(!file)
+		{
+			std::cout << "Unable to write BVH cache file " << tmpName << "\n";
+			file.close();
+			std::error_code error;
+			std::filesystem::remove(tmpName, error);
+			return;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tmpName, dstName, error);
+	if(error)
+		std::filesystem::remove(tmpName, error);
+}
+
+//--------------------------------------------------------------------------------------------------
+std::string BVHCache::fileName(uint64_t meshHash) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.blas", (unsigned long long)meshHash);
+	return (std::filesystem::path(mDirectory) / name).string();
+}
@@ -0,0 +1,55 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//--------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include <collision/CWBVH.h>
+#include <math/vector.h>
+
+class BLAS;
+
+// Stores built BLASes on disk, so later runs can skip their construction.
+// Each BLAS goes to its own file, named after a hash of the mesh it was built from.
+class BVHCache
+{
+public:
+	BVHCache(const std::string& directory);
+
+	// Content hash of a mesh. Meshes with the same hash produce the same BLAS
+	static uint64_t hashMesh(std::span<const math::Vec3f> vertices, std::span<const uint32_t> indices, CWBVH::BuildQuality quality, uint32_t maxLeafSize);
+
+	// Returns true and fills dst if the mesh was found in the cache
+	bool load(uint64_t meshHash, BLAS& dst);
+	void store(uint64_t meshHash, const BLAS& blas);
+
+	size_t hits() const { return mHits; }
+	size_t misses() const { return mMisses; }
+
+private:
+	std::string fileName(uint64_t meshHash) const;
+
+	std::string mDirectory;
+	std::atomic<size_t> mHits = 0;
+	std::atomic<size_t> mMisses = 0;
+};
@@ -27,6 +27,7 @@
 #include "math/quaterrnion.h"
 #include "math/vector.h"
 #include <fx/gltf.h>
+#include <numeric>
 
 using namespace math;
 using namespace fx;
@@ -205,13 +206,18 @@ namespace { // Auxiliary functions
 	}
 
 	//----------------------------------------------------------------------------------------------
-	std::vector<uint16_t> readIndices(const fx::gltf::Document& document, const std::vector<uint8_t>& bufferData, uint32_t accessorNdx)
+	std::vector<uint32_t> readIndices(const fx::gltf::Document& document, const std::vector<uint8_t>& bufferData, uint32_t accessorNdx)
 	{
 		auto& accessor = document.accessors[accessorNdx];
-		if(accessor.componentType == fx::gltf::Accessor::ComponentType::UnsignedByte)
-			return readAttribute<uint16_t,uint8_t>(document, bufferData, accessorNdx);
-		else 
-			return readAttribute<uint16_t>(document, bufferData, accessorNdx);
+		switch(accessor.componentType)
+		{
+			case fx::gltf::Accessor::ComponentType::UnsignedByte:
+				return readAttribute<uint32_t,uint8_t>(document, bufferData, accessorNdx);
+			case fx::gltf::Accessor::ComponentType::UnsignedShort:
+				return readAttribute<uint32_t,uint16_t>(document, bufferData, accessorNdx);
+			default:
+				return readAttribute<uint32_t>(document, bufferData, accessorNdx);
+		}
 	}
 
 	//----------------------------------------------------------------------------------------------
@@ -226,11 +232,17 @@ namespace { // Auxiliary functions
 		std::vector<uint32_t> primitives;
 		for(auto& primitiveDesc : meshDesc.primitives)
 		{
-			auto indices = readIndices(document, bufferData, primitiveDesc.indices);
 			auto position = readAttribute<math::Vec3f>(document, bufferData, primitiveDesc.attributes.at("POSITION"));
+			std::vector<uint32_t> indices;
+			if(primitiveDesc.indices >= 0)
+				indices = readIndices(document, bufferData, primitiveDesc.indices);
+			else // Non indexed primitives use each vertex once
+			{
+				indices.resize(position.size());
+				std::iota(indices.begin(), indices.end(), 0u);
+			}
 
-            auto numTris = indices.size() / 3;
-            primitives.push_back(dstScene.addBlas(position.data(), indices.data(), numTris));
+            primitives.push_back(dstScene.addBlas(std::move(position), std::move(indices)));
 		}
 
 		return primitives;
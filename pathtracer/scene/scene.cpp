@@ -20,9 +20,12 @@
 
 #include <background.h>
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <memory>
+#include <numeric>
+#include <unordered_set>
 
 #include <collision/CWBVH.h>
 #include "cmdLineParams.h"
@@ -31,7 +34,9 @@
 #include <camera/sphericalCamera.h>
 #include <camera/frustumCamera.h>
 #include <collision/BLAS.h>
+#include "bvhCache.h"
 #include "scene.h"
+#include <threadPool.h>
 
 using namespace std;
 using namespace math;
@@ -43,17 +48,48 @@ bool Scene::hit(
 	HitRecord& collision
 ) const
 {
-    return mTlas.closestHit(r, tMax, collision);
+    return tlas().closestHit(r, tMax, collision);
 }
 
 //--------------------------------------------------------------------------------------------------
-void Scene::loadFromCommandLine(const CmdLineParams& params)
+uint32_t Scene::hit8(
+	const math::Ray* rays,
+	uint32_t activeMask,
+	float tMax,
+	HitRecord* collisions
+) const
+{
+    return tlas().closestHit8(rays, activeMask, tMax, collisions);
+}
+
+//--------------------------------------------------------------------------------------------------
+bool Scene::occluded(const math::Ray& r, float tMax) const
+{
+    return tlas().anyHit(r, tMax);
+}
+
+//--------------------------------------------------------------------------------------------------
+const TLAS& Scene::tlas() const
+{
+    return mNodeTlas.empty() ? mTlas : mNodeTlas[ThreadPool::currentNode()];
+}
+
+//--------------------------------------------------------------------------------------------------
+void Scene::loadFromCommandLine(const CmdLineParams& params, ThreadPool& pool)
 {
 	// Geometry
 	if(!params.scene.empty())
 	{
+		mBvhQuality = params.fastBvh ? CWBVH::BuildQuality::Fast : CWBVH::BuildQuality::SAH;
+		mBlasLeafSize = std::clamp(params.leafSize, 1u, BLAS::kMaxLeafSize);
+		if(!params.bvhCache.empty())
+			mBvhCache = std::make_shared<BVHCache>(params.bvhCache);
 		loadGltf(params.scene.c_str(), *this, float(params.sx)/params.sy, params.overrideMaterials);
-        buildTLAS();
+        buildBLASes(pool);
+        buildTLAS(pool);
+        mTlas.setTraversalOrder(params.unorderedTraversal ? CWBVH::TraversalOrder::Unordered : CWBVH::TraversalOrder::FrontToBack);
+        if(params.numa)
+            replicatePerNode(pool);
 	}
 
 	// Background
@@ -83,17 +119,96 @@ void Scene::loadFromCommandLine(const CmdLineParams& params)
 	}
 }
 
-uint32_t Scene::addBlas(const math::Vec3f* vertices, const uint16_t* indices, uint32_t numTris)
+uint32_t Scene::addBlas(std::vector<math::Vec3f>&& vertices, std::vector<uint32_t>&& indices)
 {
-    mBLASBuffer.push_back(BLAS(vertices, indices, numTris));
-    return uint32_t(mBLASBuffer.size() - 1);
+    mPendingBLASes.push_back({ std::move(vertices), std::move(indices) });
+    return uint32_t(mPendingBLASes.size() - 1);
+}
+
+void Scene::buildBLASes(ThreadPool& pool)
+{
+    auto t0 = chrono::high_resolution_clock::now();
+
+    auto numTris = [this](size_t blasId) { return mPendingBLASes[blasId].indices.size() / 3; };
+
+    mBLASBuffer.resize(mPendingBLASes.size());
+    std::vector<double> buildTimes(mPendingBLASes.size());
+    std::vector<uint64_t> meshHashes(mPendingBLASes.size());
+    std::vector<uint8_t> cached(mPendingBLASes.size(), 0);
+
+    // Try to load all meshes from the cache first
+    if(mBvhCache)
+    {
+        pool.dispatch(mPendingBLASes.size(), [&](size_t blasId, size_t) {
+            auto loadStart = chrono::high_resolution_clock::now();
+            auto& mesh = mPendingBLASes[blasId];
+            meshHashes[blasId] = BVHCache::hashMesh(mesh.vertices, mesh.indices, mBvhQuality, mBlasLeafSize);
+            cached[blasId] = mBvhCache->load(meshHashes[blasId], mBLASBuffer[blasId]);
+            buildTimes[blasId] = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - loadStart).count();
+        });
+    }
+
+    // Build bigger meshes first
+    std::vector<size_t> buildOrder;
+    for(size_t i = 0; i < mPendingBLASes.size(); ++i)
+    {
+        if(!cached[i])
+            buildOrder.push_back(i);
+    }
+    std::sort(buildOrder.begin(), buildOrder.end(), [&](size_t a, size_t b) {
+        return numTris(a) > numTris(b);
+    });
+
+    // Identical meshes produce the same cache entry, so only the first of them stores it
+    std::vector<uint8_t> storeInCache(mPendingBLASes.size(), 0);
+    if(mBvhCache)
+    {
+        std::unordered_set<uint64_t> storedHashes;
+        for(auto blasId : buildOrder)
+            storeInCache[blasId] = storedHashes.insert(meshHashes[blasId]).second;
+    }
+
+    // Meshes are built concurrently, one per task. Big meshes also spread their own build
+    // over the pool through nested dispatches, so a single huge mesh doesn't serialize the build.
+    pool.dispatch(buildOrder.size(), [&](size_t taskNdx, size_t) {
+        auto blasId = buildOrder[taskNdx];
+        auto blasStart = chrono::high_resolution_clock::now();
+        auto& mesh = mPendingBLASes[blasId];
+        mBLASBuffer[blasId] = BLAS(mesh.vertices.data(), mesh.indices.data(), uint32_t(numTris(blasId)), mBvhQuality, &pool, mBlasLeafSize);
+        if(storeInCache[blasId])
+            mBvhCache->store(meshHashes[blasId], mBLASBuffer[blasId]);
+        buildTimes[blasId] += chrono::duration<double, milli>(chrono::high_resolution_clock::now() - blasStart).count();
+    });
+
+    for(size_t i = 0; i < mBLASBuffer.size(); ++i)
+    {
+        std::cout << "BLAS " << i << ": " << numTris(i) << " triangles, " << buildTimes[i] << " ms" << (cached[i] ? " (cached)" : "") << ", SAH cost " << mBLASBuffer[i].sahCost() << "\n";
+    }
+    if(mBvhCache)
+        std::cout << "BVH cache: " << mBvhCache->hits() << " hits, " << mBvhCache->misses() << " misses\n";
+
+    size_t totalTris = 0;
+    for(size_t i = 0; i < mPendingBLASes.size(); ++i)
+        totalTris += numTris(i);
+    size_t instancedTris = 0;
+    for(auto& instance : mInstances)
+        instancedTris += numTris(instance.BlasIndex);
+    std::cout << "Scene: " << mBLASBuffer.size() << " BLASes with " << totalTris << " triangles, "
+        << mInstances.size() << " instances with " << instancedTris << " triangles\n";
+
+    auto dt = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - t0).count();
+    std::cout << "BLAS construction: " << dt << " ms\n";
+
+    // Free source meshes
+    mPendingBLASes.clear();
+    mPendingBLASes.shrink_to_fit();
 }
 
-void Scene::buildTLAS()
+void Scene::buildTLAS(ThreadPool& pool)
 {
     auto t0 = chrono::high_resolution_clock::now();
 
-    mTlas.build(std::move(mBLASBuffer), std::move(mInstances));
+    mTlas.build(std::move(mBLASBuffer), std::move(mInstances), mBvhQuality, &pool);
 
     auto dt = chrono::high_resolution_clock::now() - t0;
     auto us = chrono::duration_cast<chrono::nanoseconds>(dt).count() * 0.001;
@@ -102,4 +217,24 @@ void Scene::buildTLAS()
         std::cout << "BVH construction: " << us << " micros\n";
     else
         std::cout << "BVH construction: " << us*0.001 << " ms\n";
+}
+
+void Scene::replicatePerNode(ThreadPool& pool)
+{
+    if(pool.numNodes() < 2)
+        return;
+
+    auto t0 = chrono::high_resolution_clock::now();
+
+    // Copying from a worker of each node makes the OS place the copy's pages on that node (first touch)
+    mNodeTlas.resize(pool.numNodes());
+    pool.forEachNode([this](size_t node) {
+        mNodeTlas[node] = mTlas;
+    });
+
+    // Only the replicas are used from now on
+    mTlas = TLAS();
+
+    auto dt = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - t0).count();
+    std::cout << "Replicated acceleration structures on " << pool.numNodes() << " NUMA nodes in " << dt << " ms\n";
 }
\ No newline at end of file
@@ -26,7 +26,9 @@
 #include <vector>
 
 struct CmdLineParams;
+class BVHCache;
 class RandomGenerator;
+class ThreadPool;
 class Background;
 
 class Scene
@@ -44,7 +46,8 @@ public:
 		mCameras.emplace_back(cam);
 	}
 
-    uint32_t addBlas(const math::Vec3f* vertices, const uint16_t* indices, uint32_t numTris);
+    // BLAS construction is deferred until the whole scene is loaded, so all meshes can be built concurrently
+    uint32_t addBlas(std::vector<math::Vec3f>&& vertices, std::vector<uint32_t>&& indices);
 
 	const std::vector<std::shared_ptr<Camera>>& cameras() const { return mCameras; }
 	std::vector<std::shared_ptr<Camera>>& cameras() { return mCameras; }
@@ -55,14 +58,41 @@ public:
 		HitRecord& collision
 	) const;
 
-	void loadFromCommandLine(const CmdLineParams&);
+	// Closest hit for a packet of up to 8 coherent rays. Returns the mask of rays in activeMask that hit.
+	uint32_t hit8(
+		const math::Ray* rays,
+		uint32_t activeMask,
+		float tMax,
+		HitRecord* collisions
+	) const;
+
+	// True if there is any geometry along r before tMax
+	bool occluded(const math::Ray& r, float tMax) const;
+
+	void loadFromCommandLine(const CmdLineParams&, ThreadPool& pool);
 
 	Background* background = nullptr;
 
 private:
-    void buildTLAS();
+    void buildBLASes(ThreadPool& pool);
+    void buildTLAS(ThreadPool& pool);
+    // Gives each NUMA node of the pool its own copy of the TLAS and BLASes, allocated from one of its workers
+    void replicatePerNode(ThreadPool& pool);
+    // Acceleration structure local to the calling thread's NUMA node
+    const TLAS& tlas() const;
+
+    struct MeshData
+    {
+        std::vector<math::Vec3f> vertices;
+        std::vector<uint32_t> indices;
+    };
 
+    CWBVH::BuildQuality mBvhQuality = CWBVH::BuildQuality::SAH;
+    uint32_t mBlasLeafSize = BLAS::kDefaultLeafSize;
+    std::shared_ptr<BVHCache> mBvhCache;
     TLAS mTlas;
+    std::vector<TLAS> mNodeTlas; // Per NUMA node replicas of mTlas. Empty when not replicated.
+    std::vector<MeshData> mPendingBLASes;
     std::vector<BLAS> mBLASBuffer;
     std::vector<TLAS::Instance> mInstances;
     std::vector<std::shared_ptr<Camera>>	mCameras;
@@ -22,6 +22,10 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
+#include <bit>
+#include <cstdint>
+#include <utility>
+
 #include <math/ray.h>
 #include <math/vector.h>
 #include "collision.h"
@@ -191,3 +195,160 @@ inline float Triangle::Simd::hitNoBackface(const math::Ray::Simd& r) const
 
     return -1;
 }
+
+// Per ray setup of the watertight ray/triangle test (Woop, Benthin and Wald 2013).
+// Computed once per traversal and shared by all the triangles the ray is tested against.
+struct WatertightRay
+{
+	WatertightRay() = default;
+	explicit WatertightRay(const math::Ray& r)
+		: origin(r.origin())
+	{
+		// Make kz the dominant axis of the direction, keeping the winding of the other two
+		const auto& d = r.direction();
+		auto ad = abs(d);
+		kz = ad.x() > ad.y() ? (ad.x() > ad.z() ? 0 : 2) : (ad.y() > ad.z() ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		if(d[kz] < 0.f)
+			std::swap(kx, ky);
+
+		// Shear that maps the direction to (0,0,1)
+		shear[0] = d[kx] / d[kz];
+		shear[1] = d[ky] / d[kz];
+		shear[2] = 1.f / d[kz];
+	}
+
+	math::Vec3f origin;
+	int kx, ky, kz;
+	float shear[3];
+};
+
+// Up to 8 triangles in structure of arrays layout, tested against a ray at once with AVX.
+// Used as multi triangle BVH leafs. Unused lanes are masked out of every hit.
+struct alignas(32) Triangle8
+{
+	static constexpr uint32_t kWidth = 8;
+
+	void set(uint32_t lane, const Triangle& triangle, uint32_t triangleId)
+	{
+		for(int i = 0; i < 3; ++i)
+			for(int axis = 0; axis < 3; ++axis)
+				v[i][axis][lane] = triangle.vtx(i)[axis];
+		id[lane] = triangleId;
+		laneMask |= 1 << lane;
+	}
+
+	math::Vec3f vtx(uint32_t i, uint32_t lane) const
+	{
+		return math::Vec3f(v[i][0][lane], v[i][1][lane], v[i][2][lane]);
+	}
+
+	// Same normal as Triangle, only computed for the final hit instead of stored
+	math::Vec3f laneNormal(uint32_t lane) const
+	{
+		return Triangle(vtx(0, lane), vtx(1, lane), vtx(2, lane)).normal();
+	}
+
+	// Mask of the triangles hit by the ray in [0, tMax]. Per lane, returns the hit distance in tOut, and
+	// the barycentric coordinates of the hit point in uOut and vOut (weights of the second and third vertices).
+	// Back-facing triangles are ignored, with the same winding as Triangle::Simd::hitNoBackface.
+	// Points on an edge shared by two triangles hit at least one of them.
+	uint32_t hit(const WatertightRay& r, float tMax, float* tOut, float* uOut, float* vOut) const;
+
+	// Lane of the closest triangle hit in [0, tMax], or -1 if there is none
+	int closestHit(const WatertightRay& r, float tMax, float& tOut, math::Vec2f& uvOut) const
+	{
+		alignas(32) float t[kWidth], u[kWidth], w[kWidth];
+		auto hitMask = hit(r, tMax, t, u, w);
+		int closestLane = -1;
+		for(; hitMask; hitMask &= hitMask - 1)
+		{
+			auto lane = std::countr_zero(hitMask);
+			if(t[lane] <= tMax)
+			{
+				tMax = t[lane];
+				closestLane = lane;
+			}
+		}
+		if(closestLane >= 0)
+			uvOut = math::Vec2f(u[closestLane], w[closestLane]);
+		tOut = tMax;
+		return closestLane;
+	}
+
+	float v[3][3][kWidth] = {}; // Vertex, axis, lane
+	uint32_t id[kWidth] = {}; // Index of each triangle in its mesh
+	uint32_t laneMask = 0; // Lanes holding a triangle
+};
+
+inline uint32_t Triangle8::hit(const WatertightRay& r, float tMax, float* tOut, float* uOut, float* vOut) const
+{
+	using math::float8;
+	const float8 sx(r.shear[0]), sy(r.shear[1]), sz(r.shear[2]);
+	const float8 ox(r.origin[r.kx]), oy(r.origin[r.ky]), oz(r.origin[r.kz]);
+
+	// Vertices relative to the ray origin, sheared so the ray runs along z
+	float8 x[3], y[3], z[3];
+	for(int i = 0; i < 3; ++i)
+	{
+		auto pz = float8(v[i][r.kz]) - oz;
+		x[i] = float8(v[i][r.kx]) - ox - sx * pz;
+		y[i] = float8(v[i][r.ky]) - oy - sy * pz;
+		z[i] = sz * pz;
+	}
+
+	// Scaled barycentrics, from the 2D edge functions of the sheared triangle
+	auto U = x[2] * y[1] - y[2] * x[1];
+	auto V = x[0] * y[2] - y[0] * x[2];
+	auto W = x[1] * y[0] - y[1] * x[0];
+
+	const float8 zero(0.f);
+	auto edgeMask = (U == zero).mask() | (V == zero).mask() | (W == zero).mask();
+	if(edgeMask & laneMask) [[unlikely]]
+	{
+		// The ray hits an edge or a vertex in float precision. Redo the edge functions in double,
+		// so neighbouring triangles agree on which side of their shared edge the ray passes
+		alignas(32) float uvw[3][kWidth], xy[2][3][kWidth];
+		U.store(uvw[0]);
+		V.store(uvw[1]);
+		W.store(uvw[2]);
+		for(int i = 0; i < 3; ++i)
+		{
+			x[i].store(xy[0][i]);
+			y[i].store(xy[1][i]);
+		}
+		for(auto lanes = edgeMask & laneMask; lanes; lanes &= lanes - 1)
+		{
+			auto lane = std::countr_zero(lanes);
+			for(int i = 0; i < 3; ++i)
+			{
+				auto a = (i + 1) % 3;
+				auto b = (i + 2) % 3;
+				uvw[i][lane] = float(double(xy[0][b][lane]) * xy[1][a][lane] - double(xy[1][b][lane]) * xy[0][a][lane]);
+			}
+		}
+		U = float8(uvw[0]);
+		V = float8(uvw[1]);
+		W = float8(uvw[2]);
+	}
+
+	// Front facing triangles have all three edge functions positive
+	auto det = U + V + W;
+	uint32_t hitMask = laneMask & ~((U < zero).mask() | (V < zero).mask() | (W < zero).mask() | (det <= zero).mask());
+	if(!hitMask)
+		return 0;
+
+	// Distance scaled by det, so the range test needs no division
+	auto T = U * z[0] + V * z[1] + W * z[2];
+	hitMask &= (T >= zero).mask() & (T <= float8(tMax) * det).mask();
+	if(!hitMask)
+		return 0;
+
+	// Divide the distance to keep it exact where possible. Barycentrics can take the reciprocal
+	(T / det).store(tOut);
+	auto invDet = float8(1.f) / det;
+	(V * invDet).store(uOut);
+	(W * invDet).store(vOut);
+	return hitMask;
+}
@@ -73,7 +73,7 @@ private:
 
     math::AABB mBBox; // Bounding box
 	AABBTree<2> mBVH;
-	std::vector<uint16_t> mIndices;
+	std::vector<uint32_t> mIndices;
 	std::vector<VtxInfo> mVtxData;
     std::shared_ptr<Material> mMaterial;
 };
@@ -0,0 +1,205 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "exrWriter.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "image.h"
+
+// Implemented in stb_image_write.h. Returns a zlib stream allocated with malloc
+unsigned char* stbi_zlib_compress(unsigned char* data, int data_len, int* out_len, int quality);
+
+namespace {
+	constexpr size_t kZipLinesPerBlock = 16;
+
+	//----------------------------------------------------------------------------------------------
+	template<class T>
+	void writeRaw(std::ostream& out, const T& value)
+	{
+		out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	//----------------------------------------------------------------------------------------------
+	void writeAttribute(std::ostream& out, const char* name, const char* type, const void* value, int32_t size)
+	{
+		out.write(name, std::strlen(name) + 1);
+		out.write(type, std::strlen(type) + 1);
+		writeRaw(out, size);
+		out.write(static_cast<const char*>(value), size);
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// tileSize is 0 for scanline files
+	void writeHeader(std::ostream& out, size_t width, size_t height, size_t tileSize, ExrCompression compression)
+	{
+		const uint32_t magic = 20000630;
+		const uint32_t version = 2 | (tileSize ? 0x200 : 0);
+		writeRaw(out, magic);
+		writeRaw(out, version);
+
+		// Channels must be sorted by name. All of them are 32 bit floats (pixel type 2), not subsampled
+		std::string channels;
+		for(auto name : { "B", "G", "R" })
+		{
+			channels.append(name, 2);
+			const int32_t desc[4] = { 2, 0, 1, 1 }; // Type, pLinear and reserved bytes, x sampling, y sampling
+			channels.append(reinterpret_cast<const char*>(desc), sizeof(desc));
+		}
+		channels.push_back('\0');
+		writeAttribute(out, "channels", "chlist", channels.data(), int32_t(channels.size()));
+
+		writeAttribute(out, "compression", "compression", &compression, 1);
+		const int32_t window[4] = { 0, 0, int32_t(width) - 1, int32_t(height) - 1 };
+		writeAttribute(out, "dataWindow", "box2i", window, sizeof(window));
+		writeAttribute(out, "displayWindow", "box2i", window, sizeof(window));
+		const uint8_t lineOrder = tileSize ? 2 : 0; // Tiles are written in any order. Scanlines, top to bottom
+		writeAttribute(out, "lineOrder", "lineOrder", &lineOrder, 1);
+		const float pixelAspectRatio = 1.f;
+		writeAttribute(out, "pixelAspectRatio", "float", &pixelAspectRatio, sizeof(float));
+		const float screenWindowCenter[2] = { 0.f, 0.f };
+		writeAttribute(out, "screenWindowCenter", "v2f", screenWindowCenter, sizeof(screenWindowCenter));
+		const float screenWindowWidth = 1.f;
+		writeAttribute(out, "screenWindowWidth", "float", &screenWindowWidth, sizeof(float));
+		if(tileSize)
+		{
+			// Single resolution level
+			uint8_t tiles[9] = {};
+			const uint32_t size = uint32_t(tileSize);
+			std::memcpy(&tiles[0], &size, 4);
+			std::memcpy(&tiles[4], &size, 4);
+			writeAttribute(out, "tiles", "tiledesc", tiles, sizeof(tiles));
+		}
+		out.put('\0');
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Pixel data of a chunk. Each row stores all its B values, then G, then R.
+	void encodeBlock(const math::Vec3f* pixels, size_t width, size_t numRows, ExrCompression compression, std::vector<uint8_t>& dst)
+	{
+		std::vector<uint8_t> raw(numRows * width * 3 * sizeof(float));
+		auto out = reinterpret_cast<float*>(raw.data());
+		for(size_t y = 0; y < numRows; ++y)
+			for(int c = 2; c >= 0; --c)
+				for(size_t x = 0; x < width; ++x)
+					*out++ = pixels[x + y * width][c];
+
+		if(compression == ExrCompression::None)
+		{
+			dst = std::move(raw);
+			return;
+		}
+
+		// Split even and odd bytes, and delta encode them, so deflate finds more redundancy
+		std::vector<uint8_t> shuffled(raw.size());
+		const auto half = (raw.size() + 1) / 2;
+		for(size_t i = 0; i < raw.size(); ++i)
+			shuffled[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+		for(size_t i = shuffled.size() - 1; i > 0; --i)
+			shuffled[i] = uint8_t(int(shuffled[i]) - int(shuffled[i - 1]) + 128);
+
+		int compressedSize = 0;
+		auto compressed = stbi_zlib_compress(shuffled.data(), int(shuffled.size()), &compressedSize, 8);
+		// Blocks that don't shrink are stored uncompressed
+		if(compressed && size_t(compressedSize) < raw.size())
+			dst.assign(compressed, compressed + compressedSize);
+		else
+			dst = std::move(raw);
+		std::free(compressed);
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+bool saveExr(const char* fileName, const Image& img, ExrCompression compression)
+{
+	std::ofstream out(fileName, std::ios::binary);
+	if(!out)
+		return false;
+
+	const auto width = img.width();
+	const auto height = img.height();
+	writeHeader(out, width, height, 0, compression);
+
+	// Reserve the offset table, and fill it in once all blocks are written
+	const auto linesPerBlock = compression == ExrCompression::Zip ? kZipLinesPerBlock : 1;
+	const auto numBlocks = (height + linesPerBlock - 1) / linesPerBlock;
+	const auto tablePos = out.tellp();
+	std::vector<uint64_t> offsets(numBlocks, 0);
+	out.write(reinterpret_cast<const char*>(offsets.data()), numBlocks * sizeof(uint64_t));
+
+	std::vector<uint8_t> data;
+	for(size_t block = 0; block < numBlocks; ++block)
+	{
+		const auto y0 = block * linesPerBlock;
+		const auto numRows = std::min(linesPerBlock, height - y0);
+		encodeBlock(&img.pixel(0, y0), width, numRows, compression, data);
+
+		offsets[block] = uint64_t(out.tellp());
+		writeRaw(out, int32_t(y0));
+		writeRaw(out, int32_t(data.size()));
+		out.write(reinterpret_cast<const char*>(data.data()), data.size());
+	}
+
+	out.seekp(tablePos);
+	out.write(reinterpret_cast<const char*>(offsets.data()), numBlocks * sizeof(uint64_t));
+	return bool(out);
+}
+
+//--------------------------------------------------------------------------------------------------
+TiledExrWriter::TiledExrWriter(const char* fileName, size_t width, size_t height, size_t tileSize, ExrCompression compression)
+	: mFile(fileName, std::ios::binary)
+	, mTileSize(tileSize)
+	, mXTiles((width + tileSize - 1) / tileSize)
+	, mCompression(compression)
+{
+	if(!mFile)
+		return;
+
+	writeHeader(mFile, width, height, tileSize, compression);
+	mOffsetTablePos = mFile.tellp();
+	const auto numTiles = mXTiles * ((height + tileSize - 1) / tileSize);
+	const std::vector<uint64_t> offsets(numTiles, 0);
+	mFile.write(reinterpret_cast<const char*>(offsets.data()), numTiles * sizeof(uint64_t));
+	mFile.flush();
+}
+
+//--------------------------------------------------------------------------------------------------
+void TiledExrWriter::writeTile(size_t x0, size_t y0, size_t x1, size_t y1, const math::Vec3f* pixels)
+{
+	std::vector<uint8_t> data;
+	encodeBlock(pixels, x1 - x0, y1 - y0, mCompression, data);
+
+	const auto tx = x0 / mTileSize;
+	const auto ty = y0 / mTileSize;
+
+	std::lock_guard lock(mMutex);
+	mFile.seekp(0, std::ios::end);
+	const auto offset = uint64_t(mFile.tellp());
+	const int32_t chunkHeader[5] = { int32_t(tx), int32_t(ty), 0, 0, int32_t(data.size()) }; // Tile coordinates and level, size
+	mFile.write(reinterpret_cast<const char*>(chunkHeader), sizeof(chunkHeader));
+	mFile.write(reinterpret_cast<const char*>(data.data()), data.size());
+
+	// Only point to the tile once all of it is in the file
+	mFile.seekp(mOffsetTablePos + std::streamoff((tx + ty * mXTiles) * sizeof(uint64_t)));
+	writeRaw(mFile, offset);
+	mFile.flush();
+}
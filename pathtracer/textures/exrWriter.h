@@ -0,0 +1,63 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+#include <math/vector.h>
+
+class Image;
+
+enum class ExrCompression : uint8_t
+{
+	None = 0,
+	Zip = 3 // Deflate over blocks of 16 scanlines, or over whole tiles
+};
+
+// Writes img as a scanline OpenEXR file with 32 bit float R, G and B channels.
+// Returns false if the file can't be written.
+bool saveExr(const char* fileName, const Image& img, ExrCompression compression);
+
+// Tiled OpenEXR file, written one tile at a time, as tiles get done and in any order.
+// The tile offset table is updated after every tile. If the render is interrupted, the file still holds all finished
+// tiles, and the offsets of the missing ones are left at 0, which OpenEXR readers recover from.
+class TiledExrWriter
+{
+public:
+	TiledExrWriter(const char* fileName, size_t width, size_t height, size_t tileSize, ExrCompression compression);
+
+	bool isOpen() const { return mFile.is_open(); }
+
+	// The tile must start on the tile grid. pixels holds its rows, from top to bottom.
+	// Can be called from several threads at once.
+	void writeTile(size_t x0, size_t y0, size_t x1, size_t y1, const math::Vec3f* pixels);
+
+private:
+	std::mutex mMutex;
+	std::ofstream mFile;
+	size_t mTileSize;
+	size_t mXTiles;
+	ExrCompression mCompression;
+	std::streamoff mOffsetTablePos;
+};
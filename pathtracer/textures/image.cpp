@@ -19,6 +19,11 @@
 #include <stb_image_write.h>
 
 #include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "exrWriter.h"
 
 Image::Image(const char* fileName)
 {
@@ -42,7 +47,7 @@ void Image::saveAsSRGB(const char* fileName) const
 {
 	std::vector<uint8_t> tmpBuffer;
 	const auto nPixels = area();
-	tmpBuffer.reserve(nPixels);
+	tmpBuffer.reserve(3 * nPixels);
 	for (size_t i = 0; i < nPixels; ++i)
 	{
 		auto& c = mData[i];
@@ -59,7 +64,7 @@ void Image::saveAsLinearRGB(const char* fileName) const
 {
 	std::vector<uint8_t> tmpBuffer;
 	const auto nPixels = area();
-	tmpBuffer.reserve(nPixels);
+	tmpBuffer.reserve(3 * nPixels);
 	for (size_t i = 0; i < nPixels; ++i)
 	{
 		auto& c = mData[i];
@@ -72,6 +77,34 @@ void Image::saveAsLinearRGB(const char* fileName) const
 	stbi_write_png(fileName, (int)sx, (int)sy, 3, tmpBuffer.data(), rowStride);
 }
 
+void Image::saveAsPFM(const char* fileName) const
+{
+	std::ofstream file(fileName, std::ios::binary);
+	if(!file)
+		return;
+
+	// Negative scale means little endian. Rows go from bottom to top
+	file << "PF\n" << sx << " " << sy << "\n-1.0\n";
+	for(size_t y = sy; y-- > 0;)
+		file.write(reinterpret_cast<const char*>(&pixel(0, y)), sx * sizeof(math::Vec3f));
+}
+
+void Image::saveAsEXR(const char* fileName) const
+{
+	saveExr(fileName, *this, ExrCompression::Zip);
+}
+
+void Image::save(const char* fileName) const
+{
+	auto extension = std::strrchr(fileName, '.');
+	if(extension && !std::strcmp(extension, ".exr"))
+		saveAsEXR(fileName);
+	else if(extension && !std::strcmp(extension, ".pfm"))
+		saveAsPFM(fileName);
+	else
+		saveAsSRGB(fileName);
+}
+
 uint8_t Image::floatToByteColor(float value)
 {
 	auto clampedVal = std::clamp(value, 0.f, 1.f);
@@ -53,6 +53,13 @@ public:
 
 	void saveAsLinearRGB(const char* fileName) const;
 
+	// Unclamped linear float RGB
+	void saveAsPFM(const char* fileName) const;
+	void saveAsEXR(const char* fileName) const;
+
+	// Picks the format from the file extension: .exr and .pfm are saved as linear float, anything else as an sRGB png
+	void save(const char* fileName) const;
+
 private:
 	static uint8_t floatToByteColor(float value);
 	static uint8_t floatToLinearByteColor(float value);
@@ -19,114 +19,515 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <mutex>
 #include <thread>
 #include <vector>
 
 #include <nlohmann/json.hpp>
 
+#include "cpuTopology.h"
+
+// Pool of persistent worker threads.
+// Each worker owns a deque of task ranges. Workers split the ranges they take, keep working on the first half,
+// and leave the rest at the back of their deque, where idle workers can steal it from.
+// dispatch can be called from inside a task. The calling worker then helps run the nested tasks until they finish.
+// On NUMA machines, workers can be split among nodes. Each node gets a contiguous block of workers, which steal
+// from each other before stealing from other nodes, so contiguous task ranges (e.g. image regions) stay on one node.
 class ThreadPool
 {
 public:
+	struct Options
+	{
+		bool pinThreads = false; // Pin each worker to a single logical core
+		bool numaAware = false; // Split workers among NUMA nodes, and keep them on their node's cores
+	};
+
+	enum class Priority
+	{
+		High, // Taken before any other queued tasks, e.g. work the caller is blocked on
+		Normal,
+		Low // Only run when there is nothing else to do
+	};
+
 	ThreadPool(size_t nWorkers)
-		: mWorkers(nWorkers)
-		, mMetrics(nWorkers)
+		: ThreadPool(nWorkers, Options())
 	{}
 
-	template<class Op>
-	bool dispatch(size_t numTasks, const Op& operation, std::ostream& log)
+	ThreadPool(size_t nWorkers, const Options& options)
+		: mQueues(std::max<size_t>(nWorkers, 1))
+		, mWorkerNode(mQueues.size(), 0)
+		, mWorkerCores(mQueues.size())
 	{
-		// Start global profiling
-		log << "Running " << mWorkers.size() << " worker threads for " << numTasks << " tasks\n";
-		auto start = std::chrono::high_resolution_clock::now();
-
-		// Reset counter and metrics
-        const auto maxExpectedTasksPerThread = 2 * numTasks / mWorkers.size();
-		for(auto& metric : mMetrics)
-			metric.reset(maxExpectedTasksPerThread);
+		assignWorkers(options);
+		for(size_t i = 0; i < mQueues.size(); ++i)
+			mWorkers.emplace_back(&ThreadPool::workerRoutine, this, i);
+	}
 
-		// Run jobs
-		mTaskCounter = 0;
-		for(int i = 0; i < mWorkers.size(); ++i)
+	~ThreadPool()
+	{
 		{
-			mWorkers[i] = std::thread(
-				workerRoutine<Op>,
-                i,
-                numTasks,
-				std::ref(mMetrics[i]),
-				&mTaskCounter,
-				std::cref(operation));
-
-			if(!mWorkers[i].joinable())
-			{
-				return false;
-			}
+			std::lock_guard lock(mSleepMutex);
+			mStop = true;
 		}
-
-		// Finish jobs
+		mWakeCondition.notify_all();
 		for(auto& worker : mWorkers)
 			worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	template<class Op>
+	bool dispatch(size_t numTasks, const Op& operation, std::ostream& log, Priority priority = Priority::Normal)
+	{
+		// Start global profiling
+		log << "Running " << mWorkers.size() << " worker threads for " << numTasks << " tasks\n";
+		auto start = std::chrono::high_resolution_clock::now();
+
+		DispatchMetrics metrics;
+		if(!dispatchJob(numTasks, operation, priority, &metrics))
+			return false;
 
 		// Close global profiling
 		const auto runningTime = std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::high_resolution_clock::now() - start);
 		auto seconds = runningTime.count();
 		log << "Running time: " << seconds << " seconds\n";
 
-		logMetrics(seconds);
+		logMetrics(metrics, seconds);
+		if(t_pool != this)
+			publishTaskTimes(std::move(metrics.taskTimes));
 
 		return true;
 	}
 
-private:
-	using AtomicCounter = std::atomic<size_t>;
+	// Same as above, but without logging. Useful for short lived jobs, like building acceleration structures.
+	// Runs operation(taskIndex, workerIndex) for every task in [0, numTasks), and returns once all of them are done.
+	template<class Op>
+	bool dispatch(size_t numTasks, const Op& operation, Priority priority = Priority::Normal)
+	{
+		// Nested dispatches are not measured
+		if(t_pool == this)
+			return dispatchJob(numTasks, operation, priority, nullptr);
 
-	struct ThreadMetrics
+		DispatchMetrics metrics;
+		if(!dispatchJob(numTasks, operation, priority, &metrics))
+			return false;
+		publishTaskTimes(std::move(metrics.taskTimes));
+		return true;
+	}
+
+	// Splits the range [0, numElements) into chunks of at least grainSize elements, and runs op(begin, end) on each of them.
+	template<class Op>
+	void parallelFor(size_t numElements, size_t grainSize, const Op& operation)
 	{
-		std::vector<double> runTimes;
+		const auto numChunks = std::max<size_t>(1, std::min(numElements / std::max<size_t>(grainSize, 1), 4 * mWorkers.size()));
+		if(numChunks == 1)
+		{
+			operation(size_t(0), numElements);
+			return;
+		}
 
-		void reset(size_t expectedMaxTasksPerThread)
+		dispatch(numChunks, [&](size_t chunk, size_t) {
+			auto begin = chunk * numElements / numChunks;
+			auto end = (chunk + 1) * numElements / numChunks;
+			operation(begin, end);
+		});
+	}
+
+	// Runs op(nodeIndex) once for each NUMA node, on a worker of that node.
+	// Memory first touched inside op will usually be allocated on that node.
+	// Must be called from outside the pool.
+	template<class Op>
+	void forEachNode(const Op& operation)
+	{
+		assert(t_pool != this);
+
+		Job job;
+		auto nodeOp = [&](size_t node, size_t) { operation(node); };
+		job.op = &nodeOp;
+		job.run = [](const void* op, size_t taskIndex, size_t workerIndex) {
+			(*static_cast<const decltype(nodeOp)*>(op))(taskIndex, workerIndex);
+		};
+		job.priority = Priority::High;
+		job.stealable = false;
+		job.remaining = mNumNodes;
+
+		for(size_t node = 0; node < mNumNodes; ++node)
 		{
-			runTimes.clear();
-			runTimes.reserve(expectedMaxTasksPerThread);
+			auto worker = std::find(mWorkerNode.begin(), mWorkerNode.end(), node) - mWorkerNode.begin();
+			push(worker, { &job, node, node + 1 });
 		}
+
+		std::unique_lock lock(mDoneMutex);
+		mDoneCondition.wait(lock, [&job]() { return job.remaining == 0; });
+	}
+
+	size_t numWorkers() const { return mWorkers.size(); }
+	// Run time in seconds of each task of the last dispatch made from outside the pool to finish, indexed by task.
+	// For tasks that dispatched nested work, this includes the time spent waiting for it.
+	std::vector<double> taskTimes() const
+	{
+		std::lock_guard lock(mTaskTimesMutex);
+		return mTaskTimes;
+	}
+	size_t numNodes() const { return mNumNodes; }
+	// NUMA node of the calling thread, if it's a pool worker. 0 otherwise.
+	static size_t currentNode() { return t_node; }
+
+private:
+	static constexpr size_t kNumPriorities = 3;
+
+	// Run times of the tasks of a single dispatch call. Each worker only writes to its own entry of workerRunTimes,
+	// so concurrent dispatches never share metrics.
+	struct DispatchMetrics
+	{
+		std::vector<std::vector<double>> workerRunTimes;
+		std::vector<double> taskTimes; // Indexed by task
 	};
 
+	// Type erased dispatch call. Lives in the stack of the dispatching thread.
+	struct Job
+	{
+		const void* op;
+		void (*run)(const void* op, size_t taskIndex, size_t workerIndex);
+		Priority priority;
+		bool stealable = true; // False for tasks that must run on the worker they were queued on
+		DispatchMetrics* metrics = nullptr; // If not null, the run time of each task is stored here
+		std::atomic<size_t> remaining; // Tasks not yet finished
+	};
+
+	// Tasks [begin, end) of a job
+	struct Range
+	{
+		Job* job;
+		size_t begin;
+		size_t end;
+	};
+
+	// Aligned to cache lines, so workers polling one queue don't slow down pushes to its neighbours
+	struct alignas(64) WorkerQueue
+	{
+		std::mutex mutex;
+		std::deque<Range> ranges[kNumPriorities];
+		// Total ranges in the deques. Only changed while holding the mutex, but read without it to skip empty queues
+		std::atomic<size_t> numRanges = 0;
+		std::atomic<size_t> numPinnedRanges = 0; // Ranges of jobs that are not stealable
+		std::vector<size_t> victims; // Other workers, in the order we try to steal from them. Same node first.
+	};
+
+	// Decides which node and cores each worker runs on
+	void assignWorkers(const Options& options)
+	{
+		const auto numWorkers = mQueues.size();
+		auto topology = CpuTopology::detect();
+		if(!options.numaAware)
+		{
+			// Treat the whole machine as a single node
+			CpuTopology::Node all;
+			for(auto& node : topology.nodes)
+				all.cores.insert(all.cores.end(), node.cores.begin(), node.cores.end());
+			topology.nodes = { std::move(all) };
+		}
+		mNumNodes = std::min(topology.nodes.size(), numWorkers);
+
+		for(size_t i = 0; i < numWorkers; ++i)
+		{
+			// Contiguous blocks of workers per node
+			auto node = i * mNumNodes / numWorkers;
+			auto firstInNode = (node * numWorkers + mNumNodes - 1) / mNumNodes;
+			auto& cores = topology.nodes[node].cores;
+			mWorkerNode[i] = node;
+			if(options.pinThreads)
+				mWorkerCores[i] = { cores[(i - firstInNode) % cores.size()] };
+			else if(options.numaAware && mNumNodes > 1)
+				mWorkerCores[i] = cores;
+		}
+
+		for(size_t i = 0; i < numWorkers; ++i)
+		{
+			auto& victims = mQueues[i].victims;
+			for(size_t j = 1; j < numWorkers; ++j)
+				victims.push_back((i + j) % numWorkers);
+			std::stable_partition(victims.begin(), victims.end(), [&](size_t v) { return mWorkerNode[v] == mWorkerNode[i]; });
+		}
+	}
+
+	void push(size_t workerIndex, const Range& range)
+	{
+		auto& queue = mQueues[workerIndex];
+		{
+			std::lock_guard lock(queue.mutex);
+			queue.ranges[size_t(range.job->priority)].push_back(range);
+			queue.numRanges.store(queue.numRanges.load(std::memory_order_relaxed) + 1);
+			if(!range.job->stealable)
+				queue.numPinnedRanges.store(queue.numPinnedRanges.load(std::memory_order_relaxed) + 1);
+		}
+
+		// Sleeping workers increase mNumSleeping before checking the queues,
+		// so either they see the new range, or we see them and wake them up.
+		// mNumSleeping only changes when workers go to sleep or wake up, so checking it here is cheap.
+		// Only our worker can run ranges that are not stealable, so wake everyone to make sure it's awake.
+		if(mNumSleeping > 0)
+		{
+			{ std::lock_guard lock(mSleepMutex); }
+			if(range.job->stealable)
+				mWakeCondition.notify_one();
+			else
+				mWakeCondition.notify_all();
+		}
+	}
+
+	// Looks for a range of tasks, in priority order: our own queue first (newest ranges first, as they are still hot in cache),
+	// then the other workers' queues (oldest ranges first, as they are usually the biggest).
+	// If onlyJob is not null, ranges from other jobs are ignored.
+	bool acquire(size_t workerIndex, const Job* onlyJob, Range& dst)
+	{
+		for(size_t priority = 0; priority < kNumPriorities; ++priority)
+		{
+			const auto& victims = mQueues[workerIndex].victims;
+			for(size_t i = 0; i <= victims.size(); ++i)
+			{
+				const bool stealing = i != 0;
+				auto& queue = mQueues[stealing ? victims[i - 1] : workerIndex];
+				if(queue.numRanges.load(std::memory_order_relaxed) == 0)
+					continue;
+				std::lock_guard lock(queue.mutex);
+				auto& ranges = queue.ranges[priority];
+				if(ranges.empty())
+					continue;
+
+				if(!onlyJob)
+				{
+					if(!stealing)
+					{
+						dst = ranges.back();
+						ranges.pop_back();
+						countTakenRange(queue, dst);
+						return true;
+					}
+					auto match = std::find_if(ranges.begin(), ranges.end(), [](const Range& r) { return r.job->stealable; });
+					if(match != ranges.end())
+					{
+						dst = *match;
+						ranges.erase(match);
+						countTakenRange(queue, dst);
+						return true;
+					}
+					continue;
+				}
+
+				auto match = std::find_if(ranges.rbegin(), ranges.rend(), [onlyJob](const Range& r) { return r.job == onlyJob; });
+				if(match != ranges.rend() && (!stealing || onlyJob->stealable))
+				{
+					dst = *match;
+					ranges.erase(std::next(match).base());
+					countTakenRange(queue, dst);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// Runs the tasks of a dispatch call. If metrics is not null, the run time of each task is stored in it.
 	template<class Op>
-	static void workerRoutine(size_t workerId, int numTasks, ThreadMetrics& metrics, AtomicCounter* globalCounter, const Op& operation)
+	bool dispatchJob(size_t numTasks, const Op& operation, Priority priority, DispatchMetrics* metrics)
+	{
+		if(numTasks == 0)
+			return true;
+
+		Job job;
+		job.op = &operation;
+		job.run = [](const void* op, size_t taskIndex, size_t workerIndex) {
+			(*static_cast<const Op*>(op))(taskIndex, workerIndex);
+		};
+		job.priority = priority;
+		job.remaining = numTasks;
+		job.metrics = metrics;
+		if(metrics)
+		{
+			metrics->workerRunTimes.resize(mQueues.size());
+			metrics->taskTimes.assign(numTasks, 0.0);
+		}
+
+		if(t_pool == this)
+		{
+			// Nested dispatch. Queue the whole range locally, and help until it's done.
+			// Only tasks from this job are run while waiting, so the task that called us
+			// never gets interleaved with unrelated work on the same worker.
+			push(t_workerIndex, { &job, 0, numTasks });
+			Range range;
+			while(job.remaining > 0)
+			{
+				if(acquire(t_workerIndex, &job, range))
+					run(t_workerIndex, range);
+				else
+					std::this_thread::yield();
+			}
+			return true;
+		}
+
+		// Give each worker a contiguous block of tasks to start with
+		const auto numBlocks = std::min(numTasks, mQueues.size());
+		for(size_t i = 0; i < numBlocks; ++i)
+			push(i, { &job, i * numTasks / numBlocks, (i + 1) * numTasks / numBlocks });
+
+		// Finish jobs
+		std::unique_lock lock(mDoneMutex);
+		mDoneCondition.wait(lock, [&job]() { return job.remaining == 0; });
+
+		return true;
+	}
+
+	// Must be called while holding the queue's mutex
+	static void countTakenRange(WorkerQueue& queue, const Range& range)
 	{
-		assert(globalCounter);
+		if(!range.job->stealable)
+			queue.numPinnedRanges.store(queue.numPinnedRanges.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		queue.numRanges.store(queue.numRanges.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+	}
 
-		size_t selfCounter = (*globalCounter)++;
-		while(selfCounter < numTasks) // There's still work to do, keep runing tasks
+	// True if any queue holds a range the worker could take. Ranges that are not stealable only count in its own queue,
+	// so other workers don't keep waking up for work they can't run.
+	bool hasWorkFor(size_t workerIndex) const
+	{
+		for(size_t i = 0; i < mQueues.size(); ++i)
+		{
+			const auto& queue = mQueues[i];
+			const auto numRanges = queue.numRanges.load();
+			if(numRanges > (i == workerIndex ? 0 : queue.numPinnedRanges.load()))
+				return true;
+		}
+		return false;
+	}
+
+	void run(size_t workerIndex, Range range)
+	{
+		// Split the range until a single task is left, leaving the rest for later or for other workers to steal
+		while(range.end - range.begin > 1)
+		{
+			auto mid = range.begin + (range.end - range.begin) / 2;
+			push(workerIndex, { range.job, mid, range.end });
+			range.end = mid;
+		}
+
+		// Run task
+		auto& job = *range.job;
+		if(job.metrics)
 		{
-			// Run task
 			auto taskStart = std::chrono::high_resolution_clock::now();
-			operation(selfCounter, workerId);
+			job.run(job.op, range.begin, workerIndex);
 			std::chrono::duration<double> taskDuration = std::chrono::high_resolution_clock::now() - taskStart;
-			metrics.runTimes.push_back(taskDuration.count());
+			job.metrics->workerRunTimes[workerIndex].push_back(taskDuration.count());
+			job.metrics->taskTimes[range.begin] = taskDuration.count();
+		}
+		else
+			job.run(job.op, range.begin, workerIndex);
+
+		// The job may be destroyed as soon as its counter reaches zero, so don't touch it after that
+		if(job.remaining.fetch_sub(1) == 1)
+		{
+			{ std::lock_guard lock(mDoneMutex); }
+			mDoneCondition.notify_all();
+		}
+	}
 
-			// Update task counter
-			selfCounter = (*globalCounter)++;
+	void workerRoutine(size_t workerIndex)
+	{
+		t_pool = this;
+		t_workerIndex = workerIndex;
+		t_node = mWorkerNode[workerIndex];
+		if(!mWorkerCores[workerIndex].empty())
+			CpuTopology::pinCurrentThread(mWorkerCores[workerIndex]);
+
+		Range range;
+		for(;;)
+		{
+			if(acquire(workerIndex, nullptr, range))
+			{
+				run(workerIndex, range);
+				continue;
+			}
+
+			// Nothing to do, wait for new work
+			std::unique_lock lock(mSleepMutex);
+			++mNumSleeping;
+			mWakeCondition.wait(lock, [this, workerIndex]() { return mStop || hasWorkFor(workerIndex); });
+			--mNumSleeping;
+			if(mStop)
+				return;
 		}
 	}
 
-	void logMetrics(double totalRunTime)
+	void publishTaskTimes(std::vector<double>&& taskTimes)
+	{
+		std::lock_guard lock(mTaskTimesMutex);
+		mTaskTimes = std::move(taskTimes);
+	}
+
+	void logMetrics(const DispatchMetrics& metrics, double totalRunTime)
 	{
 		// Log raw data
 		nlohmann::json log;
 		log["runtime"] = totalRunTime;
 		auto& threadLog = log["threads"];
 		threadLog = nlohmann::json::array();
-		for(auto& t : mMetrics)
-			threadLog.push_back(t.runTimes);
+		for(auto& runTimes : metrics.workerRunTimes)
+			threadLog.push_back(runTimes);
+
+		// Throughput per NUMA node
+		auto& nodeLog = log["nodes"];
+		nodeLog = nlohmann::json::array();
+		for(size_t node = 0; node < mNumNodes; ++node)
+		{
+			size_t numWorkers = 0;
+			size_t numTasks = 0;
+			double busyTime = 0;
+			for(size_t i = 0; i < metrics.workerRunTimes.size(); ++i)
+			{
+				if(mWorkerNode[i] != node)
+					continue;
+				++numWorkers;
+				numTasks += metrics.workerRunTimes[i].size();
+				for(auto t : metrics.workerRunTimes[i])
+					busyTime += t;
+			}
+			nodeLog.push_back({
+				{ "workers", numWorkers },
+				{ "tasks", numTasks },
+				{ "busyTime", busyTime },
+				{ "tasksPerSecond", numTasks / totalRunTime } });
+		}
 
 		std::ofstream("metrics.json") << log;
 	}
 
-	AtomicCounter	mTaskCounter;
+	// Worker threads know which pool they belong to, so nested dispatches can be detected
+	static inline thread_local ThreadPool* t_pool = nullptr;
+	static inline thread_local size_t t_workerIndex = 0;
+	static inline thread_local size_t t_node = 0;
+
+	std::vector<WorkerQueue> mQueues;
+	mutable std::mutex mTaskTimesMutex;
+	std::vector<double> mTaskTimes;
+	std::vector<size_t> mWorkerNode;
+	std::vector<std::vector<uint32_t>> mWorkerCores; // Cores each worker is restricted to. Empty if not pinned.
+	size_t mNumNodes = 1;
 	std::vector<std::thread> mWorkers;
-	std::vector<ThreadMetrics> mMetrics;
+
+	std::mutex mSleepMutex;
+	std::condition_variable mWakeCondition;
+	std::atomic<size_t> mNumSleeping = 0;
+	bool mStop = false;
+
+	std::mutex mDoneMutex;
+	std::condition_variable mDoneCondition;
 };
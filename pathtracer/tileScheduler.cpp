@@ -0,0 +1,97 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "tileScheduler.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace {
+	//----------------------------------------------------------------------------------------------
+	// Position of (x,y) along a Hilbert curve that covers a n x n grid. n must be a power of 2.
+	uint64_t hilbertIndex(uint64_t n, uint64_t x, uint64_t y)
+	{
+		uint64_t d = 0;
+		for(uint64_t s = n / 2; s > 0; s /= 2)
+		{
+			const uint64_t rx = (x & s) > 0;
+			const uint64_t ry = (y & s) > 0;
+			d += s * s * ((3 * rx) ^ ry);
+			// Rotate the quadrant so the curve stays continuous
+			if(ry == 0)
+			{
+				if(rx == 1)
+				{
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+		}
+		return d;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+TileScheduler::TileScheduler(size_t width, size_t height, size_t tileSize, Order order)
+{
+	const auto xTiles = (width + tileSize - 1) / tileSize;
+	const auto yTiles = (height + tileSize - 1) / tileSize;
+	mTiles.reserve(xTiles * yTiles);
+	for(size_t ty = 0; ty < yTiles; ++ty)
+		for(size_t tx = 0; tx < xTiles; ++tx)
+		{
+			auto x0 = tx * tileSize;
+			auto y0 = ty * tileSize;
+			mTiles.emplace_back(x0, y0, std::min(x0 + tileSize, width), std::min(y0 + tileSize, height));
+		}
+
+	if(order == Order::Hilbert)
+	{
+		uint64_t gridSize = 1;
+		while(gridSize < std::max(xTiles, yTiles))
+			gridSize *= 2;
+		std::vector<std::pair<uint64_t, Rect>> sortedTiles;
+		sortedTiles.reserve(mTiles.size());
+		for(auto& t : mTiles)
+			sortedTiles.push_back({ hilbertIndex(gridSize, t.x0 / tileSize, t.y0 / tileSize), t });
+		std::sort(sortedTiles.begin(), sortedTiles.end(), [](auto& a, auto& b) { return a.first < b.first; });
+		for(size_t i = 0; i < mTiles.size(); ++i)
+			mTiles[i] = sortedTiles[i].second;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+size_t TileScheduler::split(const Rect& rect, Rect pieces[4])
+{
+	// Don't split sides that would become smaller than kMinSplitSize
+	const auto width = rect.x1 - rect.x0;
+	const auto height = rect.y1 - rect.y0;
+	const auto xSplit = width >= 2 * kMinSplitSize ? rect.x0 + width / 2 : rect.x1;
+	const auto ySplit = height >= 2 * kMinSplitSize ? rect.y0 + height / 2 : rect.y1;
+
+	size_t numPieces = 0;
+	for(auto [y0, y1] : { std::pair(rect.y0, ySplit), std::pair(ySplit, rect.y1) })
+		for(auto [x0, x1] : { std::pair(rect.x0, xSplit), std::pair(xSplit, rect.x1) })
+		{
+			if(x0 < x1 && y0 < y1)
+				pieces[numPieces++] = Rect(x0, y0, x1, y1);
+		}
+	return numPieces;
+}
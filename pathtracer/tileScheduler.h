@@ -0,0 +1,121 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+#include "math/rectangle.h"
+#include "threadPool.h"
+
+// Splits the image into tiles and runs render passes over them on a ThreadPool.
+// Tiles on the right and bottom edges are cropped to fit the image, so any image size works.
+// Near the end of a pass, when fewer tiles are left than workers, expensive tiles are split into quadrants
+// that idle workers can steal. How expensive a tile is comes from its run time in the previous pass.
+class TileScheduler
+{
+public:
+	using Rect = math::Rectangle<size_t>;
+
+	enum class Order
+	{
+		Scanline,
+		Hilbert // Neighbouring tasks are close in the image, which is friendlier to caches
+	};
+
+	TileScheduler(size_t width, size_t height, size_t tileSize, Order order);
+
+	size_t numTiles() const { return mTiles.size(); }
+	const Rect& tile(size_t i) const { return mTiles[i]; }
+
+	// Runs op(rect, workerIndex) over regions that cover the image exactly once.
+	// If log is not null, the pass is profiled through it.
+	template<class Op>
+	bool renderPass(ThreadPool& pool, const Op& operation, std::ostream* log = nullptr)
+	{
+		return renderPass(pool, operation, [](size_t) {}, log);
+	}
+
+	// Same as above, and calls tileDone(tileIndex) as soon as all the pixels of a tile are done
+	template<class Op, class DoneOp>
+	bool renderPass(ThreadPool& pool, const Op& operation, const DoneOp& tileDone, std::ostream* log = nullptr);
+
+private:
+	// Smallest side of a tile created by splitting
+	static constexpr size_t kMinSplitSize = 4;
+
+	// Splits rect into up to 4 pieces. Returns the number of pieces.
+	static size_t split(const Rect& rect, Rect pieces[4]);
+
+	template<class Op>
+	void renderSplit(ThreadPool& pool, const Rect& rect, double expectedCost, const Op& operation);
+
+	std::vector<Rect> mTiles;
+	std::vector<double> mTileCosts; // Run time of each tile in the last pass. Empty before the first pass
+	double mMeanTileCost = 0;
+	std::atomic<size_t> mNumStartedTiles = 0;
+};
+
+//--------------------------------------------------------------------------------------------------
+template<class Op, class DoneOp>
+bool TileScheduler::renderPass(ThreadPool& pool, const Op& operation, const DoneOp& tileDone, std::ostream* log)
+{
+	mNumStartedTiles = 0;
+	auto tileTask = [&](size_t tileIndex, size_t workerIndex) {
+		const auto numPendingTiles = mTiles.size() - ++mNumStartedTiles;
+		const bool endOfPass = numPendingTiles < pool.numWorkers();
+		// With no timings yet, every tile at the end of the pass is split once
+		const auto cost = mTileCosts.empty() ? 0.0 : mTileCosts[tileIndex];
+		if(endOfPass && pool.numWorkers() > 1 && (mTileCosts.empty() || cost > mMeanTileCost))
+			renderSplit(pool, mTiles[tileIndex], cost, operation);
+		else
+			operation(mTiles[tileIndex], workerIndex);
+		tileDone(tileIndex);
+	};
+
+	const bool ok = log ? pool.dispatch(mTiles.size(), tileTask, *log) : pool.dispatch(mTiles.size(), tileTask);
+	if(!ok)
+		return false;
+
+	mTileCosts = pool.taskTimes();
+	mMeanTileCost = 0;
+	for(auto t : mTileCosts)
+		mMeanTileCost += t;
+	mMeanTileCost /= mTileCosts.size();
+	return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+template<class Op>
+void TileScheduler::renderSplit(ThreadPool& pool, const Rect& rect, double expectedCost, const Op& operation)
+{
+	Rect pieces[4];
+	const auto numPieces = split(rect, pieces);
+	const auto pieceCost = expectedCost / numPieces;
+	// The calling worker is blocked on the pieces, so they go ahead of any other work
+	pool.dispatch(numPieces, [&](size_t i, size_t workerIndex) {
+		if(numPieces > 1 && pieceCost > mMeanTileCost)
+			renderSplit(pool, pieces[i], pieceCost, operation);
+		else
+			operation(pieces[i], workerIndex);
+	}, ThreadPool::Priority::High);
+}
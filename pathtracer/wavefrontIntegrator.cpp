@@ -0,0 +1,361 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "wavefrontIntegrator.h"
+
+#include "accumulationBuffer.h"
+#include "aovBuffer.h"
+
+#include <atomic>
+
+#include <background.h>
+#include <camera/camera.h>
+#include <collision.h>
+#include <collision/CWBVH.h>
+#include <lightSampling.h>
+#include <materials/Lambertian.h>
+#include <math/ray.h>
+#include <scene/scene.h>
+#include <threadPool.h>
+
+using namespace math;
+
+namespace
+{
+	// Small enough for good load balancing, big enough to amortize dispatch
+	constexpr size_t kChunkSize = 1 << 12;
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::PathQueue::resize(size_t n)
+{
+	origin.resize(n);
+	direction.resize(n);
+	throughput.resize(n);
+	radiance.resize(n);
+	bsdfPdf.resize(n);
+	pixel.resize(n);
+	sampler.resize(n);
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::HitQueue::resize(size_t n)
+{
+	position.resize(n);
+	normal.resize(n);
+	instanceId.resize(n);
+	hit.resize(n);
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::ShadowQueue::resize(size_t n)
+{
+	origin.resize(n);
+	direction.resize(n);
+	contribution.resize(n);
+	active.resize(n);
+}
+
+//--------------------------------------------------------------------------------------------------
+WavefrontIntegrator::WavefrontIntegrator(const PathTermination& termination, bool sampleLights, Sampler::Type samplerType)
+	: mTermination(termination)
+	, mSampleLights(sampleLights)
+	, mSamplerType(samplerType)
+{}
+
+//--------------------------------------------------------------------------------------------------
+template<class Op>
+void WavefrontIntegrator::forEachChunk(ThreadPool& pool, size_t n, const Op& op)
+{
+	const auto numChunks = (n + kChunkSize - 1) / kChunkSize;
+	pool.dispatch(numChunks, [&](size_t chunk, size_t workerIndex) {
+		op(chunk * kChunkSize, std::min(n, (chunk + 1) * kChunkSize), workerIndex);
+	});
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::render(const Scene& world, const Camera& cam, AccumulationBuffer& dst, AovBuffer* aovs, unsigned nSamples, const uint8_t* activePixels, ThreadPool& pool)
+{
+	mWorkerVisitedNodes.resize(pool.numWorkers(), 0);
+
+	mActivePixels.clear();
+	for(size_t i = 0; i < dst.width() * dst.height(); ++i)
+	{
+		if(!activePixels || activePixels[i])
+			mActivePixels.push_back(uint32_t(i));
+	}
+
+	// Each sample pass starts one path per active pixel, so paths in a pass never share pixels
+	for(unsigned s = 0; s < nSamples; ++s)
+	{
+		generateCameraPaths(cam, dst, pool);
+
+		// Same bounce limit as the megakernel: paths still alive after the last bounce get no more light
+		for(int depth = 0; depth <= mTermination.maxBounces && mPaths.size() > 0; ++depth)
+		{
+			extend(world, pool);
+			if(aovs && depth == 0)
+				writeAovs(dst, *aovs, pool);
+			shadeMisses(world, dst, pool);
+			// Light samples are weighted against the bounce ray, which the last iteration doesn't trace. See color() in main.cpp
+			if(mSampleLights && depth < mTermination.maxBounces)
+			{
+				sampleLights(world, pool);
+				traceShadowRays(world, pool);
+			}
+			shadeHits(depth + 1, dst, pool);
+			compact(pool);
+		}
+		finishPaths(dst, pool);
+	}
+
+	mNumVisitedNodes = 0;
+	for(auto n : mWorkerVisitedNodes)
+		mNumVisitedNodes += n;
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::generateCameraPaths(const Camera& cam, const AccumulationBuffer& dst, ThreadPool& pool)
+{
+	const auto width = dst.width();
+	const auto height = dst.height();
+	mPaths.resize(mActivePixels.size());
+	forEachChunk(pool, mPaths.size(), [&](size_t begin, size_t end, size_t) {
+		for(size_t p = begin; p < end; ++p)
+		{
+			auto pixel = mActivePixels[p];
+			auto i = pixel / width;
+			auto j = pixel % width;
+			// Same per pixel sample sequences as the megakernel
+			auto& sampler = mPaths.sampler[p];
+			sampler = Sampler(mSamplerType, uint32_t(j), uint32_t(i), uint32_t(width), dst.numSamples(j, i));
+			auto jitter = sampler.next2D();
+			float u = float(j + jitter.x()) / width;
+			float v = 1.f - float(i + jitter.y()) / height;
+			Ray r = cam.get_ray(u, v);
+
+			mPaths.origin[p] = r.origin();
+			mPaths.direction[p] = r.direction();
+			mPaths.throughput[p] = Vec3f(1.f);
+			mPaths.radiance[p] = Vec3f(0.f);
+			mPaths.bsdfPdf[p] = 0.f;
+			mPaths.pixel[p] = pixel;
+		}
+	});
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::extend(const Scene& world, ThreadPool& pool)
+{
+	constexpr float farPlane = 1e3f;
+
+	mHits.resize(mPaths.size());
+	mNumTracedRays += mPaths.size();
+	forEachChunk(pool, mPaths.size(), [&](size_t begin, size_t end, size_t workerIndex) {
+		HitRecord hit;
+		for(size_t p = begin; p < end; ++p)
+		{
+			Ray r(mPaths.origin[p], mPaths.direction[p]);
+			mHits.hit[p] = world.hit(r, farPlane, hit);
+			mHits.position[p] = hit.p;
+			mHits.normal[p] = hit.normal;
+			mHits.instanceId[p] = hit.instanceId;
+		}
+		mWorkerVisitedNodes[workerIndex] += CWBVH::consumeVisitedNodeCount();
+	});
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::writeAovs(const AccumulationBuffer& dst, AovBuffer& aovs, ThreadPool& pool)
+{
+	forEachChunk(pool, mPaths.size(), [&](size_t begin, size_t end, size_t) {
+		for(size_t p = begin; p < end; ++p)
+		{
+			auto pixel = mPaths.pixel[p];
+			PrimaryHit hit;
+			if(mHits.hit[p])
+			{
+				const auto& normal = mHits.normal[p];
+				hit.albedo = Vec3f(DefaultAlbedo);
+				hit.normal = dot(normal, mPaths.direction[p]) > 0.f ? -normal : normal;
+				hit.depth = (mHits.position[p] - mPaths.origin[p]).norm();
+				hit.instanceId = mHits.instanceId[p];
+			}
+			aovs.addSample(pixel % dst.width(), pixel / dst.width(), mHits.hit[p] ? &hit : nullptr);
+		}
+	});
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::shadeMisses(const Scene& world, AccumulationBuffer& dst, ThreadPool& pool)
+{
+	forEachChunk(pool, mPaths.size(), [&](size_t begin, size_t end, size_t) {
+		for(size_t p = begin; p < end; ++p)
+		{
+			if(mHits.hit[p])
+				continue;
+
+			// Gather light from the background. This path is done
+			auto& direction = mPaths.direction[p];
+			float weight = 1.f;
+			if(mSampleLights && mPaths.bsdfPdf[p] > 0)
+				weight = powerHeuristic(mPaths.bsdfPdf[p], world.background->pdf(direction));
+			mPaths.radiance[p] += weight * mPaths.throughput[p] * world.background->sample(direction);
+			auto pixel = mPaths.pixel[p];
+			dst.addSample(pixel % dst.width(), pixel / dst.width(), mPaths.radiance[p]);
+		}
+	});
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::sampleLights(const Scene& world, ThreadPool& pool)
+{
+	mShadows.resize(mPaths.size());
+	forEachChunk(pool, mPaths.size(), [&](size_t begin, size_t end, size_t) {
+		for(size_t p = begin; p < end; ++p)
+		{
+			mShadows.active[p] = 0;
+			if(!mHits.hit[p])
+				continue;
+
+			auto normal = mHits.normal[p];
+			if(dot(normal, mPaths.direction[p]) > 0.f)
+				normal = -normal;
+			Ray shadowRay;
+			Vec3f contribution;
+			if(sampleBackgroundLight(*world.background, mHits.position[p], normal, Vec3f(DefaultAlbedo), mPaths.sampler[p], shadowRay, contribution))
+			{
+				mShadows.origin[p] = shadowRay.origin();
+				mShadows.direction[p] = shadowRay.direction();
+				mShadows.contribution[p] = mPaths.throughput[p] * contribution;
+				mShadows.active[p] = 1;
+			}
+		}
+	});
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::traceShadowRays(const Scene& world, ThreadPool& pool)
+{
+	constexpr float farPlane = 1e3f;
+
+	std::atomic<size_t> numShadowRays = 0;
+	forEachChunk(pool, mPaths.size(), [&](size_t begin, size_t end, size_t workerIndex) {
+		size_t chunkRays = 0;
+		for(size_t p = begin; p < end; ++p)
+		{
+			if(!mShadows.active[p])
+				continue;
+			++chunkRays;
+			if(!world.occluded(Ray(mShadows.origin[p], mShadows.direction[p]), farPlane))
+				mPaths.radiance[p] += mShadows.contribution[p];
+		}
+		numShadowRays += chunkRays;
+		mWorkerVisitedNodes[workerIndex] += CWBVH::consumeVisitedNodeCount();
+	});
+	mNumTracedRays += numShadowRays;
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::shadeHits(int depth, AccumulationBuffer& dst, ThreadPool& pool)
+{
+	forEachChunk(pool, mPaths.size(), [&](size_t begin, size_t end, size_t) {
+		for(size_t p = begin; p < end; ++p)
+		{
+			if(!mHits.hit[p])
+				continue;
+
+			// Evaluate light bounce
+			Ray scatteredRay;
+			Vec3f attenuation;
+			Vec3f emitted;
+			Ray r(mPaths.origin[p], mPaths.direction[p]);
+			lambertScatter(r, mHits.position[p], mHits.normal[p], Vec3f(DefaultAlbedo), attenuation, emitted, scatteredRay, mPaths.sampler[p]);
+			const auto facingNormal = dot(mHits.normal[p], r.direction()) > 0.f ? -mHits.normal[p] : mHits.normal[p];
+
+			// Integrate path
+			mPaths.radiance[p] += mPaths.throughput[p] * emitted;
+			mPaths.throughput[p] *= attenuation;
+			mPaths.origin[p] = scatteredRay.origin();
+			mPaths.direction[p] = scatteredRay.direction();
+			mPaths.bsdfPdf[p] = lambertPdf(facingNormal, scatteredRay.direction());
+
+			// Paths killed by roulette are done. Clearing their hit flag drops them in compaction
+			if(!mTermination.russianRoulette(depth, mPaths.throughput[p], mPaths.sampler[p]))
+			{
+				auto pixel = mPaths.pixel[p];
+				dst.addSample(pixel % dst.width(), pixel / dst.width(), mPaths.radiance[p]);
+				mHits.hit[p] = 0;
+			}
+		}
+	});
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::compact(ThreadPool& pool)
+{
+	// Count live paths per chunk
+	const auto numPaths = mPaths.size();
+	const auto numChunks = (numPaths + kChunkSize - 1) / kChunkSize;
+	mChunkOffsets.resize(numChunks + 1);
+	forEachChunk(pool, numPaths, [&](size_t begin, size_t end, size_t) {
+		size_t alive = 0;
+		for(size_t p = begin; p < end; ++p)
+			alive += mHits.hit[p];
+		mChunkOffsets[begin / kChunkSize + 1] = alive;
+	});
+
+	// Prefix sum, so each chunk knows where its paths go
+	mChunkOffsets[0] = 0;
+	for(size_t c = 0; c < numChunks; ++c)
+		mChunkOffsets[c + 1] += mChunkOffsets[c];
+
+	// Copy live paths in order
+	mCompactedPaths.resize(mChunkOffsets[numChunks]);
+	forEachChunk(pool, numPaths, [&](size_t begin, size_t end, size_t) {
+		auto dst = mChunkOffsets[begin / kChunkSize];
+		for(size_t p = begin; p < end; ++p)
+		{
+			if(!mHits.hit[p])
+				continue;
+			mCompactedPaths.origin[dst] = mPaths.origin[p];
+			mCompactedPaths.direction[dst] = mPaths.direction[p];
+			mCompactedPaths.throughput[dst] = mPaths.throughput[p];
+			mCompactedPaths.radiance[dst] = mPaths.radiance[p];
+			mCompactedPaths.bsdfPdf[dst] = mPaths.bsdfPdf[p];
+			mCompactedPaths.pixel[dst] = mPaths.pixel[p];
+			mCompactedPaths.sampler[dst] = mPaths.sampler[p];
+			++dst;
+		}
+	});
+
+	std::swap(mPaths, mCompactedPaths);
+}
+
+//--------------------------------------------------------------------------------------------------
+void WavefrontIntegrator::finishPaths(AccumulationBuffer& dst, ThreadPool& pool)
+{
+	forEachChunk(pool, mPaths.size(), [&](size_t begin, size_t end, size_t) {
+		for(size_t p = begin; p < end; ++p)
+		{
+			auto pixel = mPaths.pixel[p];
+			dst.addSample(pixel % dst.width(), pixel / dst.width(), mPaths.radiance[p]);
+		}
+	});
+}
@@ -0,0 +1,123 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//-------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <math/vector.h>
+#include <pathTermination.h>
+#include <sampler.h>
+
+class AccumulationBuffer;
+class AovBuffer;
+class Camera;
+class Scene;
+class ThreadPool;
+
+// Path tracer that advances all the paths of a sample pass together, one bounce at a time.
+// Each bounce runs extension, miss and shading stages as separate batched kernels over all live paths,
+// and dead paths are compacted out of the queues before the next bounce.
+// This keeps each stage's code and data hot in cache, unlike following a single path from start to end.
+class WavefrontIntegrator
+{
+public:
+	// If sampleLights is set, each bounce also traces a shadow ray towards a direction picked by the background
+	WavefrontIntegrator(const PathTermination& termination, bool sampleLights, Sampler::Type samplerType);
+
+	// Traces nSamples more samples for each pixel, and adds them to dst.
+	// If activePixels is not null, only pixels marked in it are sampled.
+	// If aovs is not null, the primary hits of the new samples are added to it too.
+	void render(const Scene& world, const Camera& cam, AccumulationBuffer& dst, AovBuffer* aovs, unsigned nSamples, const uint8_t* activePixels, ThreadPool& pool);
+
+	// Totals over all render calls
+	size_t numTracedRays() const { return mNumTracedRays; }
+	size_t numVisitedNodes() const { return mNumVisitedNodes; }
+
+private:
+	// State of each live path, as a structure of arrays
+	struct PathQueue
+	{
+		void resize(size_t n);
+		size_t size() const { return pixel.size(); }
+
+		std::vector<math::Vec3f> origin;
+		std::vector<math::Vec3f> direction;
+		std::vector<math::Vec3f> throughput;
+		std::vector<math::Vec3f> radiance; // Gathered so far
+		std::vector<float> bsdfPdf; // Density of the last bounce direction, for MIS. 0 for camera rays
+		std::vector<uint32_t> pixel;
+		std::vector<Sampler> sampler; // Seeded per pixel and sample, so results don't depend on scheduling
+	};
+
+	// Results of the extension stage, indexed like the path queue
+	struct HitQueue
+	{
+		void resize(size_t n);
+
+		std::vector<math::Vec3f> position;
+		std::vector<math::Vec3f> normal;
+		std::vector<uint32_t> instanceId;
+		std::vector<uint8_t> hit;
+	};
+
+	// Next event estimation rays, indexed like the path queue
+	struct ShadowQueue
+	{
+		void resize(size_t n);
+
+		std::vector<math::Vec3f> origin;
+		std::vector<math::Vec3f> direction;
+		std::vector<math::Vec3f> contribution; // Added to the path's radiance if the ray is not occluded
+		std::vector<uint8_t> active;
+	};
+
+	// Stages
+	void generateCameraPaths(const Camera& cam, const AccumulationBuffer& dst, ThreadPool& pool);
+	void extend(const Scene& world, ThreadPool& pool);
+	// Only run after the first extension, when the hits are the primary hits
+	void writeAovs(const AccumulationBuffer& dst, AovBuffer& aovs, ThreadPool& pool);
+	void shadeMisses(const Scene& world, AccumulationBuffer& dst, ThreadPool& pool);
+	void sampleLights(const Scene& world, ThreadPool& pool);
+	void traceShadowRays(const Scene& world, ThreadPool& pool);
+	// depth is the number of bounces of the paths after this stage
+	void shadeHits(int depth, AccumulationBuffer& dst, ThreadPool& pool);
+	void compact(ThreadPool& pool);
+	// Adds the radiance of all paths in the queue to their pixels
+	void finishPaths(AccumulationBuffer& dst, ThreadPool& pool);
+
+	// Runs op(begin, end, workerIndex) over fixed size chunks of [0, n)
+	template<class Op>
+	void forEachChunk(ThreadPool& pool, size_t n, const Op& op);
+
+	PathTermination mTermination;
+	bool mSampleLights;
+	Sampler::Type mSamplerType;
+	PathQueue mPaths;
+	PathQueue mCompactedPaths;
+	HitQueue mHits;
+	ShadowQueue mShadows;
+	std::vector<size_t> mWorkerVisitedNodes;
+	std::vector<size_t> mChunkOffsets; // Used for compaction
+	std::vector<uint32_t> mActivePixels; // Pixels that start a path in each sample pass
+
+	size_t mNumTracedRays = 0;
+	size_t mNumVisitedNodes = 0;
+};
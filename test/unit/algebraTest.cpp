@@ -23,6 +23,7 @@
 #include "../../pathtracer/math/random.h"
 #include "../../pathtracer/math/aabb.h"
 #include "../../pathtracer/math/ray.h"
+#include "../../pathtracer/math/distribution.h"
 #include <cmath>
 #include <vector>
 
@@ -204,10 +205,73 @@ void testAABB_Ray_intersect()
 	testAABBArraySIMD(testCases);
 }
 
+void testRandomGenerator()
+{
+	// Different streams must produce different sequences
+	RandomGenerator a(0, 1);
+	RandomGenerator b(0, 2);
+	bool different = false;
+	for(int i = 0; i < 16; ++i)
+		different |= a.next() != b.next();
+	assert(different);
+
+	// Each lane of the simd generator must match its scalar generator
+	RandomGenerator scalarGen[8];
+	RandomGenerator laneGen[8];
+	for(int i = 0; i < 8; ++i)
+		scalarGen[i] = laneGen[i] = RandomGenerator(7, 100 + i);
+	RandomGenerator8 simdGen;
+	simdGen.load(laneGen);
+	for(int n = 0; n < 100; ++n)
+	{
+		alignas(32) float values[8];
+		simdGen.scalar().store(values);
+		for(int i = 0; i < 8; ++i)
+		{
+			assert(values[i] == scalarGen[i].scalar());
+			assert(values[i] >= 0.f && values[i] < 1.f);
+		}
+	}
+
+	// Generators must carry on from where the simd version stopped
+	simdGen.store(laneGen);
+	for(int i = 0; i < 8; ++i)
+		assert(laneGen[i].next() == scalarGen[i].next());
+}
+
+void testDistribution2D()
+{
+	// 4x3 grid. The middle row is black, so it must never be sampled
+	const float weights[] = {
+		1.f, 1.f, 0.f, 6.f,
+		0.f, 0.f, 0.f, 0.f,
+		1.f, 1.f, 1.f, 1.f };
+	Distribution2D distribution(weights, 4, 3);
+
+	RandomGenerator g;
+	constexpr int numSamples = 100000;
+	int heavyCellHits = 0;
+	for(int n = 0; n < numSamples; ++n)
+	{
+		float pdf;
+		auto uv = distribution.sample(g.scalar(), g.scalar(), pdf);
+		assert(uv.x() >= 0.f && uv.x() < 1.f && uv.y() >= 0.f && uv.y() < 1.f);
+		auto cell = size_t(uv.x() * 4) + 4 * size_t(uv.y() * 3);
+		assert(weights[cell] > 0.f);
+		// Total weight is 12, spread over 12 cells, so each cell's density is its weight
+		assert(abs(pdf - weights[cell]) < 1e-4f);
+		assert(abs(pdf - distribution.pdf(uv)) < 1e-4f);
+		heavyCellHits += cell == 3;
+	}
+	assert(abs(float(heavyCellHits) / numSamples - 0.5f) < 0.01f);
+}
+
 int main()
 {
 	testAABB_Ray_intersect();
 	testLowTriangularMatrixSolve();
+	testRandomGenerator();
+	testDistribution2D();
 	testHighTriangularMatrixSolve();
 	// Test characteristic matrices
 	testLUDecomposition(Matrix44f::identity());
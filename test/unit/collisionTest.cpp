@@ -19,6 +19,16 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "../../pathtracer/collision/BLAS.h"
 #include "../../pathtracer/collision/CWBVH.h"
+#include "../../pathtracer/collision/radixSort.h"
+#include "../../pathtracer/math/random.h"
+#include "../../pathtracer/scene/bvhCache.h"
+#include "../../pathtracer/threadPool.h"
+
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
 
 using namespace math;
 
@@ -118,6 +128,184 @@ void TraceTwoSeparateElementsBVH()
     assert(hit.mNodeId == 1);
 }
 
+void TraceGridBVH(CWBVH::BuildQuality quality)
+{
+    // 4x4x4 grid of unit boxes, with gaps in between
+    constexpr int gridSize = 4;
+    std::vector<AABB> aabbs;
+    for (int z = 0; z < gridSize; ++z)
+        for (int y = 0; y < gridSize; ++y)
+            for (int x = 0; x < gridSize; ++x)
+                aabbs.push_back(AABB(Vec3f(2.f * x, 2.f * y, 2.f * z), 1.f));
+
+    CWBVH bvh;
+    bvh.build(aabbs, quality);
+    assert(bvh.sahCost() > 0.f);
+
+    auto leafOp = [&](const Ray& r, float _tMax, int32_t nodeId) {
+        float tHit = -1;
+        if (aabbs[nodeId].intersect(r.implicit(), _tMax, tHit))
+            return tHit;
+        return -1.f;
+    };
+
+    // Rays along x must always hit the first box of each row
+    const float tMax = 100.f;
+    for (int z = 0; z < gridSize; ++z)
+        for (int y = 0; y < gridSize; ++y)
+        {
+            Ray ray({ -2.f, 2.f * y, 2.f * z }, { 1, 0, 0 });
+            auto hit = bvh.closestHit(ray, ray.implicit(), tMax, leafOp);
+            assert(!hit.empty());
+            assert(hit.mNodeId == gridSize * (gridSize * z + y));
+        }
+}
+
+// With refit, boxes are moved after the build, so traversal runs on refit bounds
+void TraceRandomBoxesBVH(CWBVH::BuildQuality quality, int numBoxes = 1000, ThreadPool* pool = nullptr, uint32_t maxLeafSize = 1, bool refit = false)
+{
+    // Enough boxes to need several levels of wide nodes
+    RandomGenerator random;
+    std::vector<AABB> aabbs;
+    for (int i = 0; i < numBoxes; ++i)
+    {
+        Vec3f center(20 * random.scalar(), 20 * random.scalar(), 20 * random.scalar());
+        aabbs.push_back(AABB(center, 0.1f + random.scalar()));
+    }
+
+    CWBVH bvh;
+    bvh.build(aabbs, quality, pool, maxLeafSize);
+
+    if (refit)
+    {
+        // Refit a copy of the tree loaded from its serialized form, which has to remember how it was built
+        std::stringstream serialized;
+        bvh.save(serialized);
+        bvh = CWBVH();
+        bool loaded = bvh.load(serialized);
+        assert(loaded);
+
+        for (auto& aabb : aabbs)
+        {
+            auto offset = 2.f * random.unit_vector();
+            aabb = AABB(aabb.min() + offset, aabb.max() + offset);
+        }
+        bvh.refit(aabbs);
+    }
+
+    // Objects in each leaf
+    std::vector<std::vector<uint32_t>> leafs;
+    if (maxLeafSize > 1)
+    {
+        size_t numObjects = 0;
+        for (uint32_t i = 0; i < bvh.numLeafs(); ++i)
+        {
+            auto objects = bvh.leafObjects(i);
+            assert(!objects.empty() && objects.size() <= maxLeafSize);
+            leafs.emplace_back(objects.begin(), objects.end());
+            numObjects += objects.size();
+        }
+        assert(numObjects == aabbs.size());
+    }
+    else
+    {
+        for (uint32_t i = 0; i < aabbs.size(); ++i)
+            leafs.push_back({ i });
+    }
+
+    auto leafOp = [&](const Ray& r, float _tMax, int32_t nodeId) {
+        float closestT = -1;
+        for (auto object : leafs[nodeId])
+        {
+            float tHit = -1;
+            if (aabbs[object].intersect(r.implicit(), _tMax, tHit))
+                closestT = _tMax = tHit;
+        }
+        return closestT;
+    };
+
+    // Compare against brute force
+    const float tMax = 100.f;
+    CWBVH::RayPacket packet;
+    Ray packetRays[CWBVH::kPacketSize];
+    float packetClosestT[CWBVH::kPacketSize];
+    for (int i = 0; i < 200; ++i)
+    {
+        Ray ray(Vec3f(-5.f, 20 * random.scalar(), 20 * random.scalar()), normalize(Vec3f(1.f, 0.f, 0.f) + 0.3f * random.unit_vector()));
+        float closestT = tMax;
+        for (auto& aabb : aabbs)
+        {
+            float tHit;
+            if (aabb.intersect(ray.implicit(), closestT, tHit))
+                closestT = tHit;
+        }
+
+        auto hit = bvh.closestHit(ray, ray.implicit(), tMax, leafOp);
+        assert(hit.empty() == (closestT == tMax));
+        assert(hit.empty() || hit.t == closestT);
+
+        // Traversal order must not change the result
+        auto unorderedHit = bvh.closestHit(ray, ray.implicit(), tMax, leafOp, CWBVH::TraversalOrder::Unordered);
+        assert(unorderedHit.empty() == hit.empty());
+        assert(unorderedHit.t == hit.t);
+
+        // Group rays in packets, and check they find the same hits
+        auto lane = i % CWBVH::kPacketSize;
+        packet.setRay(lane, ray, tMax);
+        packetRays[lane] = ray;
+        packetClosestT[lane] = closestT;
+        if (lane == CWBVH::kPacketSize - 1)
+        {
+            auto packetLeafOp = [&](uint32_t nodeId, uint32_t laneMask) {
+                for (uint32_t l = 0; l < CWBVH::kPacketSize; ++l)
+                {
+                    float tHit;
+                    for (auto object : leafs[nodeId])
+                        if ((laneMask & (1 << l)) && aabbs[object].intersect(packetRays[l].implicit(), packet.tMax[l], tHit))
+                            packet.tMax[l] = tHit;
+                }
+            };
+            bvh.closestHitPacket(packet, packetLeafOp);
+            for (uint32_t l = 0; l < CWBVH::kPacketSize; ++l)
+                assert(packet.tMax[l] == packetClosestT[l]);
+            packet = CWBVH::RayPacket();
+        }
+    }
+}
+
+void TraverseDeepStack()
+{
+    // Deeper than the inline stack, so the states have to take their stacks from the heap
+    const uint32_t depth = 3 * CWBVH::TraversalState::kInlineStackSize;
+
+    Ray ray({ 0, 0, 0 }, { 0, 1, 0 });
+    CWBVH::TraversalState stack(depth);
+    stack.reset(ray.implicit(), 1.f, CWBVH::TraversalOrder::Unordered);
+    for (uint32_t i = 0; i < depth; ++i)
+        stack.push(i, 0x81);
+    for (uint32_t i = depth; i-- > 0;)
+    {
+        uint32_t childNdx;
+        assert(stack.pop(childNdx) == i && childNdx == 0);
+        assert(stack.pop(childNdx) == i && childNdx == 7);
+    }
+    assert(stack.empty());
+
+    CWBVH::RayPacket packet;
+    packet.setRay(0, ray, 1.f);
+    CWBVH::PacketTraversalState packetStack(depth);
+    packetStack.reset(packet, CWBVH::TraversalOrder::Unordered);
+    for (uint32_t i = 0; i < depth; ++i)
+        packetStack.push(i, 0x0100000000000001ull);
+    for (uint32_t i = depth; i-- > 0;)
+    {
+        uint32_t childNdx, laneMask;
+        assert(packetStack.pop(childNdx, laneMask) == i && childNdx == 0 && laneMask == 1);
+        assert(packetStack.pop(childNdx, laneMask) == i && childNdx == 7 && laneMask == 1);
+    }
+    assert(packetStack.empty());
+}
+
 void TestCWBVH()
 {
     // Trace against an empty BVH
@@ -126,20 +314,356 @@ void TestCWBVH()
     TraceSingleElementBVH();
     // Trace against a BVH with two AABBs side by side, non intersecting
     TraceTwoSeparateElementsBVH();
+    // Trace against grids of AABBs, built with each construction method
+    TraceGridBVH(CWBVH::BuildQuality::Fast);
+    TraceGridBVH(CWBVH::BuildQuality::SAH);
+    // Trace against many random AABBs, and compare with brute force
+    TraceRandomBoxesBVH(CWBVH::BuildQuality::Fast);
+    TraceRandomBoxesBVH(CWBVH::BuildQuality::SAH);
+    // Same, but big enough to be built in parallel
+    ThreadPool pool(4);
+    TraceRandomBoxesBVH(CWBVH::BuildQuality::Fast, 20000, &pool);
+    TraceRandomBoxesBVH(CWBVH::BuildQuality::SAH, 20000, &pool);
+    // Same, with several boxes per leaf
+    TraceRandomBoxesBVH(CWBVH::BuildQuality::Fast, 1000, nullptr, 4);
+    TraceRandomBoxesBVH(CWBVH::BuildQuality::SAH, 1000, nullptr, 8);
+    TraceRandomBoxesBVH(CWBVH::BuildQuality::SAH, 20000, &pool, 4);
+    // Same, after moving the boxes and refitting the tree
+    TraceRandomBoxesBVH(CWBVH::BuildQuality::Fast, 1000, nullptr, 1, true);
+    TraceRandomBoxesBVH(CWBVH::BuildQuality::SAH, 1000, nullptr, 4, true);
+    // Traversal stacks for trees too deep for the inline stack
+    TraverseDeepStack();
     // Trace against a BVH with two AABBs side by side, intersecting in the middle
     // Trace against a BVH with an AABB at each corner, non intersecting
     // Trace against a BVH with an AABB at each corner, all intersecting at the center
     // Trace against a BVH with multiple BVHs embedded in one another.
 }
 
+void TestRadixSort(size_t numKeys, ThreadPool* pool)
+{
+    // Random 63 bit keys, with plenty of duplicates
+    RandomGenerator random;
+    std::vector<uint64_t> keys(numKeys);
+    std::vector<uint32_t> values(numKeys);
+    for (size_t i = 0; i < numKeys; ++i)
+    {
+        keys[i] = uint64_t(random.next() % 64) << (random.next() % 58);
+        values[i] = uint32_t(i);
+    }
+
+    // Sort a copy of the pairs with the standard library
+    std::vector<std::pair<uint64_t, uint32_t>> expected(numKeys);
+    for (size_t i = 0; i < numKeys; ++i)
+        expected[i] = { keys[i], values[i] };
+    std::stable_sort(expected.begin(), expected.end(), [](auto& a, auto& b) { return a.first < b.first; });
+
+    radixSort(keys, values, 63, pool);
+    for (size_t i = 0; i < numKeys; ++i)
+    {
+        assert(keys[i] == expected[i].first);
+        assert(values[i] == expected[i].second); // Radix sort is stable
+    }
+}
+
+// BLASes of random triangles must find the same hits as brute force, for any leaf size
+void TraceRandomTrianglesBLAS(uint32_t maxLeafSize)
+{
+    RandomGenerator random;
+    constexpr uint32_t numTris = 2000;
+    std::vector<Vec3f> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<Triangle> triangles;
+    for (uint32_t i = 0; i < numTris; ++i)
+    {
+        Vec3f center(20 * random.scalar(), 20 * random.scalar(), 20 * random.scalar());
+        for (int v = 0; v < 3; ++v)
+        {
+            indices.push_back(uint32_t(vertices.size()));
+            vertices.push_back(center + random.unit_vector());
+        }
+        triangles.emplace_back(vertices[3 * i], vertices[3 * i + 1], vertices[3 * i + 2]);
+    }
+
+    BLAS blas(vertices.data(), indices.data(), numTris, CWBVH::BuildQuality::SAH, nullptr, maxLeafSize);
+    assert(blas.numTriangles() == numTris);
+
+    const float tMax = 100.f;
+    for (int i = 0; i < 500; ++i)
+    {
+        Ray ray(Vec3f(-5.f, 20 * random.scalar(), 20 * random.scalar()), normalize(Vec3f(1.f, 0.f, 0.f) + 0.3f * random.unit_vector()));
+        float closestT = tMax;
+        uint32_t closestId = uint32_t(-1);
+        for (uint32_t t = 0; t < numTris; ++t)
+        {
+            float tHit = triangles[t].simd().hitNoBackface(ray.simd());
+            if (tHit >= 0 && tHit <= closestT)
+            {
+                closestT = tHit;
+                closestId = t;
+            }
+        }
+
+        uint32_t hitId = uint32_t(-1);
+        float tHit = -1;
+        Vec3f normal;
+        Vec2f uv;
+        bool hit = blas.closestHit(ray, tMax, hitId, tHit, normal, uv);
+        assert(hit == (closestId != uint32_t(-1)));
+        assert(blas.anyHit(ray, tMax) == hit);
+        if (hit)
+        {
+            assert(std::abs(tHit - closestT) < 1e-4f);
+            assert(dot(normal, triangles[hitId].normal()) > 0.999f);
+
+            // Barycentrics must reconstruct the hit point
+            const auto& tri = triangles[hitId];
+            auto p = (1 - uv.x() - uv.y()) * tri.vtx(0) + uv.x() * tri.vtx(1) + uv.y() * tri.vtx(2);
+            assert((p - ray.at(tHit)).norm() < 1e-3f);
+        }
+    }
+}
+
+// Rays through the edges and vertices of a closed grid of triangles must never slip between them
+void TraceGridEdgesBLAS()
+{
+    constexpr int gridSize = 8;
+    std::vector<Vec3f> vertices;
+    for (int y = 0; y <= gridSize; ++y)
+        for (int x = 0; x <= gridSize; ++x)
+            vertices.emplace_back(0.37f * x, 0.37f * y, 0.f);
+
+    // Two triangles per cell, facing +z
+    std::vector<uint32_t> indices;
+    std::vector<Triangle> triangles;
+    for (int y = 0; y < gridSize; ++y)
+        for (int x = 0; x < gridSize; ++x)
+        {
+            uint32_t v00 = uint32_t(x + y * (gridSize + 1));
+            uint32_t v10 = v00 + 1;
+            uint32_t v01 = v00 + gridSize + 1;
+            uint32_t v11 = v01 + 1;
+            for (uint32_t i : { v00, v10, v11, v00, v11, v01 })
+                indices.push_back(i);
+        }
+    for (size_t i = 0; i < indices.size(); i += 3)
+        triangles.emplace_back(vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]]);
+    const auto numTris = uint32_t(triangles.size());
+
+    BLAS blas(vertices.data(), indices.data(), numTris);
+
+    RandomGenerator random;
+    const float tMax = 100.f;
+    int numRays = 0;
+    int edgeSignMisses = 0;
+    for (int i = 0; i < 20000; ++i)
+    {
+        // Aim at a random point on an interior edge, diagonal or vertex
+        float a = float(1 + random.scalar() * (gridSize - 2));
+        float b = float(1 + int(random.scalar() * (gridSize - 2)));
+        int edgeType = i % 4;
+        Vec2f target = edgeType == 0 ? Vec2f(a, b) : edgeType == 1 ? Vec2f(b, a) : edgeType == 2 ? Vec2f(a, a) : Vec2f(b, b);
+        Vec3f origin(3 * random.scalar(), 3 * random.scalar(), 1 + random.scalar());
+        Ray ray(origin, normalize(Vec3f(0.37f * target.x(), 0.37f * target.y(), 0.f) - origin));
+        ++numRays;
+
+        uint32_t hitId = uint32_t(-1);
+        float tHit;
+        Vec3f normal;
+        Vec2f uv;
+        bool hit = blas.closestHit(ray, tMax, hitId, tHit, normal, uv);
+        assert(hit);
+        assert(blas.anyHit(ray, tMax));
+
+        bool edgeSignHit = false;
+        for (auto& tri : triangles)
+            edgeSignHit |= tri.simd().hitNoBackface(ray.simd()) >= 0;
+        edgeSignMisses += edgeSignHit ? 0 : 1;
+    }
+    std::cout << "Grid edge rays missed. Edge sign test: " << edgeSignMisses << " of " << numRays << ", watertight test: 0\n";
+}
+
+// Meshes with more vertices than 16 bit indices can address must still hit the right triangles
+void TraceLargeMeshBLAS()
+{
+    // Height field with more than 2^16 vertices, so triangles at the far end need 32 bit indices
+    constexpr uint32_t width = 300;
+    constexpr uint32_t height = 250;
+    std::vector<Vec3f> vertices;
+    for (uint32_t y = 0; y < height; ++y)
+        for (uint32_t x = 0; x < width; ++x)
+            vertices.emplace_back(float(x), float(y), 0.1f * std::sin(0.3f * x) * std::cos(0.2f * y));
+    assert(vertices.size() > (1 << 16));
+
+    std::vector<uint32_t> indices;
+    for (uint32_t y = 0; y + 1 < height; ++y)
+        for (uint32_t x = 0; x + 1 < width; ++x)
+        {
+            uint32_t v00 = x + y * width;
+            for (uint32_t i : { v00, v00 + 1, v00 + width + 1, v00, v00 + width + 1, v00 + width })
+                indices.push_back(i);
+        }
+    const auto numTris = uint32_t(indices.size() / 3);
+
+    BLAS blas(vertices.data(), indices.data(), numTris, CWBVH::BuildQuality::SAH);
+    assert(blas.numTriangles() == numTris);
+
+    RandomGenerator random;
+    for (int i = 0; i < 1000; ++i)
+    {
+        Vec2f target(1 + random.scalar() * (width - 3), 1 + random.scalar() * (height - 3));
+        Ray ray(Vec3f(target.x(), target.y(), 5.f), Vec3f(0.f, 0.f, -1.f));
+
+        uint32_t hitId = uint32_t(-1);
+        float tHit;
+        Vec3f normal;
+        Vec2f uv;
+        bool hit = blas.closestHit(ray, 100.f, hitId, tHit, normal, uv);
+        assert(hit);
+
+        // The hit triangle must belong to the cell under the ray
+        auto cell = indices[3 * hitId];
+        assert(cell % width == uint32_t(target.x()));
+        assert(cell / width == uint32_t(target.y()));
+    }
+}
+
+// A BLAS stored in the cache and loaded back must trace exactly like the one that was built
+void CachedBLASRoundTrip(uint32_t maxLeafSize)
+{
+    RandomGenerator random;
+    constexpr uint32_t numTris = 1000;
+    std::vector<Vec3f> vertices;
+    std::vector<uint32_t> indices;
+    for (uint32_t i = 0; i < numTris; ++i)
+    {
+        Vec3f center(10 * random.scalar(), 10 * random.scalar(), 10 * random.scalar());
+        for (int v = 0; v < 3; ++v)
+        {
+            indices.push_back(uint32_t(vertices.size()));
+            vertices.push_back(center + random.unit_vector());
+        }
+    }
+
+    const auto quality = CWBVH::BuildQuality::SAH;
+    BLAS built(vertices.data(), indices.data(), numTris, quality, nullptr, maxLeafSize);
+
+    auto directory = std::filesystem::temp_directory_path() / ("collisionTestCache" + std::to_string(maxLeafSize));
+    std::filesystem::remove_all(directory);
+    {
+        BVHCache cache(directory.string());
+        auto meshHash = BVHCache::hashMesh(vertices, indices, quality, maxLeafSize);
+        BLAS missing;
+        assert(!cache.load(meshHash, missing));
+        cache.store(meshHash, built);
+
+        BLAS loaded;
+        bool found = cache.load(meshHash, loaded);
+        assert(found);
+        assert(cache.hits() == 1 && cache.misses() == 1);
+        assert(loaded.numTriangles() == numTris);
+
+        const float tMax = 100.f;
+        int numHits = 0;
+        for (int i = 0; i < 2000; ++i)
+        {
+            auto origin = Vec3f(5.f) + 12.f * random.unit_vector();
+            Ray ray(origin, normalize(Vec3f(10 * random.scalar(), 10 * random.scalar(), 10 * random.scalar()) - origin));
+
+            uint32_t builtId = uint32_t(-1), loadedId = uint32_t(-1);
+            float builtT = -1, loadedT = -1;
+            Vec3f builtNormal, loadedNormal;
+            Vec2f builtUV, loadedUV;
+            bool builtHit = built.closestHit(ray, tMax, builtId, builtT, builtNormal, builtUV);
+            bool loadedHit = loaded.closestHit(ray, tMax, loadedId, loadedT, loadedNormal, loadedUV);
+            assert(builtHit == loadedHit);
+            assert(loaded.anyHit(ray, tMax) == builtHit);
+            if (builtHit)
+            {
+                assert(builtId == loadedId);
+                assert(builtT == loadedT);
+                assert(builtNormal == loadedNormal);
+                assert(builtUV == loadedUV);
+                ++numHits;
+            }
+        }
+        assert(numHits > 0);
+    }
+    std::filesystem::remove_all(directory);
+}
+
+// Reports the cost of a single ray/triangle test, for the edge sign and the batched watertight kernels
+void BenchmarkTriangleKernels()
+{
+    RandomGenerator random;
+    constexpr uint32_t numTris = 1024;
+    std::vector<Triangle::Simd> simdTriangles;
+    std::vector<Triangle8> leafs(numTris / Triangle8::kWidth);
+    for (uint32_t i = 0; i < numTris; ++i)
+    {
+        Vec3f center(random.scalar(), random.scalar(), random.scalar());
+        Triangle tri(center + 0.2f * random.unit_vector(), center + 0.2f * random.unit_vector(), center + 0.2f * random.unit_vector());
+        simdTriangles.push_back(tri.simd());
+        leafs[i / Triangle8::kWidth].set(i % Triangle8::kWidth, tri, i);
+    }
+
+    constexpr int numRays = 2000;
+    std::vector<Ray> rays;
+    for (int i = 0; i < numRays; ++i)
+    {
+        auto origin = Vec3f(0.5f) + 3.f * random.unit_vector();
+        rays.emplace_back(origin, normalize(Vec3f(random.scalar(), random.scalar(), random.scalar()) - origin));
+    }
+
+    const float tMax = 100.f;
+    const double numTests = double(numRays) * numTris;
+    auto start = std::chrono::high_resolution_clock::now();
+    uint32_t edgeSignHits = 0;
+    for (auto& ray : rays)
+    {
+        auto simdRay = ray.simd();
+        for (auto& tri : simdTriangles)
+        {
+            float t = tri.hitNoBackface(simdRay);
+            edgeSignHits += (t >= 0 && t <= tMax) ? 1 : 0;
+        }
+    }
+    const auto edgeSignNs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() * 1e9 / numTests;
+
+    start = std::chrono::high_resolution_clock::now();
+    uint32_t watertightHits = 0;
+    alignas(32) float tHit[Triangle8::kWidth], uHit[Triangle8::kWidth], vHit[Triangle8::kWidth];
+    for (auto& ray : rays)
+    {
+        WatertightRay watertightRay(ray);
+        for (auto& leaf : leafs)
+            watertightHits += std::popcount(leaf.hit(watertightRay, tMax, tHit, uHit, vHit));
+    }
+    const auto watertightNs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() * 1e9 / numTests;
+
+    std::cout << "Ray/triangle test. Edge sign: " << edgeSignNs << " ns, watertight x8: " << watertightNs << " ns per triangle ("
+        << edgeSignHits << " and " << watertightHits << " hits)\n";
+}
+
 int main()
 {
+    TestRadixSort(1000, nullptr);
+    ThreadPool pool(4);
+    TestRadixSort(100000, &pool);
+
     TestCWBVH();
 
+    for (uint32_t maxLeafSize : { 1, 4, 8 })
+        TraceRandomTrianglesBLAS(maxLeafSize);
+    TraceGridEdgesBLAS();
+    TraceLargeMeshBLAS();
+    for (uint32_t maxLeafSize : { 1, 4, 8 })
+        CachedBLASRoundTrip(maxLeafSize);
+    BenchmarkTriangleKernels();
+
     // Other tests
     const size_t numTris = 4;
     std::vector<Vec3f> vertices(3 * numTris);
-    std::vector<uint16_t> indices(3 * numTris);
+    std::vector<uint32_t> indices(3 * numTris);
     for (size_t i = 0; i < numTris; ++i)
     {
 
@@ -160,16 +684,17 @@ int main()
     float tHit = -1;
     float tMax = 10.f;
     Vec3f normal;
+    Vec2f uv;
 
     // Intersect first tri
-    blas.closestHit(ray, tMax, hitId, tHit, normal);
+    blas.closestHit(ray, tMax, hitId, tHit, normal, uv);
 
     assert(tHit == 1.f);
     assert(hitId == 0);
 
     // Intersect second tri from inside
     ray.origin() = Vec3f(0.5f, 0.f, 0.f);
-    blas.closestHit(ray, tMax, hitId, tHit, normal);
+    blas.closestHit(ray, tMax, hitId, tHit, normal, uv);
 
     assert(tHit == 0.5f);
     assert(hitId == 1);
@@ -179,7 +704,7 @@ int main()
     for (int i = 0; i < numTris; ++i)
     {
         ray.origin() = Vec3f(-1.f, 0.5f + i, 0.f);
-        blas.closestHit(ray, tMax, hitId, tHit, normal);
+        blas.closestHit(ray, tMax, hitId, tHit, normal, uv);
 
         assert(tHit == 1.f + i);
         assert(hitId == i);
@@ -0,0 +1,127 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//--------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "../../pathtracer/denoiser.h"
+#include "../../pathtracer/math/random.h"
+#include "../../pathtracer/textures/image.h"
+#include "../../pathtracer/threadPool.h"
+
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace math;
+
+// Two flat surfaces meeting at x = width / 2, each with its own normal and lighting.
+struct TestScene
+{
+    TestScene(size_t width, size_t height)
+        : clean(width, height)
+        , noisy(width, height)
+        , albedo(width, height)
+        , normal(width, height)
+        , variance(width * height)
+    {
+        RandomGenerator random;
+        for (size_t y = 0; y < height; ++y)
+            for (size_t x = 0; x < width; ++x)
+            {
+                const bool left = x < width / 2;
+                albedo.pixel(x, y) = Vec3f(0.5f);
+                normal.pixel(x, y) = left ? Vec3f(0.f, 0.f, 1.f) : Vec3f(1.f, 0.f, 0.f);
+                clean.pixel(x, y) = Vec3f(left ? 1.f : 0.2f);
+                // Uniform noise of +-50%
+                const float value = clean.pixel(x, y).x() * (0.5f + random.scalar());
+                noisy.pixel(x, y) = Vec3f(value);
+                variance[x + y * width] = clean.pixel(x, y).x() * clean.pixel(x, y).x() / 12;
+            }
+    }
+
+    Image clean;
+    Image noisy;
+    Image albedo;
+    Image normal;
+    std::vector<float> variance;
+};
+
+float rmse(const Image& a, const Image& b)
+{
+    double sqError = 0;
+    for (size_t y = 0; y < a.height(); ++y)
+        for (size_t x = 0; x < a.width(); ++x)
+            sqError += (a.pixel(x, y) - b.pixel(x, y)).sqNorm() / 3;
+    return float(std::sqrt(sqError / a.area()));
+}
+
+void TestNoiseIsRemoved(ThreadPool& pool)
+{
+    constexpr size_t width = 128;
+    constexpr size_t height = 64;
+    TestScene scene(width, height);
+    Image denoised(width, height);
+    denoise(scene.noisy, scene.variance, scene.albedo, scene.normal, denoised, pool);
+
+    const float noisyError = rmse(scene.noisy, scene.clean);
+    const float denoisedError = rmse(denoised, scene.clean);
+    assert(denoisedError < 0.2f * noisyError);
+
+    // Nothing leaks across the edge between surfaces
+    for (size_t y = 0; y < height; ++y)
+    {
+        assert(std::abs(denoised.pixel(width / 2 - 1, y).x() - 1.f) < 0.1f);
+        assert(std::abs(denoised.pixel(width / 2, y).x() - 0.2f) < 0.02f);
+    }
+}
+
+void TestConvergedImageIsKept(ThreadPool& pool)
+{
+    // Zero variance means the image is exact, so it must come out as it went in
+    TestScene scene(32, 32);
+    std::vector<float> variance(scene.variance.size(), 0.f);
+    Image denoised(32, 32);
+    denoise(scene.noisy, variance, scene.albedo, scene.normal, denoised, pool);
+    assert(rmse(denoised, scene.noisy) < 1e-5f);
+}
+
+// Reports throughput on a full HD frame
+void BenchmarkDenoiser(ThreadPool& pool)
+{
+    constexpr size_t width = 1920;
+    constexpr size_t height = 1080;
+    TestScene scene(width, height);
+    Image denoised(width, height);
+
+    const auto start = std::chrono::high_resolution_clock::now();
+    denoise(scene.noisy, scene.variance, scene.albedo, scene.normal, denoised, pool);
+    const auto seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << "Denoiser: " << seconds * 1e3 / (width * height / 1e6) << " ms per megapixel with "
+        << pool.numWorkers() << " workers\n";
+}
+
+int main()
+{
+    ThreadPool pool(4);
+    TestNoiseIsRemoved(pool);
+    TestConvergedImageIsKept(pool);
+    BenchmarkDenoiser(pool);
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//--------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "../../pathtracer/sampler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace math;
+
+constexpr uint32_t kWidth = 64;
+
+// Sobol points of a single pixel fill every elementary interval of a power of 2 grid exactly once
+void TestSobolIsStratified()
+{
+    constexpr uint32_t n = 64;
+    std::vector<int> cells1D(n, 0);
+    std::vector<int> cells2D(n, 0);
+    std::vector<int> rows(n, 0);
+    std::vector<int> columns(n, 0);
+    for (uint32_t s = 0; s < n; ++s)
+    {
+        Sampler sampler(Sampler::Type::Sobol, 5, 7, kWidth, s);
+        sampler.next2D(); // Skip a dimension, so padded ones are tested too
+        auto u = sampler.next1D();
+        auto v = sampler.next2D();
+        assert(u >= 0 && u < 1 && v.x() >= 0 && v.x() < 1 && v.y() >= 0 && v.y() < 1);
+        cells1D[size_t(u * n)]++;
+        cells2D[size_t(v.x() * 8) + 8 * size_t(v.y() * 8)]++;
+        columns[size_t(v.x() * n)]++;
+        rows[size_t(v.y() * n)]++;
+    }
+    for (uint32_t i = 0; i < n; ++i)
+        assert(cells1D[i] == 1 && cells2D[i] == 1 && rows[i] == 1 && columns[i] == 1);
+}
+
+// Neighbouring pixels don't share their sequences
+void TestPixelsAreDecorrelated()
+{
+    Sampler a(Sampler::Type::Sobol, 0, 0, kWidth, 0);
+    Sampler b(Sampler::Type::Sobol, 1, 0, kWidth, 0);
+    for (int dimension = 0; dimension < 8; ++dimension)
+        assert(a.next1D() != b.next1D());
+}
+
+// The random sampler keeps the per pixel streams of RandomGenerator
+void TestRandomMatchesGenerator()
+{
+    Sampler sampler(Sampler::Type::Random, 3, 2, kWidth, 5);
+    RandomGenerator random(5, 3 + 2 * kWidth);
+    for (int i = 0; i < 8; ++i)
+        assert(sampler.next1D() == random.scalar());
+}
+
+// Mean toroidal distance between the values of horizontally adjacent pixels, for one dimension of the first sample
+float meanNeighbourDistance(Sampler::Type type, std::vector<float>& values)
+{
+    values.resize(kWidth * kWidth);
+    for (uint32_t y = 0; y < kWidth; ++y)
+        for (uint32_t x = 0; x < kWidth; ++x)
+        {
+            Sampler sampler(type, x, y, kWidth, 0);
+            sampler.next2D();
+            values[x + y * kWidth] = sampler.next1D();
+        }
+
+    double total = 0;
+    for (uint32_t y = 0; y < kWidth; ++y)
+        for (uint32_t x = 0; x < kWidth; ++x)
+        {
+            const float d = std::abs(values[x + y * kWidth] - values[(x + 1) % kWidth + y * kWidth]);
+            total += std::min(d, 1 - d);
+        }
+    return float(total / (kWidth * kWidth));
+}
+
+// Blue noise covers the unit interval evenly across a tile of pixels, and adjacent pixels get dissimilar values
+void TestBlueNoiseSpreadsError()
+{
+    std::vector<float> values;
+    const float blueNoiseDistance = meanNeighbourDistance(Sampler::Type::BlueNoise, values);
+    std::vector<int> bins(kWidth, 0);
+    for (float v : values)
+        bins[std::min(size_t(v * kWidth), size_t(kWidth - 1))]++;
+    for (int count : bins)
+        assert(std::abs(count - int(kWidth)) <= 1);
+
+    // White noise averages 0.25
+    const float whiteNoiseDistance = meanNeighbourDistance(Sampler::Type::Sobol, values);
+    std::cout << "Neighbour distance. Blue noise: " << blueNoiseDistance << ", white noise: " << whiteNoiseDistance << "\n";
+    assert(blueNoiseDistance > 1.2f * whiteNoiseDistance);
+}
+
+// Error of estimating the integral of a smooth 2D function
+float integrationError(Sampler::Type type, uint32_t numSamples)
+{
+    constexpr uint32_t numPixels = 256;
+    double sqError = 0;
+    for (uint32_t p = 0; p < numPixels; ++p)
+    {
+        double sum = 0;
+        for (uint32_t s = 0; s < numSamples; ++s)
+        {
+            Sampler sampler(type, p, 0, numPixels, s);
+            auto u = sampler.next2D();
+            sum += u.x() * u.y() * u.y(); // Integral is 1/6
+        }
+        const double error = sum / numSamples - 1.0 / 6;
+        sqError += error * error;
+    }
+    return float(std::sqrt(sqError / numPixels));
+}
+
+void TestSobolConvergesFaster()
+{
+    const float randomError = integrationError(Sampler::Type::Random, 64);
+    const float sobolError = integrationError(Sampler::Type::Sobol, 64);
+    std::cout << "Integration error with 64 samples. Random: " << randomError << ", Sobol: " << sobolError << "\n";
+    assert(sobolError < 0.1f * randomError);
+}
+
+int main()
+{
+    TestSobolIsStratified();
+    TestPixelsAreDecorrelated();
+    TestRandomMatchesGenerator();
+    TestBlueNoiseSpreadsError();
+    TestSobolConvergesFaster();
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//--------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "../../pathtracer/threadPool.h"
+
+#include <atomic>
+#include <cassert>
+#include <thread>
+#include <vector>
+
+void TestAllTasksRunOnce(ThreadPool& pool, size_t numTasks)
+{
+    std::vector<std::atomic<int>> runCount(numTasks);
+    bool ok = pool.dispatch(numTasks, [&](size_t taskNdx, size_t workerNdx) {
+        assert(workerNdx < pool.numWorkers());
+        ++runCount[taskNdx];
+    });
+    assert(ok);
+    for (auto& count : runCount)
+        assert(count == 1);
+}
+
+void TestNestedDispatch(ThreadPool& pool)
+{
+    constexpr size_t numOuterTasks = 16;
+    constexpr size_t numInnerTasks = 100;
+    std::vector<std::atomic<int>> runCount(numOuterTasks * numInnerTasks);
+    pool.dispatch(numOuterTasks, [&](size_t outerNdx, size_t) {
+        // Waiting for nested tasks must not run other outer tasks on this worker
+        static thread_local bool insideOuterTask = false;
+        assert(!insideOuterTask);
+        insideOuterTask = true;
+        pool.dispatch(numInnerTasks, [&](size_t innerNdx, size_t) {
+            ++runCount[outerNdx * numInnerTasks + innerNdx];
+        }, ThreadPool::Priority::High);
+        insideOuterTask = false;
+    });
+    for (auto& count : runCount)
+        assert(count == 1);
+}
+
+void TestParallelFor(ThreadPool& pool)
+{
+    constexpr size_t numElements = 10000;
+    std::vector<int> visited(numElements, 0);
+    pool.parallelFor(numElements, 64, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            ++visited[i];
+    });
+    for (auto v : visited)
+        assert(v == 1);
+}
+
+void TestTaskTimes(ThreadPool& pool)
+{
+    constexpr size_t numTasks = 8;
+    pool.dispatch(numTasks, [&](size_t taskNdx, size_t) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(taskNdx == 0 ? 20 : 1));
+    });
+    auto times = pool.taskTimes();
+    assert(times.size() == numTasks);
+    for (size_t i = 1; i < numTasks; ++i)
+        assert(times[0] > times[i]);
+}
+
+void TestConcurrentDispatch(ThreadPool& pool)
+{
+    // Several threads outside the pool dispatching at once, each with its own task times
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([&pool, i]() {
+            for (int j = 0; j < 20; ++j)
+                TestAllTasksRunOnce(pool, 100 * (i + 1));
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    TestTaskTimes(pool);
+}
+
+void TestNodes(const ThreadPool::Options& options)
+{
+    ThreadPool pool(4, options);
+    assert(pool.numNodes() >= 1 && pool.numNodes() <= pool.numWorkers());
+
+    // Each node's task must run on one of its own workers.
+    // Repeat it, so the worker that has to run each task is often asleep when it's queued.
+    constexpr int numRepeats = 100;
+    std::vector<std::atomic<int>> runCount(pool.numNodes());
+    for (int i = 0; i < numRepeats; ++i)
+    {
+        pool.forEachNode([&](size_t node) {
+            assert(ThreadPool::currentNode() == node);
+            ++runCount[node];
+        });
+    }
+    for (auto& count : runCount)
+        assert(count == numRepeats);
+
+    TestAllTasksRunOnce(pool, 1000);
+}
+
+int main()
+{
+    ThreadPool singleWorker(1);
+    TestAllTasksRunOnce(singleWorker, 100);
+    TestNestedDispatch(singleWorker);
+
+    ThreadPool pool(4);
+    TestAllTasksRunOnce(pool, 0);
+    TestAllTasksRunOnce(pool, 3);
+    // Workers are persistent, so many dispatches in a row should be cheap
+    for (int i = 0; i < 100; ++i)
+        TestAllTasksRunOnce(pool, 1000);
+    TestNestedDispatch(pool);
+    TestParallelFor(pool);
+    TestTaskTimes(pool);
+    TestConcurrentDispatch(pool);
+
+    ThreadPool::Options pinned;
+    pinned.pinThreads = true;
+    TestNodes(pinned);
+    ThreadPool::Options numa;
+    numa.numaAware = true;
+    TestNodes(numa);
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+//-------------------------------------------------------------------------------------------------
+// Toy path tracer
+//--------------------------------------------------------------------------------------------------
+// Copyright 2018 Carmelo J Fdez-Aguera
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+// NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "../../pathtracer/tileScheduler.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <vector>
+
+using Rect = TileScheduler::Rect;
+
+void TestPassCoversImage(ThreadPool& pool, size_t width, size_t height, size_t tileSize, TileScheduler::Order order)
+{
+    TileScheduler tiles(width, height, tileSize, order);
+    assert(tiles.numTiles() == ((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize));
+
+    // Later passes split tiles based on the timings of earlier ones, so run a few
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        std::vector<std::atomic<int>> visited(width * height);
+        bool ok = tiles.renderPass(pool, [&](const Rect& r, size_t workerNdx) {
+            assert(workerNdx < pool.numWorkers());
+            assert(r.x0 < r.x1 && r.x1 <= width);
+            assert(r.y0 < r.y1 && r.y1 <= height);
+            for (size_t y = r.y0; y < r.y1; ++y)
+                for (size_t x = r.x0; x < r.x1; ++x)
+                    ++visited[x + y * width];
+            // Make some tiles much more expensive than others
+            if (r.x0 == 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(200 * (r.x1 - r.x0) * (r.y1 - r.y0)));
+        });
+        assert(ok);
+        for (auto& v : visited)
+            assert(v == 1);
+    }
+}
+
+void TestHilbertOrder()
+{
+    // On a power of two grid, consecutive tiles along the curve are always neighbours
+    constexpr size_t tileSize = 8;
+    TileScheduler tiles(16 * tileSize, 16 * tileSize, tileSize, TileScheduler::Order::Hilbert);
+    for (size_t i = 1; i < tiles.numTiles(); ++i)
+    {
+        auto& a = tiles.tile(i - 1);
+        auto& b = tiles.tile(i);
+        auto dx = std::abs(int(a.x0) - int(b.x0));
+        auto dy = std::abs(int(a.y0) - int(b.y0));
+        assert(dx + dy == tileSize);
+    }
+}
+
+int main()
+{
+    ThreadPool pool(4);
+    TestPassCoversImage(pool, 64, 48, 16, TileScheduler::Order::Scanline);
+    TestPassCoversImage(pool, 67, 45, 16, TileScheduler::Order::Scanline);
+    TestPassCoversImage(pool, 67, 45, 16, TileScheduler::Order::Hilbert);
+    TestPassCoversImage(pool, 5, 3, 16, TileScheduler::Order::Hilbert);
+
+    ThreadPool singleWorker(1);
+    TestPassCoversImage(singleWorker, 67, 45, 16, TileScheduler::Order::Scanline);
+
+    TestHilbertOrder();
+    return 0;
+}
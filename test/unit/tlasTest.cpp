@@ -17,7 +17,13 @@
 // NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
 // DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
 #include "../../pathtracer/collision/TLAS.h"
+#include "../../pathtracer/math/random.h"
 
 using namespace math;
 
@@ -37,9 +43,149 @@ void TestEmptyTLAS()
     assert(!anyHit);
 }
 
+void TestOcclusion()
+{
+    // Unit quad on the XY plane, facing both ways
+    std::vector<Vec3f> vertices = { {-1, -1, 0}, {1, -1, 0}, {1, 1, 0}, {-1, 1, 0} };
+    std::vector<uint32_t> indices = { 0, 1, 2, 0, 2, 3, 0, 2, 1, 0, 3, 2 };
+    std::vector<BLAS> blas;
+    blas.emplace_back(vertices.data(), indices.data(), uint32_t(indices.size() / 3));
+
+    // A row of quads along x, two units apart
+    std::vector<TLAS::Instance> instances;
+    for (int i = 0; i < 4; ++i)
+    {
+        Matrix34f pose = Matrix34f::identity();
+        pose.position() = Vec3f(2.f * i, 0.f, 0.f);
+        instances.push_back({ pose, 0 });
+    }
+
+    TLAS tlas;
+    tlas.build(std::move(blas), std::move(instances));
+
+    // Rays along z, across the row of quads, from both sides
+    int numHits = 0;
+    for (int i = 0; i < 40; ++i)
+    {
+        float x = -2.f + 0.25f * i;
+        for (float dir : { -1.f, 1.f })
+        {
+            const Ray r({ x, 0.5f, -5 * dir }, { 0, 0, dir });
+            HitRecord hit;
+            bool closestHit = tlas.closestHit(r, 100.f, hit);
+            assert(tlas.anyHit(r, 100.f) == closestHit);
+            if (closestHit)
+            {
+                ++numHits;
+                // Each quad is an instance, and rays from each side see a different pair of its triangles.
+                // Rays through the border of two quads may hit either of them, but never slip between them
+                assert(std::abs(hit.p.x() - 2.f * hit.instanceId) <= 1.f);
+                assert((hit.primitiveId < 2) == (dir < 0));
+                // Occluders beyond tMax don't count
+                assert(!tlas.anyHit(r, hit.t - 0.1f));
+            }
+        }
+    }
+    assert(numHits > 0);
+
+    // Packets of rays must find the same hits as single rays
+    for (int i = 0; i < 5; ++i)
+    {
+        Ray rays[CWBVH::kPacketSize];
+        for (int lane = 0; lane < int(CWBVH::kPacketSize); ++lane)
+            rays[lane] = Ray({ -2.f + 2.f * i + 0.25f * lane, 0.5f, -5.f }, normalize(Vec3f( 0.1f * lane, 0.f, 1.f )));
+
+        HitRecord hits[CWBVH::kPacketSize];
+        auto hitMask = tlas.closestHit8(rays, 0xff, 100.f, hits);
+        for (int lane = 0; lane < int(CWBVH::kPacketSize); ++lane)
+        {
+            HitRecord hit;
+            bool closestHit = tlas.closestHit(rays[lane], 100.f, hit);
+            assert(closestHit == bool(hitMask & (1 << lane)));
+            assert(!closestHit || std::abs(hit.t - hits[lane].t) < 1e-5f);
+            assert(!closestHit || (hit.instanceId == hits[lane].instanceId && hit.primitiveId == hits[lane].primitiveId));
+        }
+    }
+}
+
+// Unit quad facing +z, shared by all instances
+std::vector<BLAS> quadBlas()
+{
+    std::vector<Vec3f> vertices = { {-1, -1, 0}, {1, -1, 0}, {1, 1, 0}, {-1, 1, 0} };
+    std::vector<uint32_t> indices = { 0, 1, 2, 0, 2, 3 };
+    std::vector<BLAS> blas;
+    blas.emplace_back(vertices.data(), indices.data(), uint32_t(indices.size() / 3));
+    return blas;
+}
+
+// Rays along -z must hit the same instances at the same distances in both TLASes
+void CompareTLAS(const TLAS& tlas, const TLAS& reference, RandomGenerator& random)
+{
+    for (int i = 0; i < 500; ++i)
+    {
+        const Ray r({ 40 * random.scalar(), 40 * random.scalar(), 50.f }, { 0, 0, -1 });
+        HitRecord hit, referenceHit;
+        bool closestHit = tlas.closestHit(r, 100.f, hit);
+        assert(closestHit == reference.closestHit(r, 100.f, referenceHit));
+        assert(tlas.anyHit(r, 100.f) == closestHit);
+        assert(!closestHit || (hit.t == referenceHit.t && hit.instanceId == referenceHit.instanceId));
+    }
+}
+
+// Moving instances with updatePoses must be equivalent to building a new TLAS with the new poses
+void TestUpdatePoses()
+{
+    RandomGenerator random;
+    constexpr int numInstances = 2000;
+    std::vector<Matrix34f> poses(numInstances, Matrix34f::identity());
+    for (auto& pose : poses)
+        pose.position() = Vec3f(40 * random.scalar(), 40 * random.scalar(), 40 * random.scalar());
+
+    auto instancesAt = [](const std::vector<Matrix34f>& poses) {
+        std::vector<TLAS::Instance> instances;
+        for (auto& pose : poses)
+            instances.push_back({ pose, 0 });
+        return instances;
+    };
+
+    TLAS tlas;
+    tlas.build(quadBlas(), instancesAt(poses), CWBVH::BuildQuality::SAH);
+
+    // Small motions keep the tree close to a fresh build, so it is only refit
+    for (auto& pose : poses)
+        pose.position() = pose.position() + 0.5f * random.unit_vector();
+    auto start = std::chrono::high_resolution_clock::now();
+    bool rebuilt = tlas.updatePoses(poses);
+    auto refitMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    assert(!rebuilt);
+
+    start = std::chrono::high_resolution_clock::now();
+    TLAS reference;
+    reference.build(quadBlas(), instancesAt(poses), CWBVH::BuildQuality::SAH);
+    auto buildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    CompareTLAS(tlas, reference, random);
+    std::cout << "TLAS update of " << numInstances << " instances. Refit: " << refitMs << " ms, build: " << buildMs << " ms\n";
+
+    // Shuffling all instances ruins the tree, so it gets rebuilt, unless rebuilds are disabled
+    for (auto& pose : poses)
+        pose.position() = Vec3f(40 * random.scalar(), 40 * random.scalar(), 40 * random.scalar());
+    TLAS refitOnly;
+    refitOnly.build(quadBlas(), instancesAt(poses), CWBVH::BuildQuality::SAH);
+    for (auto& pose : poses)
+        pose.position() = Vec3f(40 * random.scalar(), 40 * random.scalar(), 40 * random.scalar());
+    assert(tlas.updatePoses(poses));
+    assert(!refitOnly.updatePoses(poses, std::numeric_limits<float>::infinity()));
+
+    reference.build(quadBlas(), instancesAt(poses), CWBVH::BuildQuality::SAH);
+    CompareTLAS(tlas, reference, random);
+    CompareTLAS(refitOnly, reference, random);
+}
+
 void TestTLAS()
 {
     TestEmptyTLAS();
+    TestOcclusion();
+    TestUpdatePoses();
 }
 
 int main()